@@ -0,0 +1,210 @@
+/*
+ * libdpfp example to benchmark opening and capturing from a growing number
+ * of readers, such as those provided by emulate_reader
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* For 1, 2, 4, ... readers up to all of them, open that many readers and
+ * run each for a while in two phases: streaming frames in
+ * DPFP_MODE_SEND_FINGER, then touch cycles through the interrupt path.
+ * Reports open latency, per-reader and aggregate frame rates, frame
+ * latency percentiles from the device telemetry, and touch cycle times.
+ *
+ * Usage: bench_readers [seconds per phase, default 5] */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <libdpfp/dpfp.h>
+
+#define MAX_READERS	64
+
+struct bench {
+	struct dpfp_dev *dev;
+	pthread_t thread;
+	double duration;
+	unsigned long frames;
+	unsigned long cycles;
+	int errors;
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *stream_thread(void *arg)
+{
+	struct bench *b = arg;
+	struct dpfp_fprint *fp = dpfp_fprint_alloc();
+	double end = now() + b->duration;
+
+	if (dpfp_set_mode(b->dev, DPFP_MODE_SEND_FINGER) < 0) {
+		b->errors++;
+		goto out;
+	}
+
+	while (now() < end) {
+		if (dpfp_capture_fprint(b->dev, fp) < 0)
+			b->errors++;
+		else
+			b->frames++;
+	}
+
+out:
+	dpfp_fprint_free(fp);
+	return NULL;
+}
+
+/* touch, one frame, lift */
+static void *touch_thread(void *arg)
+{
+	struct bench *b = arg;
+	struct dpfp_fprint *fp = dpfp_fprint_alloc();
+	double end = now() + b->duration;
+
+	while (now() < end) {
+		if (dpfp_simple_await_finger_on(b->dev) < 0
+				|| dpfp_set_mode(b->dev, DPFP_MODE_SEND_FINGER) < 0
+				|| dpfp_capture_fprint(b->dev, fp) < 0
+				|| dpfp_simple_await_finger_off(b->dev) < 0) {
+			b->errors++;
+			break;
+		}
+		b->cycles++;
+	}
+
+	dpfp_fprint_free(fp);
+	return NULL;
+}
+
+static void run(struct bench *benches, int num, void *(*fn)(void *))
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		pthread_create(&benches[i].thread, NULL, fn, &benches[i]);
+	for (i = 0; i < num; i++)
+		pthread_join(benches[i].thread, NULL);
+}
+
+static void add_histogram(struct dpfp_histogram *sum,
+	const struct dpfp_histogram *hist)
+{
+	int i;
+
+	sum->count += hist->count;
+	sum->sum += hist->sum;
+	if (hist->max > sum->max)
+		sum->max = hist->max;
+	for (i = 0; i < DPFP_HIST_BUCKETS; i++)
+		sum->buckets[i] += hist->buckets[i];
+}
+
+static int bench(int num, double duration)
+{
+	struct bench benches[MAX_READERS];
+	struct dpfp_open_timing timing;
+	struct dpfp_telemetry tm;
+	struct dpfp_histogram frame;
+	double open_sum = 0, open_max = 0;
+	unsigned long frames = 0, cycles = 0;
+	int errors = 0;
+	int opened;
+	int i;
+
+	memset(benches, 0, sizeof(benches));
+	memset(&frame, 0, sizeof(frame));
+
+	for (opened = 0; opened < num; opened++) {
+		benches[opened].dev = dpfp_open_idx(opened);
+		if (benches[opened].dev == NULL) {
+			fprintf(stderr, "could not open reader %d\n", opened);
+			goto out;
+		}
+		benches[opened].duration = duration;
+
+		dpfp_get_open_timing(benches[opened].dev, &timing);
+		open_sum += timing.total;
+		if (timing.total > open_max)
+			open_max = timing.total;
+	}
+
+	run(benches, num, stream_thread);
+	run(benches, num, touch_thread);
+
+	for (i = 0; i < num; i++) {
+		frames += benches[i].frames;
+		cycles += benches[i].cycles;
+		errors += benches[i].errors;
+		dpfp_get_telemetry(benches[i].dev, &tm);
+		add_histogram(&frame, &tm.frame);
+	}
+
+	printf("%7d %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %6d\n", num,
+		open_sum / num, open_max, frames / duration / num,
+		frames / duration,
+		dpfp_histogram_percentile(&frame, 0.5) / 1000.0,
+		dpfp_histogram_percentile(&frame, 0.99) / 1000.0,
+		cycles ? duration * num * 1000 / cycles : 0, errors);
+
+out:
+	for (i = 0; i < opened; i++)
+		dpfp_close(benches[i].dev);
+	return opened == num ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	double duration = argc > 1 ? atof(argv[1]) : 5;
+	int num_readers;
+	int num;
+
+	dpfp_init();
+
+	num_readers = dpfp_get_num_readers();
+	if (num_readers > MAX_READERS)
+		num_readers = MAX_READERS;
+	if (num_readers < 1) {
+		fprintf(stderr, "no readers found\n");
+		return 1;
+	}
+
+	printf("%7s %8s %8s %8s %8s %8s %8s %8s %6s\n", "readers", "open ms",
+		"max ms", "fps/rdr", "fps", "p50 ms", "p99 ms", "touch ms",
+		"errors");
+	for (num = 1; ; num *= 2) {
+		if (num > num_readers)
+			num = num_readers;
+		if (bench(num, duration) < 0)
+			break;
+		if (num == num_readers)
+			break;
+	}
+
+	dpfp_exit();
+	return 0;
+}
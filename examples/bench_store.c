@@ -0,0 +1,207 @@
+/*
+ * libdpfp example to benchmark writing frames into a frame store and
+ * reading them back
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Streams frames in DPFP_MODE_SEND_FINGER into a store in three phases:
+ * dpfp_store_capture (the transfer lands in the store), dpfp_capture_fprint
+ * plus dpfp_store_append (one copy per frame), then every frame read back
+ * through dpfp_store_get_frame. Reports the time taken and the frame rate
+ * of each phase.
+ *
+ * To take the sensor frame rate out of the picture, run it against
+ * emulate_reader -r 0, or replay a session recorded with
+ * dpfp_open_idx_record at full speed with -p.
+ *
+ * Usage: bench_store [-n frames, default 500] [-p session] [store file,
+ *                    default bench.store] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <libdpfp/dpfp.h>
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void report(const char *phase, unsigned int frames, double elapsed)
+{
+	printf("%-10s %6u frames %9.1f ms %10.1f fps\n", phase, frames,
+		elapsed * 1000, elapsed > 0 ? frames / elapsed : 0);
+}
+
+static int bench_capture(struct dpfp_dev *dev, const char *filename,
+	unsigned int num)
+{
+	struct dpfp_store *store;
+	unsigned int i;
+	double start;
+	int r = 0;
+
+	store = dpfp_store_create(filename, num);
+	if (store == NULL) {
+		perror("dpfp_store_create");
+		return -1;
+	}
+
+	start = now();
+	for (i = 0; i < num; i++) {
+		r = dpfp_store_capture(store, dev, 0, 1000);
+		if (r < 0) {
+			fprintf(stderr, "capture %u failed (%d)\n", i, r);
+			break;
+		}
+	}
+	report("capture", i, now() - start);
+
+	dpfp_store_close(store);
+	return r;
+}
+
+static int bench_append(struct dpfp_dev *dev, const char *filename,
+	unsigned int num)
+{
+	struct dpfp_fprint *fp = dpfp_fprint_alloc();
+	struct dpfp_store *store;
+	unsigned int i;
+	double start;
+	int r = 0;
+
+	store = dpfp_store_create(filename, num);
+	if (store == NULL) {
+		perror("dpfp_store_create");
+		dpfp_fprint_free(fp);
+		return -1;
+	}
+
+	start = now();
+	for (i = 0; i < num; i++) {
+		r = dpfp_capture_fprint(dev, fp);
+		if (r == 0) {
+			fp->seq = i;
+			r = dpfp_store_append(store, fp, 0);
+		}
+		if (r < 0) {
+			fprintf(stderr, "append %u failed (%d)\n", i, r);
+			break;
+		}
+	}
+	report("append", i, now() - start);
+
+	dpfp_store_close(store);
+	dpfp_fprint_free(fp);
+	return r;
+}
+
+/* Touch one byte per row of every frame, so that each frame actually gets
+ * paged in */
+static volatile unsigned char sink;
+
+static int bench_read(const char *filename)
+{
+	struct dpfp_store *store;
+	struct dpfp_fprint view;
+	unsigned int count, i;
+	size_t off;
+	double start;
+
+	store = dpfp_store_open(filename);
+	if (store == NULL) {
+		perror("dpfp_store_open");
+		return -1;
+	}
+
+	count = dpfp_store_get_count(store);
+	start = now();
+	for (i = 0; i < count; i++) {
+		if (dpfp_store_get_frame(store, i, &view, NULL) < 0) {
+			fprintf(stderr, "frame %u unreadable\n", i);
+			break;
+		}
+		for (off = 0; off < view.data_size; off += DPFP_IMG_WIDTH)
+			sink += view.data[off];
+	}
+	report("read", i, now() - start);
+
+	dpfp_store_close(store);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *session = NULL;
+	const char *filename;
+	struct dpfp_dev *dev;
+	unsigned int num = 500;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:p:")) != -1) {
+		switch (c) {
+		case 'n':
+			num = atoi(optarg);
+			break;
+		case 'p':
+			session = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n frames] [-p session] "
+				"[store file]\n", argv[0]);
+			return 1;
+		}
+	}
+	filename = optind < argc ? argv[optind] : "bench.store";
+	if (num == 0) {
+		fprintf(stderr, "need at least one frame\n");
+		return 1;
+	}
+
+	dpfp_init();
+
+	if (session)
+		dev = dpfp_open_replay(session, DPFP_REPLAY_FAST, 0);
+	else
+		dev = dpfp_open();
+	if (dev == NULL) {
+		fprintf(stderr, "could not open reader\n");
+		return 1;
+	}
+
+	if (dpfp_set_mode(dev, DPFP_MODE_SEND_FINGER) < 0) {
+		fprintf(stderr, "could not enter streaming mode\n");
+		dpfp_close(dev);
+		return 1;
+	}
+
+	if (bench_capture(dev, filename, num) == 0)
+		bench_append(dev, filename, num);
+	bench_read(filename);
+
+	dpfp_set_mode(dev, DPFP_MODE_INIT);
+	dpfp_close(dev);
+	dpfp_exit();
+	unlink(filename);
+	return 0;
+}
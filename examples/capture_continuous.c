@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
 
 #include <libdpfp/dpfp.h>
 #include <X11/Xlib.h>
@@ -39,6 +40,7 @@ int ccd_mode = 0;
 int adaptor = -1;
 struct dpfp_dev *dev;
 struct dpfp_fprint *fp, *fp_base;
+struct dpfp_continuous *cont;
 
 unsigned char *framebuffer;
 Display *display = NULL;
@@ -63,6 +65,10 @@ int prepare_device()
 	fp = dpfp_fprint_alloc();
 	fp_base = dpfp_fprint_alloc();
 
+	/* lets us sleep on the finger-on interrupt, see wait_for_finger */
+	if (dpfp_irq_start(dev) < 0)
+		fprintf(stderr, "no interrupt listener, polling while idle\n");
+
 	return 0;
 }
 
@@ -144,6 +150,8 @@ void QueryXv()
 }
 
 void cleanup() {
+	if (cont)
+		dpfp_continuous_stop(cont);
 	dpfp_close(dev);
 
 	if ((void *) window != NULL)
@@ -156,15 +164,24 @@ void cleanup() {
 
 int get_frame()
 {
-	if (dpfp_capture_fprint(dev, fp) < 0) {
+	int r;
+
+	if (ccd_mode || cont == NULL)
+		r = dpfp_capture_fprint(dev, fp);
+	else
+		/* a short timeout so that keys are still handled while the
+		 * sensor is throttled, or asleep without a listener */
+		r = dpfp_continuous_next(cont, fp, 100);
+	if (r == -ETIMEDOUT)
+		return 1;
+	if (r < 0) {
+		errno = -r;
 		perror("simple_get_fingerprint");
 		return 1;
 	}
 
 	if (enhanced_mode) {
-		dpfp_fprint_subtract(fp, fp_base);
-		dpfp_fprint_flip_v(fp);
-		dpfp_fprint_flip_h(fp);
+		dpfp_fprint_rotate_subtract(fp, fp, fp_base);
 	}
 
 	grey2yuy2 (fp->data, framebuffer, fp->data_size);
@@ -178,11 +195,46 @@ int get_frame()
 	return 0;
 }
 
+/* Whether the sensor is asleep waiting for a finger, and there is a
+ * listener to wait on */
+int sensor_asleep()
+{
+	return cont != NULL && dpfp_irq_get_fd(dev) >= 0
+		&& dpfp_continuous_get_state(cont) == DPFP_DUTY_ASLEEP;
+}
+
+/* Block until there is an X event or an interrupt. Returns 1 if an
+ * interrupt arrived, which may be the finger-on one. */
+int wait_for_finger()
+{
+	struct pollfd fds[2];
+
+	/* Xlib may already have read events off the connection */
+	if (XPending(display) > 0)
+		return 0;
+
+	fds[0].fd = connection;
+	fds[0].events = POLLIN;
+	fds[1].fd = dpfp_irq_get_fd(dev);
+	fds[1].events = POLLIN;
+	if (poll(fds, 2, -1) < 0 || !(fds[1].revents & POLLIN))
+		return 0;
+
+	/* the session reads the interrupts from the listener itself, this
+	 * just empties the pipe */
+	dpfp_irq_handle_events(dev);
+	return 1;
+}
+
 void change_mode()
 {
 	unsigned char mode;
 
+	/* raw CCD frames are read at the full rate */
 	if (ccd_mode == 0) {
+		if (cont)
+			dpfp_continuous_stop(cont);
+		cont = NULL;
 		mode = DPFP_MODE_SHUT_UP;
 		ccd_mode = 1;
 	} else {
@@ -191,6 +243,11 @@ void change_mode()
 	}
 
 	dpfp_set_mode(dev, mode);
+	if (ccd_mode == 0) {
+		cont = dpfp_continuous_start(dev, NULL);
+		if (cont == NULL)
+			perror("continuous_start");
+	}
 	memset(framebuffer, 0, DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT * 2);
 }
 
@@ -251,12 +308,25 @@ int main(void)
 		exit(-1);
 	}
 
+	/* drops to a low frame rate, then to waiting for the finger-on
+	 * interrupt, while the sensor is empty */
+	cont = dpfp_continuous_start(dev, NULL);
+	if (cont == NULL) {
+		perror("continuous_start");
+		cleanup();
+		exit(-1);
+	}
+
 	printf("Press M for CCD mode, E for enhanced mode, Q to quit\n");
 	
 	while (1) { /* event loop */
-		get_frame();
-		display_frames();
-		XFlush(display);
+		/* while the sensor sleeps there are no frames to get until it
+		 * interrupts, so only wake up for that or for a key */
+		if ((!sensor_asleep() || wait_for_finger())
+				&& get_frame() == 0) {
+			display_frames();
+			XFlush(display);
+		}
 
 		while (XPending(display) > 0) {
 			XNextEvent(display, &xev);
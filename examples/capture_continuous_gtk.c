@@ -21,10 +21,14 @@
 
 #include <libdpfp/dpfp.h>
 #include <gtk/gtk.h>
+#include <errno.h>
 #include <string.h>
 
 struct dpfp_dev *dev;
 struct dpfp_fprint *fp;
+struct dpfp_continuous *cont;
+/* draw_frame is only scheduled while there may be frames to get */
+guint idle_id;
 
 int prepare_device()
 {
@@ -38,12 +42,22 @@ int prepare_device()
 
 	fp = dpfp_fprint_alloc();
 
+	/* lets us sleep on the finger-on interrupt, see on_irq */
+	if (dpfp_irq_start(dev) < 0)
+		fprintf(stderr, "no interrupt listener, polling while idle\n");
+
 	return 0;
 }
 
 int get_frame()
 {
-	if (dpfp_capture_fprint(dev, fp) < 0) {
+	/* a short timeout so that the main loop keeps running while the
+	 * sensor is throttled, or asleep without a listener */
+	int r = dpfp_continuous_next(cont, fp, 100);
+	if (r == -ETIMEDOUT)
+		return 1;
+	if (r < 0) {
+		errno = -r;
 		perror("simple_get_fingerprint");
 		return 1;
 	}
@@ -54,16 +68,37 @@ int get_frame()
 gboolean draw_frame (gpointer data)
 {
 	GtkWidget *widget = (GtkWidget *) data;
-	get_frame();
-	gdk_draw_gray_image (widget->window, widget->style->fg_gc[GTK_STATE_NORMAL],
+	if (get_frame() == 0)
+		gdk_draw_gray_image (widget->window,
+			widget->style->fg_gc[GTK_STATE_NORMAL],
 			0, 0, DPFP_IMG_WIDTH, DPFP_IMG_HEIGHT,
 			GDK_RGB_DITHER_NONE, fp->data, DPFP_IMG_WIDTH);
 
+	/* there are no frames until the sensor interrupts; on_irq
+	 * reschedules us then */
+	if (dpfp_irq_get_fd(dev) >= 0
+			&& dpfp_continuous_get_state(cont) == DPFP_DUTY_ASLEEP) {
+		idle_id = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean on_irq(GIOChannel *source, GIOCondition condition,
+	gpointer data)
+{
+	/* the session reads the interrupts from the listener itself, this
+	 * just empties the pipe */
+	dpfp_irq_handle_events(dev);
+	if (idle_id == 0)
+		idle_id = g_idle_add(draw_frame, data);
 	return TRUE;
 }
 
 static void on_destroy(GtkWidget *widget, gpointer data)
 {
+	dpfp_continuous_stop(cont);
 	dpfp_close(dev);
 	gtk_main_quit();
 }
@@ -87,12 +122,18 @@ int main (int argc, char *argv[])
 
 	g_signal_connect(G_OBJECT(window), "destroy", G_CALLBACK(on_destroy), NULL);
 
-	if (dpfp_set_mode(dev, DPFP_MODE_SEND_FINGER) < 0) {
-		perror("set_mode");
+	/* drops to a low frame rate, then to waiting for the finger-on
+	 * interrupt, while the sensor is empty */
+	cont = dpfp_continuous_start(dev, NULL);
+	if (cont == NULL) {
+		perror("continuous_start");
 		return 1;
 	}
 
-	g_idle_add (draw_frame, darea);
+	if (dpfp_irq_get_fd(dev) >= 0)
+		g_io_add_watch(g_io_channel_unix_new(dpfp_irq_get_fd(dev)),
+			G_IO_IN, on_irq, darea);
+	idle_id = g_idle_add (draw_frame, darea);
 	gtk_main ();
 	return 0;
 }
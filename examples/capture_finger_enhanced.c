@@ -32,7 +32,6 @@ int main(void)
 {
 	int result;
 	struct dpfp_dev *dev;
-	struct dpfp_fprint *base_img = dpfp_fprint_alloc();
 	struct dpfp_fprint *fp = dpfp_fprint_alloc();
 	struct dpfp_fprint *mask = dpfp_fprint_alloc();
 	struct dpfp_ffield *direction = dpfp_ffield_alloc();
@@ -49,15 +48,16 @@ int main(void)
 		goto exit;
 	}
 
-	/* Capture base image. We assume the finger is away from the sensor at
-	 * this point... */
-	if (dpfp_set_mode(dev, DPFP_MODE_SEND_FINGER) < 0) {
-		perror("set_mode");
+	/* Let the library maintain the base image and subtract it from every
+	 * frame. Seeding it takes one frame of the empty sensor, so we assume
+	 * the finger is away from the sensor at this point... */
+	if (dpfp_background_enable(dev, DPFP_BG_AUTO_SUBTRACT) < 0) {
+		perror("background_enable");
 		goto exit;
 	}
 
-	if (dpfp_capture_fprint(dev, base_img) < 0) {
-		perror("simple_get_fingerprint");
+	if (dpfp_background_refresh(dev, 0) < 0) {
+		perror("background_refresh");
 		goto exit;
 	}
 
@@ -85,10 +85,9 @@ int main(void)
 	gettimeofday(&tv, NULL);
 	t1 = TV_TO_DOUBLE(tv);
 
-	/* Basic enhancements: subtract base image, flip to correct orientation */
-	dpfp_fprint_subtract(fp, base_img);
-	dpfp_fprint_flip_v(fp);
-	dpfp_fprint_flip_h(fp);
+	/* Basic enhancements: flip to correct orientation. The base image was
+	 * already subtracted during capture. */
+	dpfp_fprint_rotate_subtract(fp, fp, NULL);
 
 	if (dpfp_fprint_write_to_file(fp, "finger.pgm") < 0)
 		perror("write_fingerprint_to_file");
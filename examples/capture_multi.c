@@ -0,0 +1,90 @@
+/*
+ * libdpfp example to stream frames from every attached reader at once and
+ * report per-reader and aggregate frame rates
+ * 
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <libdpfp/dpfp.h>
+
+static void event_cb(struct dpfp_manager *mgr, int reader,
+	enum dpfp_event_type type, struct dpfp_fprint *fp, int status,
+	void *user_data)
+{
+	switch (type) {
+	case DPFP_EVENT_FINGER_ON:
+		printf("reader %d: finger on\n", reader);
+		break;
+	case DPFP_EVENT_FINGER_OFF:
+		printf("reader %d: finger off\n", reader);
+		break;
+	case DPFP_EVENT_ERROR:
+		if (status == -EOVERFLOW)
+			printf("reader %d: events dropped\n", reader);
+		else
+			printf("reader %d: capture error %d\n", reader, status);
+		break;
+	default:
+		break;
+	}
+}
+
+int main(void)
+{
+	struct dpfp_manager *mgr;
+	struct dpfp_reader_stats stats;
+	int num_readers;
+	int i, j;
+
+	dpfp_init();
+
+	mgr = dpfp_manager_open(2, event_cb, NULL);
+	if (mgr == NULL) {
+		perror("manager_open");
+		return 1;
+	}
+
+	num_readers = dpfp_manager_get_num_readers(mgr);
+	for (i = 0; i < num_readers; i++)
+		printf("reader %d: %s\n", i,
+			dpfp_get_name(dpfp_manager_get_dev(mgr, i)));
+
+	if (dpfp_manager_start_capture(mgr, -1) < 0) {
+		perror("start_capture");
+		goto exit;
+	}
+
+	for (i = 0; i < 10; i++) {
+		sleep(1);
+		for (j = 0; j < num_readers; j++) {
+			dpfp_manager_get_stats(mgr, j, &stats);
+			printf("reader %d: %lu frames, %lu errors, %lu dropped, "
+				"%.1f fps\n", j, stats.frames, stats.errors,
+				stats.dropped, stats.fps);
+		}
+		dpfp_manager_get_stats(mgr, -1, &stats);
+		printf("total: %lu frames, %.1f fps\n", stats.frames, stats.fps);
+	}
+
+exit:
+	dpfp_manager_close(mgr);
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * libdpfp example to capture a fingerprint without waiting for the finger-on
+ * interrupt: the sensor streams and finger placement is detected in software
+ * 
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <libdpfp/dpfp.h>
+
+int main(void)
+{
+	struct dpfp_dev *dev;
+	struct dpfp_fprint *fp = dpfp_fprint_alloc();
+	struct dpfp_presence *presence = NULL;
+	struct dpfp_presence_report report;
+	struct dpfp_stable *stable = NULL;
+	struct dpfp_stable_report stable_report;
+	int r;
+
+	dpfp_init();
+
+	dev = dpfp_open();
+	if (dev == NULL) {
+		perror("dev");
+		goto exit;
+	}
+
+	if (dpfp_set_mode(dev, DPFP_MODE_SEND_FINGER) < 0) {
+		perror("set_mode");
+		goto exit;
+	}
+
+	/* The sensor must be empty for the base frame */
+	if (dpfp_capture_fprint(dev, fp) < 0) {
+		perror("capture base");
+		goto exit;
+	}
+
+	presence = dpfp_presence_alloc(fp);
+	if (presence == NULL) {
+		perror("presence_alloc");
+		goto exit;
+	}
+
+	printf("place your finger on the sensor\n");
+
+	if (dpfp_presence_await(dev, presence, fp, 0, &report) < 0) {
+		perror("presence_await");
+		goto exit;
+	}
+
+	printf("finger detected after %lu frames, %.0f%% coverage\n",
+		report.frames, report.coverage * 100);
+	printf("touch to frame latency: at most %.1fms\n", report.latency);
+
+	/* Frames taken while the finger is still going down are smeared */
+	stable = dpfp_stable_alloc();
+	if (stable == NULL) {
+		perror("stable_alloc");
+		goto exit;
+	}
+
+	r = dpfp_stable_await(dev, stable, presence, fp, 0, 0, &stable_report);
+	if (r == -ETIMEDOUT) {
+		printf("finger did not settle within %lu frames\n",
+			stable_report.frames);
+		goto exit;
+	} else if (r < 0) {
+		errno = -r;
+		perror("stable_await");
+		goto exit;
+	}
+
+	printf("finger settled after %.1fms, %lu more frames\n",
+		stable_report.settle_time, stable_report.frames);
+
+	if (dpfp_fprint_write_to_file(fp, "finger.pgm") < 0) {
+		perror("write_fingerprint_to_file");
+		goto exit;
+	}
+
+exit:
+	if (stable)
+		dpfp_stable_free(stable);
+	if (presence)
+		dpfp_presence_free(presence);
+	dpfp_fprint_free(fp);
+	if (dev)
+		dpfp_close(dev);
+	return 0;
+}
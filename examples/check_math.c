@@ -0,0 +1,241 @@
+/*
+ * libdpfp example to check the vector maths against libm
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Runs the dpfp_math functions over random arguments across their domains
+ * and compares every result with libm. Prints the worst error seen for each
+ * function and accuracy tier, and exits non-zero if any of them is above
+ * the bound documented at the top of dpfp_math.c.
+ *
+ * The functions are internal to the library, so this is built straight
+ * from dpfp_math.c rather than linked against libdpfp.
+ *
+ * Usage: check_math [-n arguments per function, default 1000000]
+ *                   [-s random seed, default 1] */
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libdpfp/dpfp.h>
+#include <libdpfp/dpfp_private.h>
+
+static const char *tier_name[] = { "precise", "fast" };
+
+static double *x, *y, *out1, *out2;
+static int n = 1000000;
+static int failed;
+
+static double rnd(double lo, double hi)
+{
+	return lo + (hi - lo) * (rand() / (double) RAND_MAX);
+}
+
+/* Distance between |v| and the next double away from zero */
+static double ulp(double v)
+{
+	v = fabs(v);
+	if (v < DBL_MIN)
+		return DBL_MIN * DBL_EPSILON;
+	return nextafter(v, INFINITY) - v;
+}
+
+static void report(const char *func, enum dpfp_math_accuracy acc,
+	const char *unit, double worst, double bound)
+{
+	int bad = worst > bound;
+
+	printf("%-8s %-8s %10.3g %-20s (bound %.3g)%s\n", func,
+		tier_name[acc], worst, unit, bound, bad ? " FAILED" : "");
+	failed |= bad;
+}
+
+static void check_sincos(enum dpfp_math_accuracy acc)
+{
+	double worst = 0;
+	int i;
+
+	/* mostly small arguments, then the range where the reduction is
+	 * done in SSE2, then the libm fallback beyond it */
+	for (i = 0; i < n; i++)
+		x[i] = i % 3 == 0 ? rnd(-10, 10) : i % 3 == 1 ?
+			rnd(-1e5, 1e5) : rnd(-1.7e6, 1.7e6);
+
+	dpfp_math_sincos(x, out1, out2, n, acc);
+	for (i = 0; i < n; i++) {
+		double s = sin(x[i]);
+		double c = cos(x[i]);
+		double es = fabs(out1[i] - s);
+		double ec = fabs(out2[i] - c);
+
+		if (acc == DPFP_MATH_PRECISE) {
+			es /= ulp(s);
+			ec /= ulp(c);
+		}
+		worst = fmax(worst, fmax(es, ec));
+	}
+
+	if (acc == DPFP_MATH_PRECISE)
+		report("sincos", acc, "ulp", worst, 2);
+	else
+		report("sincos", acc, "absolute", worst, 2e-9);
+}
+
+static void check_atan2(void)
+{
+	double worst = 0;
+	int i;
+
+	/* magnitudes over six decades, with zeroes on both axes */
+	for (i = 0; i < n; i++) {
+		x[i] = rnd(-1, 1) * pow(10, rnd(-3, 3));
+		y[i] = rnd(-1, 1) * pow(10, rnd(-3, 3));
+		if (i % 1000 == 0)
+			y[i] = 0;
+		if (i % 1001 == 0)
+			x[i] = 0;
+	}
+
+	dpfp_math_atan2(y, x, out1, n);
+	for (i = 0; i < n; i++) {
+		double r = atan2(y[i], x[i]);
+
+		worst = fmax(worst, fabs(out1[i] - r) / ulp(r));
+	}
+
+	report("atan2", DPFP_MATH_PRECISE, "ulp", worst, 2);
+}
+
+static void check_exp(enum dpfp_math_accuracy acc)
+{
+	double worst = 0;
+	int i;
+
+	/* the whole range with a normal result, and the small arguments the
+	 * image processing actually uses */
+	for (i = 0; i < n; i++)
+		x[i] = i % 2 ? rnd(-708, 709.78) : rnd(-20, 20);
+
+	dpfp_math_exp(x, out1, n, acc);
+	for (i = 0; i < n; i++) {
+		double r = exp(x[i]);
+		double e = fabs(out1[i] - r);
+
+		worst = fmax(worst, acc == DPFP_MATH_PRECISE ?
+			e / ulp(r) : e / r);
+	}
+
+	if (acc == DPFP_MATH_PRECISE)
+		report("exp", acc, "ulp", worst, 3);
+	else
+		report("exp", acc, "relative", worst, 8e-9);
+}
+
+static void check_pow(enum dpfp_math_accuracy acc)
+{
+	static const double exponents[] = { 0.2, 0.3, 0.5, 2.0, 7.3 };
+	double worst = 0;
+	unsigned int k;
+	int i;
+
+	for (k = 0; k < sizeof(exponents) / sizeof(exponents[0]); k++) {
+		double e = exponents[k];
+
+		for (i = 0; i < n; i++)
+			x[i] = i % 2 ? rnd(0, 3e5) : pow(10, rnd(-300, 300));
+		x[0] = 0;
+
+		dpfp_math_pow(x, e, out1, n, acc);
+		for (i = 0; i < n; i++) {
+			double r = pow(x[i], e);
+			double err = fabs(out1[i] - r);
+
+			if (r == 0) {
+				if (out1[i] != 0) {
+					printf("pow(0, %g) is %g\n", e,
+						out1[i]);
+					failed = 1;
+				}
+				continue;
+			}
+			/* overflow and underflow are outside the domain */
+			if (r > 1e300 || r < 1e-300)
+				continue;
+
+			err /= acc == DPFP_MATH_PRECISE ? ulp(r) : r;
+			worst = fmax(worst, err / (1 + fabs(e * log(x[i]))));
+		}
+	}
+
+	if (acc == DPFP_MATH_PRECISE)
+		report("pow", acc, "ulp / (1 + |y ln x|)", worst, 3);
+	else
+		report("pow", acc, "rel / (1 + |y ln x|)", worst, 6e-9);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seed = 1;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n arguments] [-s seed]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (n < 2) {
+		fprintf(stderr, "need at least two arguments\n");
+		return 1;
+	}
+
+	x = malloc(n * sizeof(*x));
+	y = malloc(n * sizeof(*y));
+	out1 = malloc(n * sizeof(*out1));
+	out2 = malloc(n * sizeof(*out2));
+	if (!x || !y || !out1 || !out2) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	srand(seed);
+	check_sincos(DPFP_MATH_PRECISE);
+	check_sincos(DPFP_MATH_FAST);
+	check_atan2();
+	check_exp(DPFP_MATH_PRECISE);
+	check_exp(DPFP_MATH_FAST);
+	check_pow(DPFP_MATH_PRECISE);
+	check_pow(DPFP_MATH_FAST);
+
+	free(x);
+	free(y);
+	free(out1);
+	free(out2);
+	return failed;
+}
@@ -0,0 +1,854 @@
+/*
+ * Emulated fingerprint readers for load testing, built on the Linux
+ * raw-gadget interface
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Each emulated reader is a USB gadget on its own dummy_hcd UDC, and shows
+ * up on the host like a real URU4000B: same descriptors, same hwstat,
+ * mode, firmware, encryption challenge and auth challenge-response
+ * requests, interrupts on EP 0x81 and frames on EP 0x82. libdpfp, or
+ * anything else, can open it like the real thing. To run 8 readers:
+ *
+ *   modprobe dummy_hcd num=8
+ *   modprobe raw_gadget
+ *   ./emulate_reader -n 8 -r 30
+ *
+ * Options:
+ *   -n num     number of readers (default 1), reader i on dummy_udc.i
+ *   -d id      only emulate the reader type with this index in the table
+ *              below; by default the readers cycle through all of them
+ *   -r fps     frame rate in DPFP_MODE_SEND_FINGER, 0 for as fast as the
+ *              host reads (default 0)
+ *   -s source  frame source: "ridges" (default, a synthetic finger),
+ *              "empty" (an empty sensor) or a PGM file, such as those
+ *              written by dpfp_fprint_write_to_file
+ *   -t ms      finger-on interrupt this long after DPFP_MODE_AWAIT_FINGER_ON
+ *              (default 500)
+ *   -l ms      finger-off interrupt this long after DPFP_MODE_AWAIT_FINGER_OFF
+ *              (default 200)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __has_include
+#if __has_include(<linux/usb/raw_gadget.h>)
+#define HAVE_RAW_GADGET 1
+#endif
+#endif
+
+#ifdef HAVE_RAW_GADGET
+
+#include <endian.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+#include <openssl/aes.h>
+
+/* The device side of the protocol in libdpfp/dpfp.h and dpfp_private.h.
+ * dpfp.h itself can't be used here, as libusb's usb.h clashes with the
+ * kernel's USB headers. */
+#define MODE_INIT		0x00
+#define MODE_AWAIT_FINGER_ON	0x10
+#define MODE_AWAIT_FINGER_OFF	0x12
+#define MODE_SEND_FINGER	0x20
+#define IRQDATA_SCANPWR_ON	0x56aa
+#define IRQDATA_FINGER_ON	0x0101
+#define IRQDATA_FINGER_OFF	0x0200
+#define IRQ_LENGTH		64
+#define IMG_WIDTH		384
+
+#define USB_RQ			0x04
+#define FW_READ_RQ		0x0c
+#define HWSTAT_CONTROL		0x07
+#define MODE_CONTROL		0x4e
+#define CHALLENGE_CONTROL	0x33
+#define RESPONSE_CONTROL	0x34
+#define AUTH_CHALLENGE		0x2010
+#define AUTH_RESPONSE		0x2000
+#define DATABLK1_SIZE		0x10000
+#define DATABLK2_SIZE		0xb340
+#define FRAME_SIZE		(DATABLK1_SIZE + DATABLK2_SIZE)
+#define FRAME_LINES		((FRAME_SIZE - 64) / IMG_WIDTH)
+
+#define EP_INTR			0x81
+#define EP_DATA			0x82
+#define FW_SIZE			0x1000
+
+#define STRING_MANUFACTURER	1
+#define STRING_PRODUCT		2
+
+struct reader_type {
+	uint16_t vid;
+	uint16_t pid;
+	/* needs auth before it will power up */
+	int auth_power_up;
+	const char *name;
+};
+
+/* The readers libdpfp knows about */
+static const struct reader_type reader_types[] = {
+	{ 0x045e, 0x00bb, 0, "Microsoft Keyboard with Fingerprint reader" },
+	{ 0x045e, 0x00bc, 0,
+		"Microsoft Wireless IntelliMouse with Fingerprint reader" },
+	{ 0x045e, 0x00bd, 0, "Microsoft Fingerprint reader (standalone)" },
+	{ 0x045e, 0x00ca, 1, "Microsoft Fingerprint reader v2 (standalone)" },
+	{ 0x05ba, 0x0007, 0, "Digital Persona U.are.U 4000" },
+	{ 0x05ba, 0x000a, 0, "Digital Persona U.are.U 4000B" },
+};
+
+#define NUM_READER_TYPES (sizeof(reader_types) / sizeof(*reader_types))
+
+/* The key libdpfp answers auth challenges with */
+static const unsigned char crkey[] = {
+	0x79, 0xac, 0x91, 0x79, 0x5c, 0xa1, 0x47, 0x8e,
+	0x98, 0xe0, 0x0f, 0x3c, 0x59, 0x8f, 0x5f, 0x4b,
+};
+
+/* what the sensor answers to encryption challenges, before the seed */
+#define SENSOR_KEY	0x5a3c9e71
+
+static AES_KEY aeskey;
+
+static int frame_rate;
+static int touch_ms = 500;
+static int lift_ms = 200;
+static const char *source = "ridges";
+/* a frame from a PGM file, if that is the source */
+static unsigned char *file_image;
+
+struct reader {
+	int idx;
+	int fd;
+	const struct reader_type *type;
+	pthread_t ep0_thread;
+	pthread_t irq_thread;
+	pthread_t data_thread;
+	int ep_intr;
+	int ep_data;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int configured;
+	unsigned char hwstat;
+	unsigned char mode;
+	int authed;
+	unsigned char auth_challenge[16];
+	uint32_t seed;
+	unsigned char fw[FW_SIZE];
+	/* next interrupt to send, and when */
+	uint16_t irq;
+	double irq_due;
+
+	unsigned long frames;
+};
+
+struct ep0_io {
+	struct usb_raw_ep_io inner;
+	unsigned char data[256];
+};
+
+struct ctrl_event {
+	struct usb_raw_event inner;
+	struct usb_ctrlrequest ctrl;
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void sleep_until(double t)
+{
+	double d = t - now();
+	struct timespec ts;
+
+	if (d <= 0)
+		return;
+	ts.tv_sec = d;
+	ts.tv_nsec = (d - ts.tv_sec) * 1000000000;
+	nanosleep(&ts, NULL);
+}
+
+/* Descriptors */
+
+static struct usb_device_descriptor device_desc(struct reader *rd)
+{
+	struct usb_device_descriptor desc;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.bLength = USB_DT_DEVICE_SIZE;
+	desc.bDescriptorType = USB_DT_DEVICE;
+	desc.bcdUSB = htole16(0x0200);
+	desc.bMaxPacketSize0 = 64;
+	desc.idVendor = htole16(rd->type->vid);
+	desc.idProduct = htole16(rd->type->pid);
+	desc.bcdDevice = htole16(0x0100);
+	desc.iManufacturer = STRING_MANUFACTURER;
+	desc.iProduct = STRING_PRODUCT;
+	desc.bNumConfigurations = 1;
+	return desc;
+}
+
+static struct usb_endpoint_descriptor ep_desc(int addr)
+{
+	struct usb_endpoint_descriptor desc;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.bLength = USB_DT_ENDPOINT_SIZE;
+	desc.bDescriptorType = USB_DT_ENDPOINT;
+	desc.bEndpointAddress = addr;
+	if (addr == EP_INTR) {
+		desc.bmAttributes = USB_ENDPOINT_XFER_INT;
+		desc.wMaxPacketSize = htole16(64);
+		desc.bInterval = 4;
+	} else {
+		desc.bmAttributes = USB_ENDPOINT_XFER_BULK;
+		desc.wMaxPacketSize = htole16(512);
+	}
+	return desc;
+}
+
+static int config_desc(unsigned char *buf)
+{
+	struct usb_config_descriptor config;
+	struct usb_interface_descriptor iface;
+	struct usb_endpoint_descriptor intr = ep_desc(EP_INTR);
+	struct usb_endpoint_descriptor data = ep_desc(EP_DATA);
+	int len = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE
+		+ 2 * USB_DT_ENDPOINT_SIZE;
+
+	memset(&config, 0, sizeof(config));
+	config.bLength = USB_DT_CONFIG_SIZE;
+	config.bDescriptorType = USB_DT_CONFIG;
+	config.wTotalLength = htole16(len);
+	config.bNumInterfaces = 1;
+	config.bConfigurationValue = 1;
+	config.bmAttributes = USB_CONFIG_ATT_ONE;
+	config.bMaxPower = 50;
+
+	/* the vendor-specific interface libdpfp looks for */
+	memset(&iface, 0, sizeof(iface));
+	iface.bLength = USB_DT_INTERFACE_SIZE;
+	iface.bDescriptorType = USB_DT_INTERFACE;
+	iface.bNumEndpoints = 2;
+	iface.bInterfaceClass = 255;
+	iface.bInterfaceSubClass = 255;
+	iface.bInterfaceProtocol = 255;
+
+	memcpy(buf, &config, USB_DT_CONFIG_SIZE);
+	buf += USB_DT_CONFIG_SIZE;
+	memcpy(buf, &iface, USB_DT_INTERFACE_SIZE);
+	buf += USB_DT_INTERFACE_SIZE;
+	memcpy(buf, &intr, USB_DT_ENDPOINT_SIZE);
+	buf += USB_DT_ENDPOINT_SIZE;
+	memcpy(buf, &data, USB_DT_ENDPOINT_SIZE);
+	return len;
+}
+
+static int string_desc(struct reader *rd, int idx, unsigned char *buf)
+{
+	const char *str;
+	int i;
+
+	if (idx == 0) {
+		buf[0] = 4;
+		buf[1] = USB_DT_STRING;
+		buf[2] = 0x09;
+		buf[3] = 0x04;
+		return 4;
+	}
+
+	if (idx == STRING_MANUFACTURER)
+		str = "libdpfp emulator";
+	else if (idx == STRING_PRODUCT)
+		str = rd->type->name;
+	else
+		return -1;
+
+	/* ASCII to UTF-16LE */
+	for (i = 0; str[i] && i < 126; i++) {
+		buf[2 + i * 2] = str[i];
+		buf[3 + i * 2] = 0;
+	}
+	buf[0] = 2 + i * 2;
+	buf[1] = USB_DT_STRING;
+	return buf[0];
+}
+
+static int get_descriptor(struct reader *rd, struct usb_ctrlrequest *ctrl,
+	unsigned char *buf)
+{
+	int value = le16toh(ctrl->wValue);
+	struct usb_device_descriptor dev;
+	struct usb_qualifier_descriptor qual;
+
+	switch (value >> 8) {
+	case USB_DT_DEVICE:
+		dev = device_desc(rd);
+		memcpy(buf, &dev, USB_DT_DEVICE_SIZE);
+		return USB_DT_DEVICE_SIZE;
+	case USB_DT_DEVICE_QUALIFIER:
+		memset(&qual, 0, sizeof(qual));
+		qual.bLength = sizeof(qual);
+		qual.bDescriptorType = USB_DT_DEVICE_QUALIFIER;
+		qual.bcdUSB = htole16(0x0200);
+		qual.bMaxPacketSize0 = 64;
+		qual.bNumConfigurations = 1;
+		memcpy(buf, &qual, sizeof(qual));
+		return sizeof(qual);
+	case USB_DT_CONFIG:
+		return config_desc(buf);
+	case USB_DT_STRING:
+		return string_desc(rd, value & 0xff, buf);
+	default:
+		return -1;
+	}
+}
+
+/* Sensor state */
+
+/* Called with the lock held */
+static void queue_irq(struct reader *rd, uint16_t type, int delay_ms)
+{
+	rd->irq = type;
+	rd->irq_due = now() + delay_ms / 1000.0;
+	pthread_cond_broadcast(&rd->cond);
+}
+
+/* Called with the lock held */
+static void set_hwstat(struct reader *rd, unsigned char val)
+{
+	int was_off = rd->hwstat & 0x80;
+
+	/* the v2 reader ignores power-up until it has been authenticated */
+	if (!(val & 0x80) && rd->type->auth_power_up && !rd->authed)
+		val |= 0x80;
+
+	rd->hwstat = val;
+	if (was_off && !(val & 0x80)) {
+		rd->mode = MODE_INIT;
+		queue_irq(rd, IRQDATA_SCANPWR_ON, 0);
+	} else if (val & 0x80) {
+		rd->authed = 0;
+		rd->irq = 0;
+	}
+}
+
+/* Called with the lock held */
+static void set_mode(struct reader *rd, unsigned char mode)
+{
+	rd->mode = mode;
+	if (mode == MODE_AWAIT_FINGER_ON)
+		queue_irq(rd, IRQDATA_FINGER_ON, touch_ms);
+	else if (mode == MODE_AWAIT_FINGER_OFF)
+		queue_irq(rd, IRQDATA_FINGER_OFF, lift_ms);
+	else if (rd->irq != IRQDATA_SCANPWR_ON)
+		rd->irq = 0;
+	pthread_cond_broadcast(&rd->cond);
+}
+
+/* Vendor requests from the host. Returns the length of the reply for IN
+ * requests, 0 for accepted OUT requests, or -1 to stall. */
+static int vendor_request(struct reader *rd, struct usb_ctrlrequest *ctrl,
+	unsigned char *buf)
+{
+	int value = le16toh(ctrl->wValue);
+	int len = le16toh(ctrl->wLength);
+	int in = ctrl->bRequestType & USB_DIR_IN;
+	unsigned char response[16];
+	uint32_t key;
+	int r = 0;
+
+	pthread_mutex_lock(&rd->lock);
+	if (in && ctrl->bRequest == FW_READ_RQ) {
+		/* firmware memory, the encryption byte included */
+		if (value + len > FW_SIZE)
+			r = -1;
+		else
+			memcpy(buf, rd->fw + value, r = len);
+	} else if (ctrl->bRequest != USB_RQ) {
+		r = -1;
+	} else if (in) {
+		switch (value) {
+		case HWSTAT_CONTROL:
+			buf[0] = rd->hwstat;
+			r = 1;
+			break;
+		case RESPONSE_CONTROL:
+			key = SENSOR_KEY ^ rd->seed;
+			buf[0] = key;
+			buf[1] = key >> 8;
+			buf[2] = key >> 16;
+			buf[3] = key >> 24;
+			r = 4;
+			break;
+		case AUTH_CHALLENGE:
+			for (r = 0; r < 16; r++)
+				rd->auth_challenge[r] = rand();
+			memcpy(buf, rd->auth_challenge, 16);
+			break;
+		default:
+			r = -1;
+		}
+	} else {
+		switch (value) {
+		case HWSTAT_CONTROL:
+			set_hwstat(rd, buf[0]);
+			break;
+		case MODE_CONTROL:
+			set_mode(rd, buf[0]);
+			break;
+		case CHALLENGE_CONTROL:
+			rd->seed = buf[1] | buf[2] << 8 | buf[3] << 16
+				| (uint32_t) buf[4] << 24;
+			break;
+		case AUTH_RESPONSE:
+			AES_encrypt(rd->auth_challenge, response, &aeskey);
+			rd->authed = len == 16 && memcmp(buf, response, 16) == 0;
+			if (!rd->authed)
+				fprintf(stderr, "reader %d: bad auth response\n",
+					rd->idx);
+			break;
+		default:
+			/* firmware upload */
+			if (value + len > FW_SIZE)
+				r = -1;
+			else
+				memcpy(rd->fw + value, buf, len);
+		}
+	}
+	pthread_mutex_unlock(&rd->lock);
+
+	return r;
+}
+
+/* Endpoints */
+
+static void *irq_thread(void *arg)
+{
+	struct reader *rd = arg;
+	struct {
+		struct usb_raw_ep_io inner;
+		unsigned char data[IRQ_LENGTH];
+	} io;
+	uint16_t type;
+	struct timespec ts;
+	double due;
+
+	while (1) {
+		pthread_mutex_lock(&rd->lock);
+		while (rd->irq == 0 || rd->irq_due > now()) {
+			if (rd->irq == 0) {
+				pthread_cond_wait(&rd->cond, &rd->lock);
+				continue;
+			}
+			due = rd->irq_due;
+			ts.tv_sec = due;
+			ts.tv_nsec = (due - ts.tv_sec) * 1000000000;
+			pthread_cond_timedwait(&rd->cond, &rd->lock, &ts);
+		}
+		type = rd->irq;
+		rd->irq = 0;
+		pthread_mutex_unlock(&rd->lock);
+
+		memset(&io, 0, sizeof(io));
+		io.inner.ep = rd->ep_intr;
+		io.inner.length = IRQ_LENGTH;
+		io.data[0] = type >> 8;
+		io.data[1] = type;
+		if (ioctl(rd->fd, USB_RAW_IOCTL_EP_WRITE, &io) < 0) {
+			perror("irq write");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* A synthetic finger: concentric ridges around a centre that moves a
+ * little from frame to frame */
+static void make_ridges(unsigned char *img, unsigned long seq)
+{
+	double cx = IMG_WIDTH / 2 + 10 * sin(seq * 0.1);
+	double cy = FRAME_LINES / 2 + 10 * cos(seq * 0.13);
+	int x, y;
+
+	for (y = 0; y < FRAME_LINES; y++)
+		for (x = 0; x < IMG_WIDTH; x++) {
+			double dx = (x - cx) / 1.3, dy = y - cy;
+			double r = sqrt(dx * dx + dy * dy);
+			int v = r < 140 ? 128 + 100 * sin(r * 0.7) : 200;
+
+			img[y * IMG_WIDTH + x] = v + (rand() & 7);
+		}
+}
+
+static void make_frame(unsigned char *frame, unsigned long seq)
+{
+	unsigned char *img = frame + 64;
+	int i;
+
+	memset(frame, 0, 64);
+	frame[4] = FRAME_LINES & 0xff;
+	frame[5] = FRAME_LINES >> 8;
+	/* two plain blocks; a block covers at most 255 lines */
+	frame[0x10] = 0;
+	frame[0x11] = 200;
+	frame[0x12] = 0;
+	frame[0x13] = FRAME_LINES - 200;
+
+	if (file_image) {
+		memcpy(img, file_image, FRAME_LINES * IMG_WIDTH);
+	} else if (strcmp(source, "empty") == 0) {
+		for (i = 0; i < FRAME_LINES * IMG_WIDTH; i++)
+			img[i] = 200 + (rand() & 7);
+	} else {
+		make_ridges(img, seq);
+	}
+}
+
+static void *data_thread(void *arg)
+{
+	struct reader *rd = arg;
+	struct usb_raw_ep_io *io;
+	unsigned char *frame;
+	double next = now();
+
+	io = malloc(sizeof(*io) + FRAME_SIZE);
+	frame = malloc(FRAME_SIZE);
+	if (io == NULL || frame == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	while (1) {
+		pthread_mutex_lock(&rd->lock);
+		while (rd->mode != MODE_SEND_FINGER
+				|| (rd->hwstat & 0x80)) {
+			pthread_cond_wait(&rd->cond, &rd->lock);
+			next = now();
+		}
+		pthread_mutex_unlock(&rd->lock);
+
+		if (frame_rate > 0) {
+			sleep_until(next);
+			next += 1.0 / frame_rate;
+		}
+
+		make_frame(frame, rd->frames);
+
+		/* the host reads a frame as two transfers */
+		io->ep = rd->ep_data;
+		io->flags = 0;
+		io->length = DATABLK1_SIZE;
+		memcpy(io->data, frame, DATABLK1_SIZE);
+		if (ioctl(rd->fd, USB_RAW_IOCTL_EP_WRITE, io) < 0)
+			break;
+
+		io->length = DATABLK2_SIZE;
+		memcpy(io->data, frame + DATABLK1_SIZE, DATABLK2_SIZE);
+		if (ioctl(rd->fd, USB_RAW_IOCTL_EP_WRITE, io) < 0)
+			break;
+
+		rd->frames++;
+	}
+
+	perror("data write");
+	free(frame);
+	free(io);
+	return NULL;
+}
+
+static int configure(struct reader *rd)
+{
+	struct usb_endpoint_descriptor intr = ep_desc(EP_INTR);
+	struct usb_endpoint_descriptor data = ep_desc(EP_DATA);
+
+	if (rd->configured)
+		return 0;
+
+	rd->ep_intr = ioctl(rd->fd, USB_RAW_IOCTL_EP_ENABLE, &intr);
+	rd->ep_data = ioctl(rd->fd, USB_RAW_IOCTL_EP_ENABLE, &data);
+	if (rd->ep_intr < 0 || rd->ep_data < 0) {
+		perror("ep_enable");
+		return -1;
+	}
+
+	ioctl(rd->fd, USB_RAW_IOCTL_VBUS_DRAW, 50);
+	if (ioctl(rd->fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0) {
+		perror("configure");
+		return -1;
+	}
+
+	rd->configured = 1;
+	pthread_create(&rd->irq_thread, NULL, irq_thread, rd);
+	pthread_create(&rd->data_thread, NULL, data_thread, rd);
+	return 0;
+}
+
+/* Control endpoint. Returns the length of the reply for IN requests, 0 for
+ * accepted OUT requests, or -1 to stall. */
+static int control_request(struct reader *rd, struct usb_ctrlrequest *ctrl,
+	unsigned char *buf)
+{
+	if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR)
+		return vendor_request(rd, ctrl, buf);
+	if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+		return -1;
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		return get_descriptor(rd, ctrl, buf);
+	case USB_REQ_SET_CONFIGURATION:
+		return configure(rd);
+	case USB_REQ_SET_INTERFACE:
+		return 0;
+	case USB_REQ_GET_CONFIGURATION:
+		buf[0] = rd->configured;
+		return 1;
+	case USB_REQ_GET_STATUS:
+		buf[0] = buf[1] = 0;
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+static void *ep0_thread(void *arg)
+{
+	struct reader *rd = arg;
+	struct ctrl_event event;
+	struct ep0_io io;
+	int len;
+	int r;
+
+	while (1) {
+		event.inner.type = 0;
+		event.inner.length = sizeof(event.ctrl);
+		if (ioctl(rd->fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0) {
+			perror("event_fetch");
+			break;
+		}
+
+		if (event.inner.type == USB_RAW_EVENT_CONNECT) {
+			printf("reader %d: %04x:%04x connected\n", rd->idx,
+				rd->type->vid, rd->type->pid);
+			continue;
+		}
+		if (event.inner.type != USB_RAW_EVENT_CONTROL)
+			continue;
+
+		len = le16toh(event.ctrl.wLength);
+		if (len > sizeof(io.data)) {
+			/* replies are short, but no OUT request carries more */
+			if (!(event.ctrl.bRequestType & USB_DIR_IN)) {
+				ioctl(rd->fd, USB_RAW_IOCTL_EP0_STALL, 0);
+				continue;
+			}
+			len = sizeof(io.data);
+		}
+
+		io.inner.ep = 0;
+		io.inner.flags = 0;
+		if (event.ctrl.bRequestType & USB_DIR_IN) {
+			r = control_request(rd, &event.ctrl, io.data);
+			if (r < 0) {
+				ioctl(rd->fd, USB_RAW_IOCTL_EP0_STALL, 0);
+				continue;
+			}
+			io.inner.length = r < len ? r : len;
+			ioctl(rd->fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+		} else {
+			/* take the data stage first, then act on it */
+			io.inner.length = len;
+			r = ioctl(rd->fd, USB_RAW_IOCTL_EP0_READ, &io);
+			if (r < 0)
+				continue;
+			if (control_request(rd, &event.ctrl, io.data) < 0)
+				fprintf(stderr, "reader %d: rejected %02x/%02x/%04x "
+					"after data stage\n", rd->idx,
+					event.ctrl.bRequestType,
+					event.ctrl.bRequest,
+					le16toh(event.ctrl.wValue));
+		}
+	}
+
+	return NULL;
+}
+
+static int start_reader(struct reader *rd)
+{
+	struct usb_raw_init init;
+
+	rd->fd = open("/dev/raw-gadget", O_RDWR);
+	if (rd->fd < 0) {
+		perror("open /dev/raw-gadget");
+		return -1;
+	}
+
+	memset(&init, 0, sizeof(init));
+	strcpy((char *) init.driver_name, "dummy_udc");
+	sprintf((char *) init.device_name, "dummy_udc.%d", rd->idx);
+	init.speed = USB_SPEED_HIGH;
+	if (ioctl(rd->fd, USB_RAW_IOCTL_INIT, &init) < 0
+			|| ioctl(rd->fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+		fprintf(stderr, "reader %d: could not start on %s: %s\n",
+			rd->idx, init.device_name, strerror(errno));
+		close(rd->fd);
+		return -1;
+	}
+
+	pthread_mutex_init(&rd->lock, NULL);
+	pthread_cond_init(&rd->cond, NULL);
+	rd->hwstat = 0x81;
+	rd->mode = MODE_INIT;
+	return pthread_create(&rd->ep0_thread, NULL, ep0_thread, rd);
+}
+
+static int load_pgm(const char *filename)
+{
+	FILE *fd = fopen(filename, "rb");
+	int width, height, maxval;
+
+	if (fd == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	if (fscanf(fd, "P5 %d %d %d", &width, &height, &maxval) != 3
+			|| width != IMG_WIDTH || height > FRAME_LINES
+			|| maxval != 255) {
+		fprintf(stderr, "%s: not a %d pixel wide 8-bit PGM\n",
+			filename, IMG_WIDTH);
+		fclose(fd);
+		return -1;
+	}
+	fgetc(fd);
+
+	file_image = calloc(FRAME_LINES, IMG_WIDTH);
+	if (file_image == NULL || fread(file_image, IMG_WIDTH, height, fd)
+			!= height) {
+		fprintf(stderr, "%s: short file\n", filename);
+		fclose(fd);
+		return -1;
+	}
+
+	fclose(fd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct reader *readers;
+	int num_readers = 1;
+	int type = -1;
+	int started = 0;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "n:d:r:s:t:l:")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_readers = atoi(optarg);
+			break;
+		case 'd':
+			type = atoi(optarg);
+			break;
+		case 'r':
+			frame_rate = atoi(optarg);
+			break;
+		case 's':
+			source = optarg;
+			break;
+		case 't':
+			touch_ms = atoi(optarg);
+			break;
+		case 'l':
+			lift_ms = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n readers] [-d type] "
+				"[-r fps] [-s ridges|empty|file.pgm] "
+				"[-t touch_ms] [-l lift_ms]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (num_readers < 1 || type >= (int) NUM_READER_TYPES) {
+		fprintf(stderr, "bad reader count or type\n");
+		return 1;
+	}
+
+	if (strcmp(source, "ridges") != 0 && strcmp(source, "empty") != 0
+			&& load_pgm(source) < 0)
+		return 1;
+
+	AES_set_encrypt_key(crkey, 128, &aeskey);
+
+	readers = calloc(num_readers, sizeof(*readers));
+	if (readers == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < num_readers; i++) {
+		readers[i].idx = i;
+		readers[i].type = &reader_types[type >= 0 ? type
+			: i % NUM_READER_TYPES];
+		if (start_reader(&readers[i]) == 0)
+			started++;
+	}
+
+	if (started == 0)
+		return 1;
+
+	printf("emulating %d readers\n", started);
+	while (1) {
+		unsigned long total = 0;
+
+		sleep(5);
+		for (i = 0; i < num_readers; i++)
+			total += readers[i].frames;
+		printf("%lu frames served\n", total);
+	}
+
+	return 0;
+}
+
+#else
+
+int main(void)
+{
+	fprintf(stderr, "built without Linux raw-gadget support\n");
+	return 1;
+}
+
+#endif
@@ -29,17 +29,13 @@
 
 struct dpfp_dev *dev;
 
-int capture_fprint(struct dpfp_fprint *fp, struct dpfp_fprint *base_img)
+int capture_fprint(struct dpfp_fprint *fp)
 {
-	/* Capture base image. We assume the finger is away from the sensor at
-	 * this point... */
-	if (dpfp_set_mode(dev, DPFP_MODE_SEND_FINGER) < 0) {
-		perror("set_mode");
-		return 1;
-	}
-
-	if (dpfp_capture_fprint(dev, base_img) < 0) {
-		perror("simple_get_fingerprint");
+	/* The library keeps the base image up to date from idle frames, and
+	 * only captures a new one here if it has gone stale. We assume the
+	 * finger is away from the sensor at this point... */
+	if (dpfp_background_refresh(dev, 0) < 0) {
+		perror("background_refresh");
 		return 1;
 	}
 
@@ -71,8 +67,7 @@ int capture_fprint(struct dpfp_fprint *fp, struct dpfp_fprint *base_img)
 
 }
 
-struct dpfp_mset *process_fprint(struct dpfp_fprint *fp,
-	struct dpfp_fprint *base_img)
+struct dpfp_mset *process_fprint(struct dpfp_fprint *fp)
 {
 	struct timeval tv;
 	double t1, t2;
@@ -85,10 +80,9 @@ struct dpfp_mset *process_fprint(struct dpfp_fprint *fp,
 	gettimeofday(&tv, NULL);
 	t1 = TV_TO_DOUBLE(tv);
 
-	/* Basic enhancements: subtract base image, flip to correct orientation */
-	dpfp_fprint_subtract(fp, base_img);
-	dpfp_fprint_flip_v(fp);
-	dpfp_fprint_flip_h(fp);
+	/* Basic enhancements: flip to correct orientation. The base image was
+	 * already subtracted during capture. */
+	dpfp_fprint_rotate_subtract(fp, fp, NULL);
 
 	/* More advanced enhancements */
 	dpfp_fprint_soften_mean(fp, 3);
@@ -116,8 +110,6 @@ struct dpfp_mset *process_fprint(struct dpfp_fprint *fp,
 
 int main(void)
 {
-	struct dpfp_fprint *base1 = dpfp_fprint_alloc();
-	struct dpfp_fprint *base2 = dpfp_fprint_alloc();
 	struct dpfp_fprint *fp1 = dpfp_fprint_alloc();
 	struct dpfp_fprint *fp2 = dpfp_fprint_alloc();
 	struct dpfp_mset *mset1;
@@ -132,9 +124,14 @@ int main(void)
 		goto exit;
 	}
 
-	capture_fprint(fp1, base1);
+	if (dpfp_background_enable(dev, DPFP_BG_AUTO_SUBTRACT) < 0) {
+		perror("background_enable");
+		goto exit;
+	}
+
+	capture_fprint(fp1);
 	sleep(1);
-	capture_fprint(fp2, base2);
+	capture_fprint(fp2);
 	dpfp_close(dev);
 
 	printf("capturing completed\n");
@@ -142,15 +139,13 @@ int main(void)
 /*
 	dpfp_fprint_write_to_file(fp1, "fp1.pgm");
 	dpfp_fprint_write_to_file(fp2, "fp2.pgm");
-	dpfp_fprint_write_to_file(base1, "base1.pgm");
-	dpfp_fprint_write_to_file(base2, "base2.pgm");
 */
 
 	printf("processing fingerprint 1...\n");
-	mset1 = process_fprint(fp1, base1);
+	mset1 = process_fprint(fp1);
 
 	printf("processing fingerprint 2...\n");
-	mset2 = process_fprint(fp2, base2);
+	mset2 = process_fprint(fp2);
 
 	result = dpfp_fprint_mset_match1(mset1, mset2);
 	printf("match1 result %f\n", result);
@@ -20,6 +20,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -78,20 +79,25 @@ static const struct dpfp_dev_entry device_tbl[] = {
 	},
 };
 
-static const struct dpfp_dev_entry *get_dev_entry(struct usb_device *udev)
+const struct dpfp_dev_entry *dpfp_lookup_dev_entry(uint16_t vid, uint16_t pid)
 {
 	int i;
 
 	for (i = 0; i < (sizeof(device_tbl) / sizeof(*device_tbl)); i++) {
 		const struct dpfp_dev_entry *deventry = &device_tbl[i];
-		if (deventry->vid == udev->descriptor.idVendor
-				&& deventry->pid == udev->descriptor.idProduct)
+		if (deventry->vid == vid && deventry->pid == pid)
 			return deventry;
 	}
 
 	return NULL;
 }
 
+const struct dpfp_dev_entry *dpfp_get_dev_entry(struct usb_device *udev)
+{
+	return dpfp_lookup_dev_entry(udev->descriptor.idVendor,
+		udev->descriptor.idProduct);
+}
+
 #if 0
 /* FIXME err check */
 static int dpfp_upload_firmware(struct dpfp_dev *dev)
@@ -119,7 +125,7 @@ static int dpfp_upload_firmware(struct dpfp_dev *dev)
 
 		fread(buf, 256, 1, fp);
 
-		usb_control_msg(dev->handle, 0x40, 0x04, offset, 0,
+		dpfp_control_msg(dev, 0x40, 0x04, offset, 0,
 			buf, size, CTRL_TIMEOUT);
 
 		len -= size;
@@ -146,7 +152,7 @@ int fix_firmware(struct dpfp_dev *dev)
 	unsigned char val, new;
 	int r;
 
-	r = usb_control_msg(dev->handle, 0xc0, 0x0c, enc_addr, 0, &val, 1,
+	r = dpfp_control_msg(dev, 0xc0, 0x0c, enc_addr, 0, &val, 1,
 		CTRL_TIMEOUT);
 	if (r < 0)
 		return r;
@@ -159,7 +165,7 @@ int fix_firmware(struct dpfp_dev *dev)
 	if (new == val)
 		return 0;
 
-	r = usb_control_msg(dev->handle, 0x40, 0x04, enc_addr, 0, &new, 1,
+	r = dpfp_control_msg(dev, 0x40, 0x04, enc_addr, 0, &new, 1,
 		CTRL_TIMEOUT);
 	if (r < 0)
 		return r;
@@ -168,13 +174,246 @@ int fix_firmware(struct dpfp_dev *dev)
 	return 1;
 }
 
-static struct dpfp_dev *dpfp_open_usb(struct usb_device *udev,
-		const struct dpfp_dev_entry *deventry)
+/* Add the time since *mark to a phase counter (in ms) and move the mark */
+static void phase_done(double *phase, double *mark)
+{
+	struct timeval tv;
+	double now;
+
+	gettimeofday(&tv, NULL);
+	now = TV_TO_DOUBLE(tv);
+	*phase += (now - *mark) * 1000;
+	*mark = now;
+}
+
+/* Bring the sensor from whatever state it is in to powered up and ready to
+ * scan. start is when opening began, for the timing breakdown in timing. */
+static int power_up(struct dpfp_dev *dev, double start,
+	struct dpfp_open_timing *timing)
 {
 	int i;
 	int r;
 	unsigned char buf[DPFP_IRQ_LENGTH];
 	unsigned char status;
+	unsigned long irq_pos;
+	double mark = start;
+
+	r = dpfp_get_hwstat(dev, &status);
+	if (r < 0)
+		return r;
+	phase_done(&timing->probe, &mark);
+
+	/* A previous persistent session left the sensor powered and the
+	 * firmware patched: nothing to do. fix_firmware only reads in that
+	 * case; if it had to patch anything we go the long way round. */
+	if ((dev->flags & DPFP_OPEN_WARM) && (status & 0x80) == 0) {
+		r = 0;
+		if (!(dev->flags & DPFP_OPEN_ENCRYPTED))
+			r = fix_firmware(dev);
+		if (r < 0)
+			return r;
+		phase_done(&timing->firmware, &mark);
+		if (r == 0) {
+			dbg(DBG_INFO, "device already powered up");
+			timing->warm = 1;
+			goto ready;
+		}
+	}
+
+	/* After closing a dpfp app and setting hwstat to 0x80, my ms keyboard
+	 * gets in a confused state and returns hwstat 0x85. On next app run,
+	 * we don't get the 56aa interrupt. This is the best way I've found to
+	 * fix it: mess around with hwstat until it starts returning more
+	 * recognisable values. This doesn't happen on my other devices:
+	 * uru4000, uru4000b, ms fp rdr v2 
+	 * The windows driver copes with this OK, but then again it uploads
+	 * firmware right after reading the 0x85 hwstat, allowing some time
+	 * to pass before it attempts to tweak hwstat again... */
+	if ((status & 0x84) == 0x84) {
+		printf("rebooting device power...\n");
+		TELEMETRY_INC(dev, power_reboots);
+		r = dpfp_set_hwstat(dev, status & 0xf);
+		if (r < 0)
+			return r;
+
+		for (i = 0; i < 100; i++) {
+			r = dpfp_get_hwstat(dev, &status);
+			if (r < 0)
+				return r;
+			if (status & 0x1)
+				break;
+			usleep(10000);
+		}
+		if ((status & 0x1) == 0) {
+			dbg(DBG_ERR, "could not reboot device power");
+			return -EIO;
+		}
+	}
+	phase_done(&timing->power_cycle, &mark);
+	
+	if ((status & 0x80) == 0) {
+		status |= 0x80;
+		r = dpfp_set_hwstat(dev, status);
+		if (r < 0)
+			return r;
+	}
+
+	/* We decrypt images ourselves rather than rely on the patch */
+	if (!(dev->flags & DPFP_OPEN_ENCRYPTED)) {
+		r = fix_firmware(dev);
+		if (r < 0)
+			return r;
+	}
+	phase_done(&timing->firmware, &mark);
+
+	/* Power up device and wait for interrupt notification */
+	/* The combination of both modifying firmware *and* doing C-R auth on
+	 * my ms fp v2 device causes us not to get to get the 56aa interrupt and
+	 * for the hwstat write not to take effect. We loop a few times,
+	 * authenticating each time, until the device wakes up. */
+	irq_pos = dpfp_irq_position(dev);
+	for (i = 0; i < 100; i++) { /* max 1 sec */
+		r = dpfp_set_hwstat(dev, status & 0xf);
+		if (r < 0)
+			return r;
+
+		r = dpfp_get_hwstat(dev, buf);
+		if (r < 0)
+			return r;
+
+		if ((buf[0] & 0x80) == 0)
+			break;
+
+		usleep(10000);
+		TELEMETRY_INC(dev, retries);
+
+		if (dev->dev_entry->type == DEV_TYPE_URU4000Bg2) {
+			r = dpfp_simple_auth_cr(dev);
+			if (r < 0)
+				return r;
+		}
+	}
+
+	if (buf[0] & 0x80) {
+		dbg(DBG_ERR, "could not power up device");
+		return -EIO;
+	}
+	phase_done(&timing->power_up, &mark);
+
+	r = dpfp_get_irq_type_from(dev, &irq_pos, DPFP_IRQDATA_SCANPWR_ON, buf,
+		5);
+	if (r == -ETIMEDOUT)
+		dpfp_irq_missed(dev);
+	if (r < 0)
+		return r;
+	phase_done(&timing->irq_wait, &mark);
+
+ready:
+	timing->total = (mark - start) * 1000;
+	dbgf(DBG_INFO, "open took %.1fms", timing->total);
+	return 0;
+
+}
+
+/* Power-cycle a sensor which has stopped behaving and bring it back up in
+ * the mode it was last put in, for the watchdog. This is the power-up
+ * sequence of dpfp_open, except that scan power is dropped first so that
+ * it always goes the long way round, and the URU4000Bg2 is authenticated
+ * again up front as the wedge may have cost us the session. */
+static int recover(struct dpfp_dev *dev)
+{
+	struct dpfp_open_timing timing;
+	struct timeval tv;
+	unsigned char status;
+	int r;
+
+	r = dpfp_get_hwstat(dev, &status);
+	if (r < 0)
+		return r;
+
+	/* 0x85 and the like are left for power_up to reboot */
+	if ((status & 0x80) == 0) {
+		r = dpfp_set_hwstat(dev, status | 0x80);
+		if (r < 0)
+			return r;
+	}
+
+	if (dev->dev_entry->type == DEV_TYPE_URU4000Bg2) {
+		r = dpfp_simple_auth_cr(dev);
+		if (r < 0)
+			return r;
+	}
+
+	/* the sensor may hand out different keys after a power cycle */
+	dpfp_crypt_reset(dev);
+
+	memset(&timing, 0, sizeof(timing));
+	gettimeofday(&tv, NULL);
+	r = power_up(dev, TV_TO_DOUBLE(tv), &timing);
+	if (r < 0)
+		return r;
+
+	return dpfp_write_mode(dev,
+		__atomic_load_n(&dev->mode, __ATOMIC_RELAXED));
+}
+
+/* Captures and mode changes already in flight are allowed to finish first
+ * (a capture on a wedged device fails within its timeout), and new ones
+ * wait until the device has been recovered, so that none of them sees the
+ * sensor half powered up or the key cache being reset. */
+int dpfp_recover(struct dpfp_dev *dev)
+{
+	int r;
+
+	pthread_mutex_lock(&dev->io_lock);
+	while (dev->recovering)
+		pthread_cond_wait(&dev->io_cond, &dev->io_lock);
+	dev->recovering = 1;
+	while (dev->io_busy)
+		pthread_cond_wait(&dev->io_cond, &dev->io_lock);
+	pthread_mutex_unlock(&dev->io_lock);
+
+	r = recover(dev);
+
+	pthread_mutex_lock(&dev->io_lock);
+	dev->recovering = 0;
+	pthread_cond_broadcast(&dev->io_cond);
+	pthread_mutex_unlock(&dev->io_lock);
+	return r;
+}
+
+static struct dpfp_dev *dev_alloc(void)
+{
+	struct dpfp_dev *dev;
+
+	dev = malloc(sizeof(*dev));
+	if (dev == NULL)
+		return NULL;
+
+	memset(dev, 0, sizeof(*dev));
+	pthread_mutex_init(&dev->io_lock, NULL);
+	pthread_cond_init(&dev->io_cond, NULL);
+	return dev;
+}
+
+static void dev_free(struct dpfp_dev *dev)
+{
+	pthread_cond_destroy(&dev->io_cond);
+	pthread_mutex_destroy(&dev->io_lock);
+	free(dev);
+}
+
+/* Claim a reader and set up a device for it. This is the only part of
+ * opening which touches udev, so the registry runs it under its lock;
+ * dpfp_open_finish then powers the sensor up, which takes long enough that
+ * the registry must not hold the lock across it. */
+struct dpfp_dev *dpfp_open_usb(struct usb_device *udev,
+		const struct dpfp_dev_entry *deventry, int flags, const char *record)
+{
+	int i;
+	int r;
+	struct timeval tv;
+	double start;
 	struct usb_dev_handle *handle;
 	struct usb_config_descriptor *config;
 	struct usb_interface *iface = NULL;
@@ -182,6 +421,9 @@ static struct dpfp_dev *dpfp_open_usb(struct usb_device *udev,
 	struct usb_endpoint_descriptor *ep;
 	struct dpfp_dev *dev = NULL;
 
+	gettimeofday(&tv, NULL);
+	start = TV_TO_DOUBLE(tv);
+
 	handle = usb_open(udev);
 	if (handle == NULL) {
 		dbg(DBG_ERR, "usb_open returned NULL");
@@ -243,130 +485,138 @@ static struct dpfp_dev *dpfp_open_usb(struct usb_device *udev,
 		goto err;
 	}
 
-	dev = malloc(sizeof(*dev));
+	dev = dev_alloc();
 	if (dev == NULL)
 		goto err_release;
 
-	memset(dev, 0, sizeof(*dev));
 	dev->handle = handle;
+	dev->interface = iface_desc->bInterfaceNumber;
 	dev->dev_entry = deventry;
+	dev->flags = flags;
+	dev->ops = &dpfp_usb_transport;
+	dev->open_start = start;
 
-	r = dpfp_get_hwstat(dev, &status);
-	if (r < 0)
+	if (record && dpfp_transport_record(dev, record) < 0) {
+		dbgf(DBG_ERR, "could not record to %s", record);
 		goto err_release;
+	}
 
-	/* After closing a dpfp app and setting hwstat to 0x80, my ms keyboard
-	 * gets in a confused state and returns hwstat 0x85. On next app run,
-	 * we don't get the 56aa interrupt. This is the best way I've found to
-	 * fix it: mess around with hwstat until it starts returning more
-	 * recognisable values. This doesn't happen on my other devices:
-	 * uru4000, uru4000b, ms fp rdr v2 
-	 * The windows driver copes with this OK, but then again it uploads
-	 * firmware right after reading the 0x85 hwstat, allowing some time
-	 * to pass before it attempts to tweak hwstat again... */
-	if ((status & 0x84) == 0x84) {
-		printf("rebooting device power...\n");
-		r = dpfp_set_hwstat(dev, status & 0xf);
-		if (r < 0)
-			goto err_release;
+	return dev;
 
-		for (i = 0; i < 100; i++) {
-			r = dpfp_get_hwstat(dev, &status);
-			if (r < 0)
-				goto err_release;
-			if (status & 0x1)
-				break;
-			usleep(10000);
-		}
-		if ((status & 0x1) == 0) {
-			dbg(DBG_ERR, "could not reboot device power");
-			goto err_release;
-		}
-	}
-	
-	if ((status & 0x80) == 0) {
-		status |= 0x80;
-		r = dpfp_set_hwstat(dev, status);
-		if (r < 0)
-			goto err_release;
-	}
+err_release:
+	usb_release_interface(handle, iface_desc->bInterfaceNumber);
+err:
+	if (dev)
+		dev_free(dev);
 
-	r = fix_firmware(dev);
-	if (r < 0)
-		goto err_release;
+	usb_close(handle);
+	return NULL;
+}
 
-	/* Power up device and wait for interrupt notification */
-	/* The combination of both modifying firmware *and* doing C-R auth on
-	 * my ms fp v2 device causes us not to get to get the 56aa interrupt and
-	 * for the hwstat write not to take effect. We loop a few times,
-	 * authenticating each time, until the device wakes up. */
-	for (i = 0; i < 100; i++) { /* max 1 sec */
-		r = dpfp_set_hwstat(dev, status & 0xf);
-		if (r < 0)
-			goto err_release;
+/* Power up a device set up by dpfp_open_usb. On failure the device is
+ * closed and freed. */
+int dpfp_open_finish(struct dpfp_dev *dev)
+{
+	int r;
 
-		r = dpfp_get_hwstat(dev, buf);
-		if (r < 0)
-			goto err_release;
+	r = power_up(dev, dev->open_start, &dev->timing);
+	if (r < 0) {
+		usb_release_interface(dev->handle, dev->interface);
+		dev->ops->close(dev);
+		dev_free(dev);
+	}
+	return r;
+}
 
-		if ((buf[0] & 0x80) == 0)
-			break;
+/* Open a device backed by a session previously recorded with
+ * dpfp_open_idx_record instead of real hardware. With DPFP_REPLAY_REALTIME
+ * no transaction completes earlier, relative to the open, than it did when
+ * recorded, which reproduces both the transfer times and the gaps between
+ * them; with DPFP_REPLAY_FAST they complete immediately. */
+struct dpfp_dev *dpfp_open_replay(const char *filename,
+	enum dpfp_replay_speed speed, int flags)
+{
+	struct dpfp_dev *dev;
+	struct timeval tv;
+	uint16_t vid, pid;
+	int r;
 
-		usleep(10000);
+	dev = dev_alloc();
+	if (dev == NULL)
+		return NULL;
 
-		if (dev->dev_entry->type == DEV_TYPE_URU4000Bg2) {
-			r = dpfp_simple_auth_cr(dev);
-			if (r < 0)
-				goto err_release;
-		}
+	dev->flags = flags;
+	strcpy(dev->path, "replay");
+	gettimeofday(&tv, NULL);
+
+	r = dpfp_transport_replay(dev, filename, speed, &vid, &pid);
+	if (r < 0) {
+		dev_free(dev);
+		errno = -r;
+		return NULL;
 	}
 
-	if (buf[0] & 0x80) {
-		dbg(DBG_ERR, "could not power up device");
-		goto err_release;
+	dev->dev_entry = dpfp_lookup_dev_entry(vid, pid);
+	if (dev->dev_entry == NULL) {
+		dbgf(DBG_ERR, "recorded unknown device %04x:%04x", vid, pid);
+		r = -ENODEV;
+		goto err;
 	}
 
-	r = dpfp_simple_get_irq_with_type(dev, DPFP_IRQDATA_SCANPWR_ON, buf, 5);
+	r = power_up(dev, TV_TO_DOUBLE(tv), &dev->timing);
 	if (r < 0)
-		goto err_release;
+		goto err;
 
 	return dev;
 
-err_release:
-	usb_release_interface(handle, iface_desc->bInterfaceNumber);
 err:
-	if (dev)
-		free(dev);
-
-	usb_close(handle);
+	dev->ops->close(dev);
+	dev_free(dev);
+	errno = -r;
 	return NULL;
 }
 
+/* Open the idx'th reader in the device registry */
 struct dpfp_dev *dpfp_open_idx(int idx)
 {
-	struct usb_bus *bus;
-	int count = -1;
-
-	usb_find_busses();
-	usb_find_devices();
+	return dpfp_registry_open(idx, 0, NULL);
+}
 
-	for (bus = usb_busses; bus; bus = bus->next) {
-		struct usb_device *udev;
+/* As dpfp_open_idx, with DPFP_OPEN_* flags:
+ *  - DPFP_OPEN_WARM: if the sensor is still powered up and configured from a
+ *    previous DPFP_OPEN_PERSISTENT session, skip the power-up sequence
+ *  - DPFP_OPEN_PERSISTENT: leave the sensor powered on dpfp_close, so that
+ *    the next warm open is fast
+ *  - DPFP_OPEN_ENCRYPTED: do not patch the firmware to turn image
+ *    encryption off, decrypt frames as they are captured instead */
+struct dpfp_dev *dpfp_open_idx_flags(int idx, int flags)
+{
+	return dpfp_registry_open(idx, flags, NULL);
+}
 
-		for (udev = bus->devices; udev; udev = udev->next) {
-			const struct dpfp_dev_entry *deventry;
+/* As dpfp_open_idx_flags, additionally recording every transaction with
+ * the device (starting with the power-up sequence) to a session file for
+ * dpfp_open_replay */
+struct dpfp_dev *dpfp_open_idx_record(int idx, int flags, const char *filename)
+{
+	return dpfp_registry_open(idx, flags, filename);
+}
 
-			deventry = get_dev_entry(udev);
-			if (deventry == NULL)
-				continue;
+/* Open every reader in the device registry. Up to max devices are stored in
+ * devs; returns the number opened. */
+int dpfp_open_all(struct dpfp_dev **devs, int max)
+{
+	int num = dpfp_get_num_readers();
+	int count = 0;
+	int i;
 
-			if (++count == idx)
-				return dpfp_open_usb(udev, deventry);
-		}
+	for (i = 0; i < num && count < max; i++) {
+		struct dpfp_dev *dev = dpfp_registry_open(i, 0, NULL);
+		if (dev)
+			devs[count++] = dev;
 	}
 
-	errno = ENODEV;
-	return NULL;
+	return count;
 }
 
 struct dpfp_dev *dpfp_open()
@@ -379,11 +629,16 @@ int dpfp_close(struct dpfp_dev *dev)
 {
 	int r;
 
+	dpfp_irq_stop(dev);
+	dpfp_background_disable(dev);
+	dpfp_crypt_free(dev);
+	dpfp_registry_release(dev);
 	dpfp_set_mode(dev, DPFP_MODE_INIT);
-	dpfp_set_hwstat(dev, 0x80);
+	if (!(dev->flags & DPFP_OPEN_PERSISTENT))
+		dpfp_set_hwstat(dev, 0x80);
 
-	r = usb_close(dev->handle);
-	free(dev);
+	r = dev->ops->close(dev);
+	dev_free(dev);
 	return r;
 }
 
@@ -392,10 +647,28 @@ static const unsigned char crkey[] = {
 	0x98, 0xe0, 0x0f, 0x3c, 0x59, 0x8f, 0x5f, 0x4b,
 };
 
+const char *dpfp_get_name(struct dpfp_dev *dev)
+{
+	return dev->dev_entry->name;
+}
+
+/* Time spent in each phase of opening the device */
+void dpfp_get_open_timing(struct dpfp_dev *dev, struct dpfp_open_timing *timing)
+{
+	*timing = dev->timing;
+}
+
+/* Bus path of the device, as reported in dpfp_reader_info */
+const char *dpfp_get_path(struct dpfp_dev *dev)
+{
+	return dev->path;
+}
+
 int dpfp_init()
 {
 	usb_init();
 	AES_set_encrypt_key(crkey, 128, &aeskey);
+	dpfp_registry_init();
 	return 0;
 }
 
@@ -33,12 +33,51 @@
 #include <usb.h>
 
 struct dpfp_dev;
+struct dpfp_async;
+struct dpfp_ring;
+struct dpfp_store;
+struct dpfp_presence;
+struct dpfp_stable;
+struct dpfp_continuous;
+struct dpfp_pipeline;
+struct dpfp_stream;
+struct dpfp_prep;
+struct dpfp_manager;
+struct dpfp_verify;
+struct dpfp_watchdog;
 
 struct dpfp_fprint {
 	size_t header_size;
 	size_t data_size;
 	unsigned char *header;
 	unsigned char *data;
+
+	/* frame sequence number, assigned by the frame ring and async engine */
+	unsigned long seq;
+	/* time at which the transfer completed, in seconds */
+	double timestamp;
+};
+
+#define DPFP_FRAME_MAX_BLOCKS	15
+
+/* dpfp_frame_block flags */
+#define DPFP_BLOCK_NOT_PRESENT		0x01
+#define DPFP_BLOCK_ENCRYPTED		0x02
+#define DPFP_BLOCK_NO_KEY_UPDATE	0x04
+#define DPFP_BLOCK_CHANGE_KEY		0x80
+
+struct dpfp_frame_block {
+	unsigned char flags;
+	unsigned char num_lines;
+};
+
+/* Parsed frame header */
+struct dpfp_frame_info {
+	int num_lines;
+	int key_number;
+	/* runs of lines making up the image, in order */
+	int num_blocks;
+	struct dpfp_frame_block blocks[DPFP_FRAME_MAX_BLOCKS];
 };
 
 struct dpfp_ffield {
@@ -84,11 +123,118 @@ enum dpfp_modes {
 #define DPFP_IMG_HEIGHT	289
 #define DPFP_IMG_WIDTH	384
 
+#define DPFP_PATH_LENGTH	32
+
+struct dpfp_reader_info {
+	/* bus/device, stable for as long as the reader stays plugged in */
+	char path[DPFP_PATH_LENGTH];
+	uint16_t vendor;
+	uint16_t product;
+	const char *name;
+};
+
+typedef void (*dpfp_hotplug_cb)(const struct dpfp_reader_info *info,
+	int arrived, void *user_data);
+
+/* dpfp_open_idx_flags flags */
+#define DPFP_OPEN_WARM		(1 << 0)
+#define DPFP_OPEN_PERSISTENT	(1 << 1)
+#define DPFP_OPEN_ENCRYPTED	(1 << 2)
+
+/* Milliseconds spent in each phase of dpfp_open */
+struct dpfp_open_timing {
+	double probe;		/* usb_open, descriptor checks, hwstat read */
+	double power_cycle;	/* recovering a confused sensor */
+	double firmware;	/* firmware encryption byte check/patch */
+	double power_up;	/* hwstat power-up loop and auth */
+	double irq_wait;	/* waiting for the SCANPWR_ON interrupt */
+	double total;
+	int warm;		/* power-up was skipped */
+};
+
+/* Latency histograms cover 1us to 2^27us with 2^DPFP_HIST_SUB_BITS buckets
+ * per power of two, see dpfp_telemetry.c */
+#define DPFP_HIST_SUB_BITS	4
+#define DPFP_HIST_BUCKETS	384
+
+/* Latencies in microseconds */
+struct dpfp_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[DPFP_HIST_BUCKETS];
+};
+
+enum dpfp_telemetry_irq {
+	DPFP_TM_IRQ_SCANPWR_ON = 0,
+	DPFP_TM_IRQ_FINGER_ON,
+	DPFP_TM_IRQ_FINGER_OFF,
+	DPFP_TM_IRQ_OTHER,
+	DPFP_TM_IRQ_TYPES,
+};
+
+/* Everything that has happened on a device since it was opened */
+struct dpfp_telemetry {
+	/* interrupts read, by type */
+	uint64_t irqs[DPFP_TM_IRQ_TYPES];
+	/* interrupts skipped while waiting for another type */
+	uint64_t discarded_irqs;
+	/* interrupt reads which ran into their timeout */
+	uint64_t irq_timeouts;
+	/* control and bulk transfers which timed out */
+	uint64_t timeouts;
+	/* transfers which failed otherwise */
+	uint64_t errors;
+	/* repeated interrupt reads and power-up attempts */
+	uint64_t retries;
+	uint64_t power_reboots;
+	uint64_t auth_rounds;
+	uint64_t frames;
+	/* the watchdog found the device wedged, brought it back, or gave
+	 * up on it */
+	uint64_t wedges;
+	uint64_t recoveries;
+	uint64_t failed_recoveries;
+	/* every control message, every bulk read, and every whole frame
+	 * including decryption */
+	struct dpfp_histogram control;
+	struct dpfp_histogram bulk;
+	struct dpfp_histogram frame;
+	/* time from the watchdog noticing a wedge to the device working
+	 * again; sum / count is the mean time to recover */
+	struct dpfp_histogram recovery;
+};
+
+enum dpfp_replay_speed {
+	DPFP_REPLAY_REALTIME = 0,
+	DPFP_REPLAY_FAST,
+};
+
 int dpfp_init();
+void dpfp_exit(void);
+
+int dpfp_get_num_readers(void);
+int dpfp_get_reader_info(int idx, struct dpfp_reader_info *info);
+int dpfp_find_reader(uint16_t vendor, uint16_t product);
+int dpfp_find_reader_path(const char *path);
+int dpfp_rescan(void);
+void dpfp_set_hotplug_callback(dpfp_hotplug_cb callback, void *user_data);
 
 struct dpfp_dev *dpfp_open();
 struct dpfp_dev *dpfp_open_idx(int idx);
+struct dpfp_dev *dpfp_open_idx_flags(int idx, int flags);
+struct dpfp_dev *dpfp_open_idx_record(int idx, int flags, const char *filename);
+struct dpfp_dev *dpfp_open_replay(const char *filename,
+	enum dpfp_replay_speed speed, int flags);
+struct dpfp_dev *dpfp_open_path(const char *path);
+int dpfp_open_all(struct dpfp_dev **devs, int max);
 int dpfp_close(struct dpfp_dev *dev);
+const char *dpfp_get_name(struct dpfp_dev *dev);
+const char *dpfp_get_path(struct dpfp_dev *dev);
+void dpfp_get_open_timing(struct dpfp_dev *dev, struct dpfp_open_timing *timing);
+void dpfp_get_telemetry(struct dpfp_dev *dev, struct dpfp_telemetry *tm);
+uint64_t dpfp_histogram_percentile(const struct dpfp_histogram *hist,
+	double fraction);
 
 struct dpfp_fprint *dpfp_fprint_alloc();
 void dpfp_fprint_free(struct dpfp_fprint *fp);
@@ -96,17 +242,29 @@ int dpfp_fprint_write_to_file(struct dpfp_fprint *fp, char *filename);
 void dpfp_fprint_flip_v(struct dpfp_fprint *fp);
 void dpfp_fprint_flip_h(struct dpfp_fprint *fp);
 void dpfp_fprint_subtract(struct dpfp_fprint *a, struct dpfp_fprint *b);
+int dpfp_fprint_rotate_subtract(struct dpfp_fprint *dst,
+	struct dpfp_fprint *fp, struct dpfp_fprint *base);
+int dpfp_fprint_get_info(struct dpfp_fprint *fp, struct dpfp_frame_info *info);
 
 struct dpfp_ffield *dpfp_ffield_alloc();
 void dpfp_ffield_free(struct dpfp_ffield *ffield);
 
 struct dpfp_mset *dpfp_mset_alloc();
 
+/* Largest dpfp_fprint_soften_mean window, and the scratch it needs */
+#define DPFP_SOFTEN_MAX		255
+#define DPFP_SOFTEN_SCRATCH(size)	(((size) / 2 + 1) * DPFP_IMG_WIDTH)
+
 int dpfp_fprint_soften_mean(struct dpfp_fprint *fp, int size);
+int dpfp_fprint_soften_mean_scratch(struct dpfp_fprint *fp, int size,
+	unsigned char *scratch);
 int dpfp_fprint_get_direction(struct dpfp_fprint *fp, struct dpfp_ffield *ff,
 	int block_size, int filter_size);
 int dpfp_fprint_get_frequency(struct dpfp_fprint *fp,
 	struct dpfp_ffield *direction, struct dpfp_ffield *frequency);
+int dpfp_fprint_get_frequency_stride(struct dpfp_fprint *fp,
+	struct dpfp_ffield *direction, struct dpfp_ffield *frequency,
+	int stride);
 int dpfp_fprint_get_mask(struct dpfp_fprint *fp, struct dpfp_ffield *direction,
 	struct dpfp_ffield *frequency, struct dpfp_fprint *mask);
 int dpfp_fprint_enhance_gabor(struct dpfp_fprint *fp,
@@ -118,10 +276,16 @@ void dpfp_fprint_plot_mset(struct dpfp_mset *mset, struct dpfp_fprint *fp);
 float dpfp_fprint_mset_match1(struct dpfp_mset *mset1, struct dpfp_mset *mset2);
 struct dpfp_mset *dpfp_mset_remove_noise(struct dpfp_mset *mset,
 	struct dpfp_fprint *mask);
+void dpfp_fprint_binarize(struct dpfp_fprint *fp, unsigned char limit);
+void dpfp_fprint_thin(struct dpfp_fprint *fp);
+struct dpfp_mset *dpfp_fprint_process(struct dpfp_fprint *fp,
+	struct dpfp_fprint *base);
 
 int dpfp_get_irq(struct dpfp_dev *dev, unsigned char *buf, int timeout);
 int dpfp_set_mode(struct dpfp_dev *dev, unsigned char mode);
 int dpfp_capture_fprint(struct dpfp_dev *dev, struct dpfp_fprint *fp);
+int dpfp_capture_fprint_timeout(struct dpfp_dev *dev, struct dpfp_fprint *fp,
+	int timeout);
 int dpfp_set_edge_light(struct dpfp_dev *dev, int brightness);
 
 int dpfp_get_hwstat(struct dpfp_dev *dev, unsigned char *data);
@@ -130,6 +294,316 @@ int dpfp_set_hwstat_pwr(struct dpfp_dev *dev, int on);
 int dpfp_auth_read_challenge(struct dpfp_dev *dev, unsigned char *data);
 int dpfp_auth_write_response(struct dpfp_dev *dev, unsigned char *data);
 
+typedef void (*dpfp_async_cb)(struct dpfp_async *async,
+	struct dpfp_fprint *fp, int status, void *user_data);
+
+struct dpfp_async *dpfp_async_start(struct dpfp_dev *dev, int num_bufs,
+	int timeout, dpfp_async_cb callback, void *user_data);
+void dpfp_async_cancel(struct dpfp_async *async);
+void dpfp_async_stop(struct dpfp_async *async);
+struct dpfp_dev *dpfp_async_get_dev(struct dpfp_async *async);
+
+typedef void (*dpfp_irq_cb)(struct dpfp_dev *dev, uint16_t type,
+	unsigned char *irqbuf, void *user_data);
+
+int dpfp_irq_start(struct dpfp_dev *dev);
+void dpfp_irq_stop(struct dpfp_dev *dev);
+int dpfp_irq_add_handler(struct dpfp_dev *dev, uint16_t type,
+	dpfp_irq_cb callback, void *user_data);
+int dpfp_irq_get_fd(struct dpfp_dev *dev);
+int dpfp_irq_handle_events(struct dpfp_dev *dev);
+
+enum dpfp_ring_policy {
+	DPFP_RING_DROP_OLDEST = 0,
+	DPFP_RING_BLOCK,
+};
+
+struct dpfp_ring *dpfp_ring_alloc(int num_slots, enum dpfp_ring_policy policy);
+void dpfp_ring_free(struct dpfp_ring *ring);
+int dpfp_ring_add_reader(struct dpfp_ring *ring);
+void dpfp_ring_remove_reader(struct dpfp_ring *ring, int reader);
+int dpfp_ring_capture(struct dpfp_ring *ring, struct dpfp_dev *dev,
+	int timeout);
+struct dpfp_fprint *dpfp_ring_borrow(struct dpfp_ring *ring, int reader,
+	int timeout);
+void dpfp_ring_return(struct dpfp_ring *ring, struct dpfp_fprint *fp);
+unsigned long dpfp_ring_get_dropped(struct dpfp_ring *ring, int reader);
+
+struct dpfp_store *dpfp_store_create(const char *filename,
+	unsigned int max_frames);
+struct dpfp_store *dpfp_store_open(const char *filename);
+void dpfp_store_close(struct dpfp_store *store);
+int dpfp_store_sync(struct dpfp_store *store);
+int dpfp_store_append(struct dpfp_store *store, struct dpfp_fprint *fp,
+	uint32_t devid);
+int dpfp_store_capture(struct dpfp_store *store, struct dpfp_dev *dev,
+	uint32_t devid, int timeout);
+unsigned int dpfp_store_get_count(struct dpfp_store *store);
+int dpfp_store_get_frame(struct dpfp_store *store, unsigned int idx,
+	struct dpfp_fprint *view, uint32_t *devid);
+
+struct dpfp_presence_report {
+	/* frames captured while waiting, including the returned one */
+	unsigned long frames;
+	/* fraction of the sensor covered in the returned frame */
+	double coverage;
+	/* times of the first frame showing contact and of the returned frame */
+	double contact_time;
+	double frame_time;
+	/* upper bound on touch-to-frame latency in ms, 0 if the finger was
+	 * already down on the first frame */
+	double latency;
+};
+
+struct dpfp_presence *dpfp_presence_alloc(struct dpfp_fprint *base);
+void dpfp_presence_free(struct dpfp_presence *presence);
+void dpfp_presence_set_base(struct dpfp_presence *presence,
+	struct dpfp_fprint *base);
+void dpfp_presence_set_threshold(struct dpfp_presence *presence, int energy,
+	double coverage);
+double dpfp_presence_get_coverage(struct dpfp_presence *presence,
+	struct dpfp_fprint *fp);
+int dpfp_presence_await(struct dpfp_dev *dev, struct dpfp_presence *presence,
+	struct dpfp_fprint *fp, int timeout, struct dpfp_presence_report *report);
+
+struct dpfp_stable_report {
+	/* frames captured while waiting, including the returned one */
+	unsigned long frames;
+	/* change per pixel of the most changed block into the returned frame */
+	int motion;
+	/* times of the first frame with the finger present and of the returned
+	 * frame, and the time in ms it took the finger to settle */
+	double contact_time;
+	double frame_time;
+	double settle_time;
+};
+
+struct dpfp_stable *dpfp_stable_alloc(void);
+void dpfp_stable_free(struct dpfp_stable *stable);
+void dpfp_stable_set_threshold(struct dpfp_stable *stable, int motion,
+	int frames);
+void dpfp_stable_reset(struct dpfp_stable *stable);
+int dpfp_stable_get_motion(struct dpfp_stable *stable);
+int dpfp_stable_feed(struct dpfp_stable *stable, struct dpfp_fprint *fp);
+int dpfp_stable_await(struct dpfp_dev *dev, struct dpfp_stable *stable,
+	struct dpfp_presence *presence, struct dpfp_fprint *fp, int timeout,
+	int max_wait, struct dpfp_stable_report *report);
+
+enum dpfp_duty_state {
+	DPFP_DUTY_ACTIVE = 0,	/* full frame rate */
+	DPFP_DUTY_THROTTLED,	/* empty sensor, low frame rate */
+	DPFP_DUTY_ASLEEP,	/* waiting for the finger-on interrupt */
+};
+
+struct dpfp_duty_policy {
+	/* empty frames in a row after which the frame rate drops */
+	int idle_frames;
+	/* ms between frames while throttled */
+	int idle_interval;
+	/* ms spent throttled before waiting for the finger-on interrupt
+	 * instead, or -1 to keep polling */
+	int sleep_after;
+	/* presence detector thresholds for a frame to show a finger, see
+	 * dpfp_presence_set_threshold */
+	int energy;
+	double coverage;
+};
+
+void dpfp_duty_policy_init(struct dpfp_duty_policy *policy);
+struct dpfp_continuous *dpfp_continuous_start(struct dpfp_dev *dev,
+	const struct dpfp_duty_policy *policy);
+void dpfp_continuous_stop(struct dpfp_continuous *cont);
+enum dpfp_duty_state dpfp_continuous_get_state(struct dpfp_continuous *cont);
+int dpfp_continuous_next(struct dpfp_continuous *cont, struct dpfp_fprint *fp,
+	int timeout);
+
+/* Rows [first, last) of fp have arrived */
+typedef void (*dpfp_rows_cb)(struct dpfp_fprint *fp, int first, int last,
+	void *user_data);
+
+struct dpfp_stream *dpfp_stream_alloc(struct dpfp_dev *dev);
+void dpfp_stream_free(struct dpfp_stream *stream);
+int dpfp_stream_capture(struct dpfp_stream *stream, struct dpfp_fprint *fp,
+	int timeout, dpfp_rows_cb callback, void *user_data);
+
+struct dpfp_prep *dpfp_prep_alloc(struct dpfp_fprint *base, int soften_size,
+	int block_size, int filter_size);
+void dpfp_prep_free(struct dpfp_prep *prep);
+void dpfp_prep_set_base(struct dpfp_prep *prep, struct dpfp_fprint *base);
+void dpfp_prep_rows(struct dpfp_fprint *fp, int first, int last,
+	void *user_data);
+int dpfp_prep_finish(struct dpfp_prep *prep, struct dpfp_fprint *out,
+	struct dpfp_ffield *direction);
+
+/* dpfp_background_enable flags.
+ *
+ * DPFP_BG_AUTO_SUBTRACT applies to the device, not just to the code that
+ * enabled it: every frame captured through dpfp_capture_fprint comes back
+ * with the base image subtracted. That includes the await functions,
+ * async capture, pipelines, reader managers, frame stores, continuous
+ * sessions and verification. Do not subtract a base image of your own as
+ * well, e.g. with dpfp_fprint_rotate_subtract. Only streams still return
+ * raw frames. Presence and stability detection judge each frame before the
+ * base is subtracted, so their base image stays a raw frame of the empty
+ * sensor either way. */
+#define DPFP_BG_AUTO_SUBTRACT	(1 << 0)
+
+struct dpfp_background_stats {
+	int valid;
+	/* seconds since the model last took in a frame */
+	double age;
+	/* idle frames averaged in, and those that reseeded it after drift */
+	unsigned long updates;
+	unsigned long reseeds;
+	/* frames captured by dpfp_background_refresh */
+	unsigned long refreshes;
+	unsigned long subtracted;
+};
+
+int dpfp_background_enable(struct dpfp_dev *dev, int flags);
+void dpfp_background_disable(struct dpfp_dev *dev);
+void dpfp_background_set_params(struct dpfp_dev *dev, double max_age,
+	int drift);
+void dpfp_background_invalidate(struct dpfp_dev *dev);
+int dpfp_background_needs_refresh(struct dpfp_dev *dev);
+int dpfp_background_refresh(struct dpfp_dev *dev, int timeout);
+int dpfp_background_get_base(struct dpfp_dev *dev, struct dpfp_fprint *fp);
+void dpfp_background_get_stats(struct dpfp_dev *dev,
+	struct dpfp_background_stats *stats);
+
+/* fp and mset are NULL when status reports a capture error */
+typedef void (*dpfp_pipeline_cb)(struct dpfp_pipeline *pl,
+	struct dpfp_fprint *fp, struct dpfp_mset *mset, int status,
+	void *user_data);
+
+struct dpfp_pipeline_stats {
+	unsigned long captured;
+	unsigned long processed;
+	/* captured while every worker was busy */
+	unsigned long dropped;
+};
+
+struct dpfp_pipeline *dpfp_pipeline_start(struct dpfp_dev *dev,
+	struct dpfp_fprint *base, int num_workers, dpfp_pipeline_cb callback,
+	void *user_data);
+void dpfp_pipeline_stop(struct dpfp_pipeline *pl);
+void dpfp_pipeline_get_stats(struct dpfp_pipeline *pl,
+	struct dpfp_pipeline_stats *stats);
+
+enum dpfp_verify_event {
+	DPFP_VERIFY_DECISION = 0,
+	DPFP_VERIFY_LIFT,
+	DPFP_VERIFY_ERROR,
+};
+
+/* When each step of a verification happened, in seconds. Touch-to-decision
+ * latency is decision - touch. lift is only set for DPFP_VERIFY_LIFT. */
+struct dpfp_verify_timeline {
+	double touch;		/* finger-on interrupt */
+	double first_frame;	/* frame off the bus */
+	double enhanced;	/* image enhanced and binarized */
+	double minutiae;	/* minutiae extracted */
+	double decision;	/* matched against the templates */
+	double lift;		/* finger-off interrupt */
+};
+
+struct dpfp_verify_result {
+	/* touch number within the session */
+	unsigned long seq;
+	int status;
+	int match;
+	/* best template and its score, index -1 without templates */
+	int index;
+	float score;
+	/* minutiae of the touch, only set during DPFP_VERIFY_DECISION */
+	struct dpfp_mset *mset;
+	struct dpfp_verify_timeline timeline;
+};
+
+typedef void (*dpfp_verify_cb)(struct dpfp_verify *verify,
+	enum dpfp_verify_event event, const struct dpfp_verify_result *result,
+	void *user_data);
+
+struct dpfp_verify *dpfp_verify_start(struct dpfp_dev *dev,
+	struct dpfp_mset *templates, int num_templates, float threshold,
+	dpfp_verify_cb callback, void *user_data);
+void dpfp_verify_stop(struct dpfp_verify *verify);
+
+enum dpfp_event_type {
+	DPFP_EVENT_FRAME = 0,
+	DPFP_EVENT_FINGER_ON,
+	DPFP_EVENT_FINGER_OFF,
+	DPFP_EVENT_ERROR,
+};
+
+/* fp is only set for DPFP_EVENT_FRAME, and only valid during the callback.
+ * status is the error code for DPFP_EVENT_ERROR; -EOVERFLOW means the
+ * application fell behind and finger and error events of that reader were
+ * dropped. */
+typedef void (*dpfp_manager_cb)(struct dpfp_manager *mgr, int reader,
+	enum dpfp_event_type type, struct dpfp_fprint *fp, int status,
+	void *user_data);
+
+struct dpfp_reader_stats {
+	unsigned long frames;
+	unsigned long errors;
+	/* finger and error events dropped because the queue was full */
+	unsigned long dropped;
+	double fps;
+};
+
+struct dpfp_manager *dpfp_manager_open(int num_workers,
+	dpfp_manager_cb callback, void *user_data);
+void dpfp_manager_close(struct dpfp_manager *mgr);
+int dpfp_manager_get_num_readers(struct dpfp_manager *mgr);
+struct dpfp_dev *dpfp_manager_get_dev(struct dpfp_manager *mgr, int idx);
+int dpfp_manager_start_capture(struct dpfp_manager *mgr, int idx);
+void dpfp_manager_stop_capture(struct dpfp_manager *mgr, int idx);
+int dpfp_manager_get_stats(struct dpfp_manager *mgr, int idx,
+	struct dpfp_reader_stats *stats);
+
+/* Why the watchdog took a device for wedged */
+enum dpfp_wedge_reason {
+	DPFP_WEDGE_TRANSFERS = 0,	/* control/bulk transfers kept failing */
+	DPFP_WEDGE_IRQ,			/* interrupts stopped arriving */
+	DPFP_WEDGE_HWSTAT,		/* hwstat lost scan power or failed */
+};
+
+enum dpfp_watchdog_event {
+	DPFP_WATCHDOG_WEDGED = 0,
+	DPFP_WATCHDOG_RECOVERED,
+	DPFP_WATCHDOG_FAILED,
+};
+
+struct dpfp_watchdog_policy {
+	/* ms between health checks */
+	int interval;
+	/* failed control/bulk transfers in a row; a timeout only counts
+	 * if the transfer had at least the library's default timeout */
+	int transfers;
+	/* interrupts the device owes the library (such as the scan power
+	 * interrupt at power-up) not arriving in a row, 0 to ignore */
+	int irq_timeouts;
+	/* read hwstat at each check, one control transfer per device per
+	 * interval; off by default */
+	int probe;
+	/* recovery attempts, interval ms apart, before giving up */
+	int attempts;
+};
+
+/* status is the error of the last attempt for DPFP_WATCHDOG_FAILED */
+typedef void (*dpfp_watchdog_cb)(struct dpfp_watchdog *wd,
+	struct dpfp_dev *dev, enum dpfp_watchdog_event event,
+	enum dpfp_wedge_reason reason, int status, void *user_data);
+
+void dpfp_watchdog_policy_init(struct dpfp_watchdog_policy *policy);
+struct dpfp_watchdog *dpfp_watchdog_start(
+	const struct dpfp_watchdog_policy *policy, dpfp_watchdog_cb callback,
+	void *user_data);
+void dpfp_watchdog_stop(struct dpfp_watchdog *wd);
+int dpfp_watchdog_add(struct dpfp_watchdog *wd, struct dpfp_dev *dev);
+void dpfp_watchdog_remove(struct dpfp_watchdog *wd, struct dpfp_dev *dev);
+
 int dpfp_simple_get_irq_with_type(struct dpfp_dev *dev, uint16_t irqtype,
 	unsigned char *irqbuf, int timeout);
 
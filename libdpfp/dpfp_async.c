@@ -0,0 +1,255 @@
+/*
+ * Asynchronous capture engine
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* libusb-0.1 has no asynchronous transfer API, so we emulate one: a reader
+ * thread keeps the data endpoint busy by reading frames back-to-back into a
+ * pool of buffers, and a dispatch thread hands completed frames to the
+ * application callback. While the application processes frame n, the next
+ * frame is already being transferred into a spare buffer.
+ *
+ * A bulk read which is already in progress cannot be aborted, so after
+ * cancellation the reader thread may stay busy for up to one frame timeout
+ * before it notices. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+struct dpfp_async {
+	struct dpfp_dev *dev;
+	dpfp_async_cb callback;
+	void *user_data;
+	int timeout;
+
+	int num_bufs;
+	struct dpfp_fprint **bufs;
+	int *status;
+
+	/* FIFOs of buffer indices, each num_bufs long */
+	int *free_q;
+	int free_head, free_count;
+	int *done_q;
+	int done_head, done_count;
+
+	unsigned long seq;
+	int cancelled;
+	int reader_done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t reader;
+	pthread_t dispatcher;
+};
+
+static void q_push(int *q, int head, int *count, int size, int val)
+{
+	q[(head + *count) % size] = val;
+	(*count)++;
+}
+
+static int q_pop(int *q, int *head, int *count, int size)
+{
+	int val = q[*head];
+	*head = (*head + 1) % size;
+	(*count)--;
+	return val;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct dpfp_async *async = arg;
+	int idx;
+	int r;
+
+	pthread_mutex_lock(&async->lock);
+	while (1) {
+		while (async->free_count == 0 && !async->cancelled)
+			pthread_cond_wait(&async->cond, &async->lock);
+		if (async->cancelled)
+			break;
+
+		idx = q_pop(async->free_q, &async->free_head, &async->free_count,
+			async->num_bufs);
+		pthread_mutex_unlock(&async->lock);
+
+		r = dpfp_capture_fprint_timeout(async->dev, async->bufs[idx],
+			async->timeout);
+
+		pthread_mutex_lock(&async->lock);
+		async->bufs[idx]->seq = async->seq++;
+		async->status[idx] = r;
+		q_push(async->done_q, async->done_head, &async->done_count,
+			async->num_bufs, idx);
+		pthread_cond_broadcast(&async->cond);
+
+		/* Timeouts are reported per frame, anything else means the
+		 * device has gone away, is wedged or has lost frame sync */
+		if (r < 0 && r != -ETIMEDOUT) {
+			dbgf(DBG_ERR, "capture failed (%d), stopping", r);
+			break;
+		}
+	}
+
+	async->reader_done = 1;
+	pthread_cond_broadcast(&async->cond);
+	pthread_mutex_unlock(&async->lock);
+	return NULL;
+}
+
+static void *dispatch_thread(void *arg)
+{
+	struct dpfp_async *async = arg;
+	int idx;
+
+	pthread_mutex_lock(&async->lock);
+	while (1) {
+		while (async->done_count == 0 && !async->reader_done)
+			pthread_cond_wait(&async->cond, &async->lock);
+
+		/* Frames which completed before cancellation are dropped */
+		if (async->done_count == 0 || async->cancelled)
+			break;
+
+		idx = q_pop(async->done_q, &async->done_head, &async->done_count,
+			async->num_bufs);
+		pthread_mutex_unlock(&async->lock);
+
+		async->callback(async, async->bufs[idx], async->status[idx],
+			async->user_data);
+
+		pthread_mutex_lock(&async->lock);
+		q_push(async->free_q, async->free_head, &async->free_count,
+			async->num_bufs, idx);
+		pthread_cond_broadcast(&async->cond);
+	}
+	pthread_mutex_unlock(&async->lock);
+	return NULL;
+}
+
+static void async_free(struct dpfp_async *async)
+{
+	int i;
+
+	for (i = 0; async->bufs && i < async->num_bufs; i++)
+		if (async->bufs[i])
+			dpfp_fprint_free(async->bufs[i]);
+
+	pthread_cond_destroy(&async->cond);
+	pthread_mutex_destroy(&async->lock);
+	free(async->bufs);
+	free(async->status);
+	free(async->free_q);
+	free(async->done_q);
+	free(async);
+}
+
+/* Start streaming frames from dev. The device should already be in
+ * DPFP_MODE_SEND_FINGER. num_bufs frame buffers (at least 2) are allocated
+ * and cycled between the USB transfer and the callback. timeout is the
+ * deadline in milliseconds for each frame; a frame which never started by
+ * then is reported to the callback with status -ETIMEDOUT and streaming
+ * continues. Any other error, including -EPIPE for a frame that timed out
+ * half way and left the endpoint out of step, is reported once and ends
+ * the stream. */
+struct dpfp_async *dpfp_async_start(struct dpfp_dev *dev, int num_bufs,
+	int timeout, dpfp_async_cb callback, void *user_data)
+{
+	struct dpfp_async *async;
+	int i;
+
+	if (num_bufs < 2 || callback == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	async = malloc(sizeof(*async));
+	if (async == NULL)
+		return NULL;
+
+	memset(async, 0, sizeof(*async));
+	async->dev = dev;
+	async->callback = callback;
+	async->user_data = user_data;
+	async->timeout = timeout > 0 ? timeout : DATA_TIMEOUT;
+	async->num_bufs = num_bufs;
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->cond, NULL);
+
+	async->bufs = calloc(num_bufs, sizeof(*async->bufs));
+	async->status = calloc(num_bufs, sizeof(*async->status));
+	async->free_q = calloc(num_bufs, sizeof(*async->free_q));
+	async->done_q = calloc(num_bufs, sizeof(*async->done_q));
+	if (!async->bufs || !async->status || !async->free_q || !async->done_q)
+		goto err;
+
+	for (i = 0; i < num_bufs; i++) {
+		async->bufs[i] = dpfp_fprint_alloc();
+		if (async->bufs[i] == NULL)
+			goto err;
+		q_push(async->free_q, async->free_head, &async->free_count,
+			num_bufs, i);
+	}
+
+	if (pthread_create(&async->reader, NULL, reader_thread, async) != 0)
+		goto err;
+
+	if (pthread_create(&async->dispatcher, NULL, dispatch_thread,
+			async) != 0) {
+		dpfp_async_cancel(async);
+		pthread_join(async->reader, NULL);
+		goto err;
+	}
+
+	return async;
+
+err:
+	async_free(async);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* Request that streaming stops. Safe to call from the callback. Apart from
+ * a callback which may already be running, no further frames are delivered
+ * once this returns. */
+void dpfp_async_cancel(struct dpfp_async *async)
+{
+	pthread_mutex_lock(&async->lock);
+	async->cancelled = 1;
+	pthread_cond_broadcast(&async->cond);
+	pthread_mutex_unlock(&async->lock);
+}
+
+/* Cancel streaming, wait for the engine to wind down and free it. Must not
+ * be called from the callback. */
+void dpfp_async_stop(struct dpfp_async *async)
+{
+	dpfp_async_cancel(async);
+	pthread_join(async->reader, NULL);
+	pthread_join(async->dispatcher, NULL);
+	async_free(async);
+}
+
+struct dpfp_dev *dpfp_async_get_dev(struct dpfp_async *async)
+{
+	return async->dev;
+}
@@ -0,0 +1,360 @@
+/*
+ * Per-device background model
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Fingerprint images only make sense once an image of the empty sensor has
+ * been subtracted. Rather than capturing that base image before every
+ * fingerprint, the device keeps a model of it.
+ *
+ * The model is a per-pixel running average in 8.8 fixed point. It is seeded
+ * from one frame of the empty sensor by dpfp_background_refresh. After that,
+ * every frame captured from the device is compared to it with the presence
+ * detector. Frames with (next to) no covered blocks are idle and are folded
+ * in at a weight of 1/2^BG_SHIFT, so the model follows slow changes for
+ * free. If an idle frame is further from the model than the drift limit,
+ * the sensor has changed too fast for averaging to catch up. The model is
+ * then reseeded from that frame instead.
+ *
+ * A model that has not seen an idle frame for max_age seconds is stale.
+ * Only then does dpfp_background_refresh spend a USB frame on it. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define BG_PIXELS	(DATABLK1_RQSIZE + DATABLK2_RQSIZE - 64)
+#define BG_SHIFT	3
+
+/* fraction of covered blocks up to which a frame still counts as idle */
+#define IDLE_COVERAGE		0.02
+#define DEFAULT_MAX_AGE		300
+#define DEFAULT_DRIFT		8
+
+struct dpfp_background {
+	pthread_mutex_t lock;
+	int flags;
+	int valid;
+	/* running average, 8.8 fixed point */
+	uint16_t acc[BG_PIXELS];
+	/* acc rounded to 8 bits, what gets subtracted */
+	struct dpfp_fprint *base;
+	/* scratch frame for dpfp_background_refresh */
+	struct dpfp_fprint *frame;
+	struct dpfp_presence *presence;
+	/* time of the last frame folded into the model */
+	double updated;
+	double max_age;
+	/* limit on the sum of |frame - base| over the frame */
+	unsigned long drift;
+	struct dpfp_background_stats stats;
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return TV_TO_DOUBLE(tv);
+}
+
+static void render(struct dpfp_background *bg, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		bg->base->data[i] = (bg->acc[i] + 0x80) >> 8;
+	bg->base->data_size = size;
+	dpfp_presence_set_base(bg->presence, bg->base);
+}
+
+static void seed(struct dpfp_background *bg, struct dpfp_fprint *fp)
+{
+	size_t i;
+
+	for (i = 0; i < fp->data_size; i++)
+		bg->acc[i] = fp->data[i] << 8;
+	bg->base->header_size = fp->header_size;
+	memcpy(bg->base->header, fp->header, fp->header_size);
+	render(bg, fp->data_size);
+	bg->valid = 1;
+	bg->updated = fp->timestamp;
+}
+
+/* Fold an idle frame into the model, or reseed from it if the sensor has
+ * drifted too far */
+static void fold(struct dpfp_background *bg, struct dpfp_fprint *fp)
+{
+	unsigned long residual = 0;
+	size_t i;
+
+	for (i = 0; i < fp->data_size; i++)
+		residual += abs(fp->data[i] - bg->base->data[i]);
+
+	if (residual > bg->drift * fp->data_size) {
+		dbgf(DBG_INFO, "drift %lu, reseeding",
+			residual / fp->data_size);
+		seed(bg, fp);
+		bg->stats.reseeds++;
+		return;
+	}
+
+	for (i = 0; i < fp->data_size; i++) {
+		int delta = (fp->data[i] << 8) - bg->acc[i];
+		bg->acc[i] += delta >> BG_SHIFT;
+	}
+	render(bg, fp->data_size);
+	bg->updated = fp->timestamp;
+	bg->stats.updates++;
+}
+
+static int is_idle(struct dpfp_background *bg, struct dpfp_fprint *fp)
+{
+	return dpfp_presence_get_coverage(bg->presence, fp) <= IDLE_COVERAGE;
+}
+
+/* Called on every frame captured from a device with a background model */
+void dpfp_background_apply(struct dpfp_dev *dev, struct dpfp_fprint *fp)
+{
+	struct dpfp_background *bg = dev->background;
+
+	pthread_mutex_lock(&bg->lock);
+	if (bg->valid && fp->data_size == bg->base->data_size) {
+		if (is_idle(bg, fp))
+			fold(bg, fp);
+		if (bg->flags & DPFP_BG_AUTO_SUBTRACT) {
+			dpfp_fprint_subtract(fp, bg->base);
+			bg->stats.subtracted++;
+		}
+	}
+	pthread_mutex_unlock(&bg->lock);
+}
+
+/* Give dev a background model. With DPFP_BG_AUTO_SUBTRACT, frames returned
+ * by dpfp_capture_fprint and everything built on it have the base image
+ * subtracted already (see dpfp.h). The model starts out empty; call
+ * dpfp_background_refresh with the finger away from the sensor to seed it.
+ * Calling this again only changes the flags. */
+int dpfp_background_enable(struct dpfp_dev *dev, int flags)
+{
+	struct dpfp_background *bg = dev->background;
+
+	if (bg) {
+		pthread_mutex_lock(&bg->lock);
+		bg->flags = flags;
+		pthread_mutex_unlock(&bg->lock);
+		return 0;
+	}
+
+	bg = malloc(sizeof(*bg));
+	if (bg == NULL)
+		return -ENOMEM;
+
+	memset(bg, 0, sizeof(*bg));
+	bg->base = dpfp_fprint_alloc();
+	bg->frame = dpfp_fprint_alloc();
+	if (bg->base == NULL || bg->frame == NULL)
+		goto err;
+
+	/* the presence detector needs a base; it is replaced on seeding */
+	memset(bg->base->header, 0, DATABLK1_RQSIZE + DATABLK2_RQSIZE);
+	bg->base->data_size = DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT;
+	bg->presence = dpfp_presence_alloc(bg->base);
+	if (bg->presence == NULL)
+		goto err;
+
+	pthread_mutex_init(&bg->lock, NULL);
+	bg->flags = flags;
+	bg->max_age = DEFAULT_MAX_AGE;
+	bg->drift = DEFAULT_DRIFT;
+	dev->background = bg;
+	return 0;
+
+err:
+	if (bg->base)
+		dpfp_fprint_free(bg->base);
+	if (bg->frame)
+		dpfp_fprint_free(bg->frame);
+	free(bg);
+	return -ENOMEM;
+}
+
+/* Flags the model was last enabled with, 0 if there is none */
+int dpfp_background_get_flags(struct dpfp_dev *dev)
+{
+	struct dpfp_background *bg = dev->background;
+	int flags;
+
+	if (bg == NULL)
+		return 0;
+
+	pthread_mutex_lock(&bg->lock);
+	flags = bg->flags;
+	pthread_mutex_unlock(&bg->lock);
+	return flags;
+}
+
+void dpfp_background_disable(struct dpfp_dev *dev)
+{
+	struct dpfp_background *bg = dev->background;
+
+	if (bg == NULL)
+		return;
+
+	dev->background = NULL;
+	pthread_mutex_destroy(&bg->lock);
+	dpfp_presence_free(bg->presence);
+	dpfp_fprint_free(bg->base);
+	dpfp_fprint_free(bg->frame);
+	free(bg);
+}
+
+/* max_age: seconds without an idle frame after which the model is stale, 0
+ * for never. drift: mean absolute difference (0-255) between an idle frame
+ * and the model above which the model is reseeded rather than averaged. */
+void dpfp_background_set_params(struct dpfp_dev *dev, double max_age,
+	int drift)
+{
+	struct dpfp_background *bg = dev->background;
+
+	if (bg == NULL)
+		return;
+
+	pthread_mutex_lock(&bg->lock);
+	bg->max_age = max_age;
+	bg->drift = drift;
+	pthread_mutex_unlock(&bg->lock);
+}
+
+/* Forget the model, e.g. after changing something that affects the
+ * illumination of the sensor */
+void dpfp_background_invalidate(struct dpfp_dev *dev)
+{
+	struct dpfp_background *bg = dev->background;
+
+	if (bg == NULL)
+		return;
+
+	pthread_mutex_lock(&bg->lock);
+	bg->valid = 0;
+	pthread_mutex_unlock(&bg->lock);
+}
+
+static int needs_refresh(struct dpfp_background *bg)
+{
+	if (!bg->valid)
+		return 1;
+	return bg->max_age > 0 && now() - bg->updated > bg->max_age;
+}
+
+int dpfp_background_needs_refresh(struct dpfp_dev *dev)
+{
+	struct dpfp_background *bg = dev->background;
+	int r;
+
+	if (bg == NULL)
+		return 0;
+
+	pthread_mutex_lock(&bg->lock);
+	r = needs_refresh(bg);
+	pthread_mutex_unlock(&bg->lock);
+	return r;
+}
+
+/* Capture a new base image if the model is empty or stale, otherwise do
+ * nothing. The finger should be away from the sensor. dev is left in
+ * DPFP_MODE_SEND_FINGER if a frame was captured. timeout is in
+ * milliseconds, 0 for the default. Returns 1 if the model was refreshed, 0
+ * if it was still good, and -EAGAIN if the frame showed a finger on the
+ * sensor. */
+int dpfp_background_refresh(struct dpfp_dev *dev, int timeout)
+{
+	struct dpfp_background *bg = dev->background;
+	int r;
+
+	if (bg == NULL)
+		return -EINVAL;
+	if (!dpfp_background_needs_refresh(dev))
+		return 0;
+	if (timeout <= 0)
+		timeout = DATA_TIMEOUT;
+
+	r = dpfp_set_mode(dev, DPFP_MODE_SEND_FINGER);
+	if (r < 0)
+		return r;
+
+	r = dpfp_capture_raw(dev, bg->frame, timeout);
+	if (r < 0)
+		return r;
+
+	pthread_mutex_lock(&bg->lock);
+	bg->stats.refreshes++;
+	/* a stale model is still good enough to spot a finger */
+	if (bg->valid && !is_idle(bg, bg->frame)) {
+		r = -EAGAIN;
+	} else {
+		seed(bg, bg->frame);
+		r = 1;
+	}
+	pthread_mutex_unlock(&bg->lock);
+	return r;
+}
+
+/* Copy the current base image into fp */
+int dpfp_background_get_base(struct dpfp_dev *dev, struct dpfp_fprint *fp)
+{
+	struct dpfp_background *bg = dev->background;
+	int r = 0;
+
+	if (bg == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&bg->lock);
+	if (bg->valid) {
+		memcpy(fp->header, bg->base->header,
+			bg->base->header_size + bg->base->data_size);
+		fp->header_size = bg->base->header_size;
+		fp->data_size = bg->base->data_size;
+		fp->timestamp = bg->updated;
+	} else {
+		r = -ENODATA;
+	}
+	pthread_mutex_unlock(&bg->lock);
+	return r;
+}
+
+void dpfp_background_get_stats(struct dpfp_dev *dev,
+	struct dpfp_background_stats *stats)
+{
+	struct dpfp_background *bg = dev->background;
+
+	memset(stats, 0, sizeof(*stats));
+	if (bg == NULL)
+		return;
+
+	pthread_mutex_lock(&bg->lock);
+	*stats = bg->stats;
+	stats->valid = bg->valid;
+	stats->age = bg->valid ? now() - bg->updated : 0;
+	pthread_mutex_unlock(&bg->lock);
+}
@@ -0,0 +1,310 @@
+/*
+ * Duty-cycled continuous capture
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Streaming frames from an empty sensor costs a CPU core and the USB
+ * bandwidth of a full frame rate for nothing. A continuous capture session
+ * watches every frame with the presence detector and steps down while the
+ * sensor stays empty:
+ *
+ *   ACTIVE     frames at the full rate, until idle_frames empty frames in
+ *              a row
+ *   THROTTLED  one frame every idle_interval ms, until sleep_after ms have
+ *              passed like that
+ *   ASLEEP     the sensor is in DPFP_MODE_AWAIT_FINGER_ON and no frames
+ *              are read at all; we block on the interrupt endpoint
+ *
+ * Any frame showing a finger, or the finger-on interrupt, goes straight
+ * back to ACTIVE.
+ *
+ * Presence is judged on the raw frame against a base image of the empty
+ * sensor. That is the background model's base if the device has one,
+ * otherwise the first frame of the session, and it follows empty frames
+ * seen while idle.
+ *
+ * An application which has to stay responsive while the sensor sleeps
+ * should not call dpfp_continuous_next with a short timeout in a loop: that
+ * keeps re-arming interrupt reads, and libusb-0.1 can lose an interrupt
+ * which arrives as a read times out. Instead it starts a listener
+ * (dpfp_irq_start) and, while the state is ASLEEP, waits for
+ * dpfp_irq_get_fd to become readable in its own poll loop. The session
+ * reads the listener's queue from where it was when the sensor went to
+ * sleep, so a finger-on interrupt which arrives before the next call is
+ * not lost. */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define DEFAULT_IDLE_FRAMES	10
+#define DEFAULT_IDLE_INTERVAL	250
+#define DEFAULT_SLEEP_AFTER	5000
+#define DEFAULT_COVERAGE	0.05
+#define DEFAULT_ENERGY		20
+
+struct dpfp_continuous {
+	struct dpfp_dev *dev;
+	struct dpfp_duty_policy policy;
+	struct dpfp_presence *presence;
+	int have_base;
+	enum dpfp_duty_state state;
+	/* empty frames in a row */
+	int empty;
+	/* when throttling began, and when the next throttled frame is due */
+	double idle_since;
+	double next_frame;
+	/* listener read position from when the sensor went to sleep */
+	unsigned long irq_pos;
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return TV_TO_DOUBLE(tv);
+}
+
+static void sleep_until(double t)
+{
+	double d = t - now();
+
+	if (d > 0)
+		usleep(d * 1000000);
+}
+
+void dpfp_duty_policy_init(struct dpfp_duty_policy *policy)
+{
+	policy->idle_frames = DEFAULT_IDLE_FRAMES;
+	policy->idle_interval = DEFAULT_IDLE_INTERVAL;
+	policy->sleep_after = DEFAULT_SLEEP_AFTER;
+	policy->coverage = DEFAULT_COVERAGE;
+	policy->energy = DEFAULT_ENERGY;
+}
+
+/* Start continuous capture from dev, following policy, or the defaults if
+ * NULL. The sensor should be empty when this is called unless the device
+ * has a background model. Puts dev in DPFP_MODE_SEND_FINGER. */
+struct dpfp_continuous *dpfp_continuous_start(struct dpfp_dev *dev,
+	const struct dpfp_duty_policy *policy)
+{
+	struct dpfp_continuous *cont;
+	struct dpfp_fprint *base;
+	int r;
+
+	cont = malloc(sizeof(*cont));
+	if (cont == NULL)
+		return NULL;
+
+	memset(cont, 0, sizeof(*cont));
+	cont->dev = dev;
+	if (policy)
+		cont->policy = *policy;
+	else
+		dpfp_duty_policy_init(&cont->policy);
+
+	base = dpfp_fprint_alloc();
+	if (base == NULL)
+		goto err;
+
+	/* a placeholder until there is a real base image */
+	memset(base->header, 0, DATABLK1_RQSIZE + DATABLK2_RQSIZE);
+	base->data_size = DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT;
+	if (dev->background && dpfp_background_get_base(dev, base) == 0)
+		cont->have_base = 1;
+
+	cont->presence = dpfp_presence_alloc(base);
+	dpfp_fprint_free(base);
+	if (cont->presence == NULL)
+		goto err;
+	dpfp_presence_set_threshold(cont->presence, cont->policy.energy,
+		cont->policy.coverage);
+
+	r = dpfp_set_mode(dev, DPFP_MODE_SEND_FINGER);
+	if (r < 0) {
+		dpfp_presence_free(cont->presence);
+		free(cont);
+		errno = -r;
+		return NULL;
+	}
+
+	return cont;
+
+err:
+	free(cont);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* End the session. A sleeping sensor is put back into
+ * DPFP_MODE_SEND_FINGER. */
+void dpfp_continuous_stop(struct dpfp_continuous *cont)
+{
+	if (cont->state == DPFP_DUTY_ASLEEP)
+		dpfp_set_mode(cont->dev, DPFP_MODE_SEND_FINGER);
+	dpfp_presence_free(cont->presence);
+	free(cont);
+}
+
+enum dpfp_duty_state dpfp_continuous_get_state(struct dpfp_continuous *cont)
+{
+	return cont->state;
+}
+
+/* Read one interrupt within ms milliseconds, 0 for no limit */
+static int read_irq(struct dpfp_continuous *cont, unsigned char *buf, int ms)
+{
+	struct dpfp_dev *dev = cont->dev;
+	int r;
+
+	/* dpfp_get_irq knows how to wait forever on every platform */
+	if (__atomic_load_n(&dev->irq, __ATOMIC_ACQUIRE))
+		r = dpfp_irq_wait(dev, &cont->irq_pos, buf, ms);
+	else if (ms <= 0)
+		return dpfp_get_irq(dev, buf, 0);
+	else
+		r = dpfp_interrupt_read(dev, EP_INTR, buf, DPFP_IRQ_LENGTH, ms);
+	if (r < 0)
+		return r;
+	return r < DPFP_IRQ_LENGTH ? -EIO : 0;
+}
+
+/* Wait for the finger-on interrupt, until deadline if not 0 */
+static int await_touch(struct dpfp_continuous *cont, double deadline)
+{
+	unsigned char buf[DPFP_IRQ_LENGTH];
+	int ms = 0;
+	int r;
+
+	while (1) {
+		if (deadline) {
+			/* rounded up, so that a 1 ms timeout still picks up an
+			 * interrupt the listener has already queued */
+			ms = ceil((deadline - now()) * 1000);
+			if (ms <= 0)
+				return -ETIMEDOUT;
+		}
+
+		r = read_irq(cont, buf, ms);
+		if (r < 0)
+			return r;
+		if (be16_to_cpu(*((uint16_t *) buf)) == DPFP_IRQDATA_FINGER_ON)
+			return 0;
+		TELEMETRY_INC(cont->dev, discarded_irqs);
+	}
+}
+
+/* Move between states after looking at a frame */
+static int update_state(struct dpfp_continuous *cont, struct dpfp_fprint *fp)
+{
+	struct dpfp_duty_policy *policy = &cont->policy;
+	double coverage;
+
+	if (!cont->have_base) {
+		dpfp_presence_set_base(cont->presence, fp);
+		cont->have_base = 1;
+		coverage = 0;
+	} else {
+		coverage = dpfp_presence_get_coverage(cont->presence, fp);
+	}
+
+	if (coverage >= policy->coverage) {
+		if (cont->state != DPFP_DUTY_ACTIVE)
+			dbg(DBG_INFO, "finger, full rate");
+		cont->state = DPFP_DUTY_ACTIVE;
+		cont->empty = 0;
+		return 0;
+	}
+
+	cont->empty++;
+	/* keep up with the empty sensor, but only while idle so that a
+	 * finger which is just arriving doesn't become part of the base */
+	if (coverage == 0 && cont->state != DPFP_DUTY_ACTIVE)
+		dpfp_presence_set_base(cont->presence, fp);
+
+	if (cont->state == DPFP_DUTY_ACTIVE
+			&& cont->empty >= policy->idle_frames) {
+		dbg(DBG_INFO, "sensor empty, throttling");
+		cont->state = DPFP_DUTY_THROTTLED;
+		cont->idle_since = fp->timestamp;
+	} else if (cont->state == DPFP_DUTY_THROTTLED
+			&& policy->sleep_after >= 0
+			&& (fp->timestamp - cont->idle_since) * 1000
+				>= policy->sleep_after) {
+		int r;
+
+		cont->irq_pos = dpfp_irq_position(cont->dev);
+		r = dpfp_set_mode(cont->dev, DPFP_MODE_AWAIT_FINGER_ON);
+		if (r < 0)
+			return r;
+		dbg(DBG_INFO, "sensor empty, waiting for interrupt");
+		cont->state = DPFP_DUTY_ASLEEP;
+	}
+
+	cont->next_frame = fp->timestamp + policy->idle_interval / 1000.0;
+	return 0;
+}
+
+/* Get the next frame of the session into fp. While the sensor is idle this
+ * blocks for as long as the policy says, so calling it in a loop is cheap.
+ * timeout is in milliseconds and bounds that wait, 0 for no limit; a
+ * frame which has started arriving is always waited for. Returns
+ * -ETIMEDOUT if no frame was due within timeout. */
+int dpfp_continuous_next(struct dpfp_continuous *cont, struct dpfp_fprint *fp,
+	int timeout)
+{
+	struct dpfp_dev *dev = cont->dev;
+	double deadline = timeout > 0 ? now() + timeout / 1000.0 : 0;
+	int r;
+
+	if (__atomic_load_n(&dev->unplugged, __ATOMIC_RELAXED))
+		return -ENODEV;
+
+	if (cont->state == DPFP_DUTY_ASLEEP) {
+		r = await_touch(cont, deadline);
+		if (r < 0)
+			return r;
+		r = dpfp_set_mode(dev, DPFP_MODE_SEND_FINGER);
+		if (r < 0)
+			return r;
+		dbg(DBG_INFO, "finger-on interrupt, full rate");
+		cont->state = DPFP_DUTY_ACTIVE;
+		cont->empty = 0;
+	} else if (cont->state == DPFP_DUTY_THROTTLED) {
+		if (deadline && cont->next_frame > deadline) {
+			sleep_until(deadline);
+			return -ETIMEDOUT;
+		}
+		sleep_until(cont->next_frame);
+	}
+
+	r = dpfp_capture_raw(dev, fp, DATA_TIMEOUT);
+	if (r < 0)
+		return r;
+
+	r = update_state(cont, fp);
+	if (dev->background)
+		dpfp_background_apply(dev, fp);
+	return r;
+}
@@ -0,0 +1,337 @@
+/*
+ * Image decryption
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* With encryption enabled in the firmware, the image blocks listed in the
+ * frame header may be scrambled. The key is a 32-bit LFSR state. The header
+ * names a key number, and the sensor gives out the key for a number in
+ * exchange for a challenge (see get_key). Each byte of an encrypted block
+ * is the next byte xored with 8 bits picked from the key, and the key is
+ * stepped once per byte. Blocks which are not encrypted still step the
+ * key, unless flagged otherwise. Blocks flagged as not present were never
+ * transferred: they take up no image data and do not step the key.
+ *
+ * Stepping the key is linear over GF(2), and so is picking the xor byte.
+ * The effect of each byte of the key on the next 8 xor bytes and on the key
+ * 8 steps later can therefore be tabulated separately, and the results
+ * xored together. That makes 8 bytes of keystream cost 8 table lookups,
+ * and the xor itself is done 16 bytes at a time with SSE2. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+/* LFSR taps at bit positions 1 3 4 7 11 13 20 23 26 29 32 */
+#define KEY_TAPS	0x9248144d
+
+struct dpfp_crypt {
+	uint32_t keys[256];
+	unsigned char have_key[256];
+};
+
+/* xor bytes for the next 8 steps, and the key 8 steps on, indexed by each
+ * byte of the current key */
+static uint64_t stream_tbl[4][256];
+static uint32_t step_tbl[4][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static uint32_t update_key(uint32_t key)
+{
+	uint32_t bit = key & KEY_TAPS;
+
+	bit ^= bit << 16;
+	bit ^= bit << 8;
+	bit ^= bit << 4;
+	bit ^= bit << 2;
+	bit ^= bit << 1;
+	return (bit & 0x80000000) | (key >> 1);
+}
+
+static unsigned char key_byte(uint32_t key)
+{
+	return ((key >> 4) & 1)
+		| ((key >> 8) & 1) << 1
+		| ((key >> 11) & 1) << 2
+		| ((key >> 14) & 1) << 3
+		| ((key >> 18) & 1) << 4
+		| ((key >> 21) & 1) << 5
+		| ((key >> 24) & 1) << 6
+		| ((key >> 29) & 1) << 7;
+}
+
+static void build_tables(void)
+{
+	int b, v, j;
+
+	for (b = 0; b < 4; b++)
+		for (v = 0; v < 256; v++) {
+			uint32_t key = (uint32_t) v << (b * 8);
+			unsigned char ks[8];
+
+			for (j = 0; j < 8; j++) {
+				ks[j] = key_byte(key);
+				key = update_key(key);
+			}
+			/* in memory order, whatever the endianness */
+			memcpy(&stream_tbl[b][v], ks, sizeof(ks));
+			step_tbl[b][v] = key;
+		}
+}
+
+static uint64_t next8(uint32_t *key)
+{
+	uint32_t k = *key;
+
+	*key = step_tbl[0][k & 0xff] ^ step_tbl[1][(k >> 8) & 0xff]
+		^ step_tbl[2][(k >> 16) & 0xff] ^ step_tbl[3][k >> 24];
+	return stream_tbl[0][k & 0xff] ^ stream_tbl[1][(k >> 8) & 0xff]
+		^ stream_tbl[2][(k >> 16) & 0xff] ^ stream_tbl[3][k >> 24];
+}
+
+/* Decrypt bytes [0, n) of data in place. Each one is made from the byte
+ * after it, so data[n] must be readable. Returns the key n steps on. */
+static uint32_t decode_span(unsigned char *data, int n, uint32_t key)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= n; i += 16) {
+		uint64_t ks[2];
+		__m128i d;
+
+		ks[0] = next8(&key);
+		ks[1] = next8(&key);
+		d = _mm_loadu_si128((const __m128i *) (data + i + 1));
+		d = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *) ks));
+		_mm_storeu_si128((__m128i *) (data + i), d);
+	}
+#endif
+
+	for (; i + 8 <= n; i += 8) {
+		uint64_t ks = next8(&key);
+		uint64_t d;
+
+		memcpy(&d, data + i + 1, sizeof(d));
+		d ^= ks;
+		memcpy(data + i, &d, sizeof(d));
+	}
+
+	for (; i < n; i++) {
+		data[i] = data[i + 1] ^ key_byte(key);
+		key = update_key(key);
+	}
+
+	return key;
+}
+
+/* Step the key n times without decrypting anything */
+static uint32_t skip_key(uint32_t key, int n)
+{
+	for (; n >= 8; n -= 8)
+		next8(&key);
+	for (; n > 0; n--)
+		key = update_key(key);
+	return key;
+}
+
+/* Ask the sensor for the key behind a key number. The answer does not
+ * change while the device is open, so it is only asked once. */
+static int get_key(struct dpfp_dev *dev, int key_number, uint32_t *key)
+{
+	struct dpfp_crypt *crypt = dev->crypt;
+	unsigned char challenge[DPFP_CHALLENGE_LENGTH];
+	unsigned char response[DPFP_RESPONSE_LENGTH];
+	int r;
+
+	if (crypt == NULL) {
+		crypt = calloc(1, sizeof(*crypt));
+		if (crypt == NULL)
+			return -ENOMEM;
+		dev->crypt = crypt;
+	}
+
+	if (crypt->have_key[key_number]) {
+		*key = crypt->keys[key_number];
+		return 0;
+	}
+
+	memset(challenge, 0, sizeof(challenge));
+	challenge[0] = key_number;
+	r = dpfp_challenge(dev, challenge);
+	if (r < 0)
+		return r;
+
+	r = dpfp_read_response(dev, response);
+	if (r < 0)
+		return r;
+
+	*key = response[0] | response[1] << 8 | response[2] << 16
+		| (uint32_t) response[3] << 24;
+	dbgf(DBG_INFO, "key %02x is %08x", key_number, *key);
+
+	crypt->keys[key_number] = *key;
+	crypt->have_key[key_number] = 1;
+	return 0;
+}
+
+/* Set up for the block the decoder has just reached */
+static int enter_block(struct dpfp_dev *dev, struct dpfp_decoder *dec)
+{
+	struct dpfp_frame_block *block = &dec->info.blocks[dec->block];
+
+	if ((block->flags & (DPFP_BLOCK_NO_KEY_UPDATE | DPFP_BLOCK_ENCRYPTED))
+			== (DPFP_BLOCK_NO_KEY_UPDATE | DPFP_BLOCK_ENCRYPTED)) {
+		dbgf(DBG_ERR, "bad flags %02x on block %d", block->flags,
+			dec->block);
+		return -EPROTO;
+	}
+
+	if (block->flags & DPFP_BLOCK_CHANGE_KEY) {
+		dec->key_number = (dec->key_number + 1) & 0xff;
+		return get_key(dev, dec->key_number, &dec->key);
+	}
+
+	return 0;
+}
+
+/* Get ready to decrypt fp, whose header must already have arrived */
+int dpfp_decrypt_start(struct dpfp_dev *dev, struct dpfp_fprint *fp,
+	struct dpfp_decoder *dec)
+{
+	int r;
+
+	pthread_once(&tables_once, build_tables);
+
+	r = dpfp_fprint_get_info(fp, &dec->info);
+	if (r < 0)
+		return r;
+
+	dec->key_number = dec->info.key_number;
+	r = get_key(dev, dec->key_number, &dec->key);
+	if (r < 0)
+		return r;
+
+	dec->block = 0;
+	dec->start = 0;
+	dec->pos = 0;
+	return enter_block(dev, dec);
+}
+
+/* Decrypt as much of fp as the first avail bytes of image data allow.
+ * Returns how many bytes at the start of the image are now plaintext. */
+int dpfp_decrypt_upto(struct dpfp_dev *dev, struct dpfp_fprint *fp,
+	struct dpfp_decoder *dec, int avail)
+{
+	unsigned char *data = fp->data;
+	int r;
+
+	while (dec->block < dec->info.num_blocks) {
+		struct dpfp_frame_block *block = &dec->info.blocks[dec->block];
+		int end = dec->start;
+		int stop;
+
+		if (!(block->flags & DPFP_BLOCK_NOT_PRESENT))
+			end += block->num_lines * DPFP_IMG_WIDTH;
+		stop = end < avail ? end : avail;
+
+		switch (block->flags & (DPFP_BLOCK_NOT_PRESENT
+				| DPFP_BLOCK_NO_KEY_UPDATE | DPFP_BLOCK_ENCRYPTED)) {
+		case DPFP_BLOCK_ENCRYPTED:
+			/* a byte can only be decrypted once the one after it
+			 * has arrived. The last byte of a block has nothing
+			 * after it and is always zero. */
+			stop--;
+			if (stop > dec->pos) {
+				dec->key = decode_span(data + dec->pos,
+					stop - dec->pos, dec->key);
+				dec->pos = stop;
+			}
+			if (dec->pos == end - 1 && avail >= end) {
+				data[dec->pos++] = 0;
+				dec->key = update_key(dec->key);
+			}
+			break;
+		case 0:
+			dec->key = skip_key(dec->key, stop - dec->pos);
+			dec->pos = stop;
+			break;
+		default:
+			/* not present, or the key is left alone */
+			dec->pos = stop;
+			break;
+		}
+
+		if (dec->pos < end)
+			break;
+
+		dec->start = end;
+		if (++dec->block < dec->info.num_blocks) {
+			r = enter_block(dev, dec);
+			if (r < 0)
+				return r;
+		}
+	}
+
+	return dec->pos;
+}
+
+/* Decrypt a whole frame in place */
+int dpfp_decrypt_frame(struct dpfp_dev *dev, struct dpfp_fprint *fp)
+{
+	struct dpfp_decoder dec;
+	int r;
+
+	r = dpfp_decrypt_start(dev, fp, &dec);
+	if (r < 0)
+		return r;
+
+	r = dpfp_decrypt_upto(dev, fp, &dec, fp->data_size);
+	if (r < 0)
+		return r;
+
+	if (r < dec.info.num_lines * DPFP_IMG_WIDTH) {
+		dbgf(DBG_ERR, "truncated frame, %d of %d bytes", r,
+			dec.info.num_lines * DPFP_IMG_WIDTH);
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+/* Forget the keys asked for so far; they are asked for again as frames
+ * need them. Only called by dpfp_recover, while no frame is in flight. */
+void dpfp_crypt_reset(struct dpfp_dev *dev)
+{
+	if (dev->crypt)
+		memset(dev->crypt->have_key, 0, sizeof(dev->crypt->have_key));
+}
+
+void dpfp_crypt_free(struct dpfp_dev *dev)
+{
+	free(dev->crypt);
+	dev->crypt = NULL;
+}
@@ -26,6 +26,10 @@
 #include "dpfp.h"
 #include "dpfp_private.h"
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 struct dpfp_fprint *dpfp_fprint_alloc()
 {
 	struct dpfp_fprint *fp = malloc(sizeof(*fp));
@@ -168,3 +172,166 @@ void dpfp_fprint_subtract(struct dpfp_fprint *a, struct dpfp_fprint *b)
 	}
 }
 
+/* Rotating the image by 180 degrees is the same as reversing the order of
+ * its pixels, so dpfp_fprint_rotate_subtract works inwards from both ends
+ * at once: each step loads a vector from the front and one from the back,
+ * takes the absolute difference from the base image, reverses both and
+ * stores each at the other end. That also makes it safe in place. */
+#if defined(__AVX2__)
+#define ROT_VEC	32
+
+static void rotate_vec(const unsigned char *src, const unsigned char *base,
+	unsigned char *dst, int lo, int hi)
+{
+	const __m256i rev = _mm256_setr_epi8(
+		15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+		15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i a = _mm256_loadu_si256((const __m256i *) (src + lo));
+	__m256i b = _mm256_loadu_si256((const __m256i *) (src + hi));
+
+	if (base) {
+		__m256i ba = _mm256_loadu_si256((const __m256i *) (base + lo));
+		__m256i bb = _mm256_loadu_si256((const __m256i *) (base + hi));
+		a = _mm256_or_si256(_mm256_subs_epu8(a, ba),
+			_mm256_subs_epu8(ba, a));
+		b = _mm256_or_si256(_mm256_subs_epu8(b, bb),
+			_mm256_subs_epu8(bb, b));
+	}
+
+	/* bytes within each lane, then the lanes */
+	a = _mm256_shuffle_epi8(a, rev);
+	a = _mm256_permute2x128_si256(a, a, 0x01);
+	b = _mm256_shuffle_epi8(b, rev);
+	b = _mm256_permute2x128_si256(b, b, 0x01);
+	_mm256_storeu_si256((__m256i *) (dst + lo), b);
+	_mm256_storeu_si256((__m256i *) (dst + hi), a);
+}
+#elif defined(__SSE2__)
+#define ROT_VEC	16
+
+/* SSE2 has no byte shuffle: reverse the dwords, the words within them,
+ * then the bytes within those */
+static __m128i reverse16(__m128i v)
+{
+	v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static void rotate_vec(const unsigned char *src, const unsigned char *base,
+	unsigned char *dst, int lo, int hi)
+{
+	__m128i a = _mm_loadu_si128((const __m128i *) (src + lo));
+	__m128i b = _mm_loadu_si128((const __m128i *) (src + hi));
+
+	if (base) {
+		__m128i ba = _mm_loadu_si128((const __m128i *) (base + lo));
+		__m128i bb = _mm_loadu_si128((const __m128i *) (base + hi));
+		a = _mm_or_si128(_mm_subs_epu8(a, ba), _mm_subs_epu8(ba, a));
+		b = _mm_or_si128(_mm_subs_epu8(b, bb), _mm_subs_epu8(bb, b));
+	}
+
+	_mm_storeu_si128((__m128i *) (dst + lo), reverse16(b));
+	_mm_storeu_si128((__m128i *) (dst + hi), reverse16(a));
+}
+#endif
+
+/* dst = fp - base (absolute difference), rotated by 180 degrees: the same
+ * as dpfp_fprint_subtract, dpfp_fprint_flip_v and dpfp_fprint_flip_h in a
+ * single pass. base may be NULL to only rotate, and dst may be fp. If dst
+ * is another fprint, it gets a copy of the header too, so fp can be the
+ * frame as it came off the bus. */
+int dpfp_fprint_rotate_subtract(struct dpfp_fprint *dst,
+	struct dpfp_fprint *fp, struct dpfp_fprint *base)
+{
+	const unsigned char *src = fp->data;
+	const unsigned char *b = NULL;
+	unsigned char *out = dst->data;
+	int n = fp->data_size / DPFP_IMG_WIDTH * DPFP_IMG_WIDTH;
+	int lo = 0;
+	int hi = n;
+
+	if (base) {
+		if (base->data_size != fp->data_size) {
+			dbgf(DBG_ERR, "fp size %zu does not match base size %zu",
+				fp->data_size, base->data_size);
+			return -EINVAL;
+		}
+		b = base->data;
+	}
+
+	if (dst != fp) {
+		memcpy(dst->header, fp->header, fp->header_size);
+		dst->header_size = fp->header_size;
+		dst->data_size = fp->data_size;
+		dst->seq = fp->seq;
+		dst->timestamp = fp->timestamp;
+	}
+
+#ifdef ROT_VEC
+	for (; hi - lo >= 2 * ROT_VEC; lo += ROT_VEC, hi -= ROT_VEC)
+		rotate_vec(src, b, out, lo, hi - ROT_VEC);
+#endif
+
+	/* whatever is left in the middle */
+	for (hi--; lo <= hi; lo++, hi--) {
+		int p = src[lo];
+		int q = src[hi];
+		if (b) {
+			p = abs(p - b[lo]);
+			q = abs(q - b[hi]);
+		}
+		out[lo] = q;
+		out[hi] = p;
+	}
+
+	return 0;
+}
+
+/* Parse the header the sensor sends in front of every frame. The image is
+ * described as up to DPFP_FRAME_MAX_BLOCKS runs of lines. Runs flagged
+ * DPFP_BLOCK_NOT_PRESENT are not sent; the others must add up to the line
+ * count of the frame. Returns -EPROTO for a header that cannot describe a
+ * real frame. */
+int dpfp_fprint_get_info(struct dpfp_fprint *fp, struct dpfp_frame_info *info)
+{
+	unsigned char *hdr = fp->header;
+	uint16_t num_lines;
+	int lines = 0;
+	int i;
+
+	if (fp->header_size < 64)
+		return -EPROTO;
+
+	memcpy(&num_lines, hdr + HDR_NUM_LINES, sizeof(num_lines));
+	info->num_lines = le16_to_cpu(num_lines);
+	info->key_number = hdr[HDR_KEY_NUMBER];
+	info->num_blocks = 0;
+
+	if (info->num_lines == 0 || info->num_lines > HDR_MAX_LINES) {
+		dbgf(DBG_ERR, "bad line count %d", info->num_lines);
+		return -EPROTO;
+	}
+
+	for (i = 0; i < DPFP_FRAME_MAX_BLOCKS && lines < info->num_lines; i++) {
+		struct dpfp_frame_block *block = &info->blocks[i];
+
+		block->flags = hdr[HDR_BLOCK_INFO + i * 2];
+		block->num_lines = hdr[HDR_BLOCK_INFO + i * 2 + 1];
+		if (block->num_lines == 0)
+			break;
+		/* listed, but never transferred */
+		if (!(block->flags & DPFP_BLOCK_NOT_PRESENT))
+			lines += block->num_lines;
+		info->num_blocks++;
+	}
+
+	if (lines != info->num_lines) {
+		dbgf(DBG_ERR, "blocks cover %d of %d lines", lines,
+			info->num_lines);
+		return -EPROTO;
+	}
+
+	return 0;
+}
@@ -280,13 +280,48 @@ struct dpfp_mset *dpfp_mset_remove_noise(struct dpfp_mset *mset,
 	return new;
 }
 
+/* For each minutia of from, 1 / (d^(2 e) + 1) with d the distance to the
+ * closest minutia of to, summed. The closest minutia scores best, so only
+ * the smallest squared distance is raised to the power, and that for all
+ * minutiae of from at once. */
+static float closest_sum(struct dpfp_mset *from, struct dpfp_mset *to,
+	double e)
+{
+	double closest[DPFP_MAX_MINUTIAE];
+	float value = 0;
+	int i, j;
+
+	if (to->count == 0)
+		return 0;
+
+	for (i = 0; i < from->count; i++) {
+		int x = from->minutiae[i].x;
+		int y = from->minutiae[i].y;
+		int best = -1;
+
+		for (j = 0; j < to->count; j++) {
+			int dx = to->minutiae[j].x - x;
+			int dy = to->minutiae[j].y - y;
+			if (best < 0 || dx * dx + dy * dy < best)
+				best = dx * dx + dy * dy;
+		}
+		closest[i] = best;
+	}
+
+	dpfp_math_pow(closest, e, closest, from->count, DPFP_MATH_PRECISE);
+	for (i = 0; i < from->count; i++)
+		value += 1.0f / (float) (closest[i] + 1);
+
+	return value;
+}
+
 float dpfp_fprint_mset_match1(struct dpfp_mset *mset1, struct dpfp_mset *mset2)
 {
 
-	float value = 0, returnValue;
+	float returnValue;
 	int mean1x = 0, mean1y = 0;
 	int mean2x = 0, mean2y = 0;
-	int i, j;
+	int i;
 
 	/* find means */
 	for (i = 0; i < mset1->count; i++) {
@@ -311,38 +346,8 @@ float dpfp_fprint_mset_match1(struct dpfp_mset *mset1, struct dpfp_mset *mset2)
 		mset1->minutiae[i].y -= mean1y - mean2y;
 	}
 
-	for (i = 0; i < mset1->count; i++) {
-		int x = mset1->minutiae[i].x;
-		int y = mset1->minutiae[i].y;
-		float thisValue = 0;
-		for (j = 0; j < mset2->count; j++) {
-			int x2 = mset2->minutiae[i].x;
-			int y2 = mset2->minutiae[i].y;
-			float newValue = 1.0f / (float)
-				(pow((x2 - x) * (x2 - x) + (y2 - y) * (y2 - y), 0.2) + 1);
-			if (newValue > thisValue)
-				thisValue = newValue;
-		}
-		value += thisValue;
-	}
-	returnValue = value / mset1->count;
-
-	value = 0;
-	for (i = 0; i < mset2->count; i++) {
-		int x = mset2->minutiae[i].x;
-		int y = mset2->minutiae[i].y;
-		float thisValue = 0;
-		for (j = 0; j < mset1->count; j++) {
-			int x2 = mset1->minutiae[i].x;
-			int y2 = mset1->minutiae[i].y;
-			float newValue = 1.0f / (float)
-				(pow((x2 - x) * (x2 - x) + (y2 - y) * (y2 - y), 0.3) + 1);
-			if (newValue > thisValue) 
-				thisValue = newValue;
-		}
-		value += thisValue;
-	}
-	returnValue += value / mset2->count;
+	returnValue = closest_sum(mset1, mset2, 0.2) / mset1->count;
+	returnValue += closest_sum(mset2, mset1, 0.3) / mset2->count;
 
 	return returnValue * 50.0f;
 }
@@ -21,6 +21,7 @@
 
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,41 +30,155 @@
 #include "dpfp.h"
 #include "dpfp_private.h"
 
-/* Applies a smooth effect to fp */
-int dpfp_fprint_soften_mean(struct dpfp_fprint *fp, int size)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The mean filter is separable, and both directions use running sums, so
+ * the cost per pixel does not depend on the window size. Going down the
+ * image, colsum holds the sum of each column over the window rows: moving
+ * on a row adds the row entering the window and subtracts the one leaving
+ * it. Each output row is then a running sum along colsum. Pixels beyond
+ * the edge of the image read as the nearest edge pixel. */
+
+/* 1/area as a multiply and shift, exact for anything a window can sum to
+ * (see dpfp_soften_rows) */
+#define SOFTEN_SHIFT	40
+
+static inline int clamp_row(int y)
+{
+	if (y < 0)
+		return 0;
+	if (y >= DPFP_IMG_HEIGHT)
+		return DPFP_IMG_HEIGHT - 1;
+	return y;
+}
+
+#ifdef __SSE2__
+/* colsum += add - sub, 16 columns at a time */
+static void update_colsum(uint16_t *colsum, const unsigned char *add,
+	const unsigned char *sub)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int x;
+
+	for (x = 0; x < DPFP_IMG_WIDTH; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (add + x));
+		__m128i lo = _mm_loadu_si128((const __m128i *) (colsum + x));
+		__m128i hi = _mm_loadu_si128((const __m128i *) (colsum + x + 8));
+
+		lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(a, zero));
+		hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(a, zero));
+		if (sub) {
+			__m128i b = _mm_loadu_si128((const __m128i *) (sub + x));
+			lo = _mm_sub_epi16(lo, _mm_unpacklo_epi8(b, zero));
+			hi = _mm_sub_epi16(hi, _mm_unpackhi_epi8(b, zero));
+		}
+		_mm_storeu_si128((__m128i *) (colsum + x), lo);
+		_mm_storeu_si128((__m128i *) (colsum + x + 8), hi);
+	}
+}
+#else
+static void update_colsum(uint16_t *colsum, const unsigned char *add,
+	const unsigned char *sub)
+{
+	int x;
+
+	for (x = 0; x < DPFP_IMG_WIDTH; x++)
+		colsum[x] += add[x] - (sub ? sub[x] : 0);
+}
+#endif
+
+/* One output row: the running sum of colsum over the window, divided */
+static void soften_row(const uint16_t *colsum, unsigned char *dst, int half,
+	uint64_t recip)
+{
+	uint32_t sum;
+	int x;
+
+	sum = colsum[0] * (half + 1);
+	for (x = 1; x <= half; x++)
+		sum += colsum[x < DPFP_IMG_WIDTH ? x : DPFP_IMG_WIDTH - 1];
+
+	for (x = 0; x < DPFP_IMG_WIDTH; x++) {
+		int in = x + half + 1;
+		int out = x - half;
+
+		dst[x] = (sum * recip) >> SOFTEN_SHIFT;
+		sum += colsum[in < DPFP_IMG_WIDTH ? in : DPFP_IMG_WIDTH - 1];
+		sum -= colsum[out > 0 ? out : 0];
+	}
+}
+
+/* Soften rows [first, last) of src into dst with a mean filter over the
+ * size x size window around each pixel (size is rounded up to odd). If
+ * ring is not NULL, src and dst are the same image and ring has room for
+ * size / 2 + 1 rows, which keep the original of rows the window has not
+ * left yet. */
+static void soften(const unsigned char *src, unsigned char *dst, int size,
+	int first, int last, unsigned char *ring)
+{
+	uint16_t colsum[DPFP_IMG_WIDTH];
+	int half = size / 2;
+	int width = half * 2 + 1;
+	uint64_t recip;
+	int y;
+
+	/* The largest sum is 255 * width^2, which times the rounding error of
+	 * recip (below width^2) stays under 2^SOFTEN_SHIFT for width <= 255,
+	 * so the quotient is exact. */
+	recip = ((1ULL << SOFTEN_SHIFT) + width * width - 1) / (width * width);
+
+	memset(colsum, 0, sizeof(colsum));
+	for (y = first - half; y <= first + half; y++)
+		update_colsum(colsum, src + clamp_row(y) * DPFP_IMG_WIDTH, NULL);
+
+	for (y = first; y < last; y++) {
+		const unsigned char *leaving;
+		int out = clamp_row(y - half);
+
+		if (ring) {
+			memcpy(ring + y % (half + 1) * DPFP_IMG_WIDTH,
+				src + y * DPFP_IMG_WIDTH, DPFP_IMG_WIDTH);
+			leaving = ring + out % (half + 1) * DPFP_IMG_WIDTH;
+		} else {
+			leaving = src + out * DPFP_IMG_WIDTH;
+		}
+
+		soften_row(colsum, dst + y * DPFP_IMG_WIDTH, half, recip);
+		if (y + 1 < last)
+			update_colsum(colsum, src
+				+ clamp_row(y + half + 1) * DPFP_IMG_WIDTH,
+				leaving);
+	}
+}
+
+/* Soften rows [first, last) of src into dst with a size x size mean filter */
+void dpfp_soften_rows(const unsigned char *src, unsigned char *dst, int size,
+	int first, int last)
+{
+	soften(src, dst, size, first, last, NULL);
+}
+
+/* Applies a smooth effect to fp: each pixel becomes the mean of the size x
+ * size window around it, with size odd and at most DPFP_SOFTEN_MAX. The
+ * cost does not depend on size. scratch must hold
+ * DPFP_SOFTEN_SCRATCH(size) bytes. */
+int dpfp_fprint_soften_mean_scratch(struct dpfp_fprint *fp, int size,
+	unsigned char *scratch)
 {
 	struct timeval tv;
 	double t1, t2;
-	int soften_size, soften_area;
-	int x, y;
-	int c, p, q;
-	unsigned char *copy;
-	unsigned char *buf = fp->data;
-
-	gettimeofday(&tv, NULL);
-	t1 = TV_TO_DOUBLE(tv);
 
-	/* We need a copy of the original during computation */
-	copy = malloc(fp->data_size);
-	if (copy == NULL) {
-		errno = ENOMEM;
+	if (size < 1 || size > DPFP_SOFTEN_MAX) {
+		errno = EINVAL;
 		return -1;
 	}
-	memcpy(copy, fp->data, fp->data_size);
-
-	soften_size = size / 2;		/* size */
-	soften_area = size * size;	/* area */
-
-	for (y = soften_size; y < DPFP_IMG_HEIGHT - soften_size; y++)
-		for (x = soften_size; x < DPFP_IMG_WIDTH - soften_size; x++) {
-			c = 0;
-			for (q = -soften_size; q <= soften_size; q++)
-				for (p = -soften_size; p <= soften_size; p++)
-					c += copy[(x + p) + (y + q) * DPFP_IMG_WIDTH];
-			buf[x + y * DPFP_IMG_WIDTH] = c / soften_area;
-		}
 
-	free(copy);
+	gettimeofday(&tv, NULL);
+	t1 = TV_TO_DOUBLE(tv);
+
+	soften(fp->data, fp->data, size, 0, DPFP_IMG_HEIGHT, scratch);
 
 	gettimeofday(&tv, NULL);
 	t2 = TV_TO_DOUBLE(tv);
@@ -72,6 +187,29 @@ int dpfp_fprint_soften_mean(struct dpfp_fprint *fp, int size)
 	return 0;
 }
 
+/* As dpfp_fprint_soften_mean_scratch, with scratch on the stack for the
+ * usual small sizes */
+int dpfp_fprint_soften_mean(struct dpfp_fprint *fp, int size)
+{
+	unsigned char buf[DPFP_SOFTEN_SCRATCH(15)];
+	unsigned char *scratch = buf;
+	int r;
+
+	if (size > 15 && size <= DPFP_SOFTEN_MAX) {
+		scratch = malloc(DPFP_SOFTEN_SCRATCH(size));
+		if (scratch == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	r = dpfp_fprint_soften_mean_scratch(fp, size, scratch);
+
+	if (scratch != buf)
+		free(scratch);
+	return r;
+}
+
 struct dpfp_ffield *dpfp_ffield_alloc()
 {
 	struct dpfp_ffield *ffield = malloc(sizeof(*ffield));
@@ -153,188 +291,309 @@ void dpfp_ffield_free(struct dpfp_ffield *ffield)
 ** obtained.
 **
 */
-static int fprint_direction_low_pass(double *theta, double *ffbuf,
-		int filter_size)
+/* The filter is uniform, so step 4 is a mean over the window, done with
+ * running sums in each direction as in the mean filter; scaling does not
+ * change the angle, so the sums are never divided. The input is the
+ * (Phi_x, Phi_y) field itself, as dpfp_direction_vec_rows produces it,
+ * rather than theta, which saves converting there and back. As before, the
+ * window for (x, y) spans [x, x + fsize) x [y, y + fsize); near the right
+ * and bottom edges it reads the edge values again instead of leaving the
+ * result unset. */
+
+/* Steps 4 and 5: low-pass filter the field of (Phi_x, Phi_y) pairs in phi
+ * and store the smoothed orientation in ffbuf */
+int dpfp_direction_low_pass(const double *phi, double *ffbuf, int filter_size)
 {
 	struct timeval tv;
 	double t1, t2;
-	double *fbuf;
-	double *phix, *phiy;
-	double *phi2x, *phi2y;
+	/* column sums as (x, y) pairs, then window sums along the row */
+	double col[2 * DPFP_IMG_WIDTH];
+	double sumx[DPFP_IMG_WIDTH];
+	double sumy[DPFP_IMG_WIDTH];
 	int fsize = filter_size * 2 + 1;
-	int fbuf_size = fsize * fsize * sizeof(double);
-	int result;
-	size_t nbytes = DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT * sizeof(double);
-	double nx, ny;
-	int val;
-	int i, j;
 	int x, y;
 
 	gettimeofday(&tv, NULL);
 	t1 = TV_TO_DOUBLE(tv);
 
-	fbuf = malloc(fbuf_size);
-	phix = malloc(nbytes);
-	phiy = malloc(nbytes);
-	phi2x = malloc(nbytes);
-	phi2y = malloc(nbytes);
-
-	if (!fbuf || !phi2x || !phi2y || !phix || !phiy) {
-		errno = ENOMEM;
-		result = -1;
-		goto free;
+	memset(col, 0, sizeof(col));
+	for (y = 0; y < fsize; y++) {
+		const double *row = phi + 2 * DPFP_IMG_WIDTH
+			* (y < DPFP_IMG_HEIGHT ? y : DPFP_IMG_HEIGHT - 1);
+		for (x = 0; x < 2 * DPFP_IMG_WIDTH; x++)
+			col[x] += row[x];
 	}
 
-	/* reset all fields to 0 */
-	memset(fbuf, 0, fbuf_size);
-	memset(phix, 0, nbytes);
-	memset(phiy, 0, nbytes);
-	memset(phi2x, 0, nbytes);
-	memset(phi2y, 0, nbytes);
+	for (y = 0; y < DPFP_IMG_HEIGHT; y++) {
+		double sx = 0.0, sy = 0.0;
+		double *out = ffbuf + y * DPFP_IMG_WIDTH;
+		const double *add, *sub;
 
-	/* 4 - Compute a continuous field from theta */
-	for (y = 0; y < DPFP_IMG_HEIGHT; y++)
+		for (x = 0; x < fsize; x++) {
+			int c = x < DPFP_IMG_WIDTH ? x : DPFP_IMG_WIDTH - 1;
+			sx += col[2 * c];
+			sy += col[2 * c + 1];
+		}
 		for (x = 0; x < DPFP_IMG_WIDTH; x++) {
-			val = x + y * DPFP_IMG_WIDTH;
-			phix[val] = cos(theta[val]);
-			phiy[val] = sin(theta[val]);
+			int c = x + fsize < DPFP_IMG_WIDTH ?
+				x + fsize : DPFP_IMG_WIDTH - 1;
+			sumx[x] = sx;
+			sumy[x] = sy;
+			sx += col[2 * c] - col[2 * x];
+			sy += col[2 * c + 1] - col[2 * x + 1];
 		}
 
-	/* build the low-pass filter */
-	nx = 0.0;
-	for (j = 0; j < fsize; j++)
-		for (i = 0; i < fsize; i++) {
-			fbuf[j * fsize + i] = 1.0;
-			/*
-			   fbuf[j*fsize+i] = (FvsFloat_t)(fsize - (abs(nFilterSize-i)+abs(nFilterSize-j)));
-			   */
-			nx += fbuf[j*fsize+i]; /* sum of coefficients */
-		}
-	if (nx > 1.0) {
-		for (j = 0; j < fsize; j++)
-			for (i = 0; i < fsize; i++)
-				/* normalize the result */
-				fbuf[j * fsize + i] /= nx;
+		/* 5 - local ridge orientation */
+		dpfp_math_atan2(sumy, sumx, out, DPFP_IMG_WIDTH);
+		for (x = 0; x < DPFP_IMG_WIDTH; x++)
+			out[x] *= 0.5;
+
+		if (y + 1 == DPFP_IMG_HEIGHT)
+			break;
+		add = phi + 2 * DPFP_IMG_WIDTH * (y + fsize < DPFP_IMG_HEIGHT ?
+			y + fsize : DPFP_IMG_HEIGHT - 1);
+		sub = phi + 2 * DPFP_IMG_WIDTH * y;
+		for (x = 0; x < 2 * DPFP_IMG_WIDTH; x++)
+			col[x] += add[x] - sub[x];
 	}
-	/* low-pass on the result arrays getting phi2 */
-	for (y = 0; y < DPFP_IMG_HEIGHT - fsize; y++)
-		for (x = 0; x < DPFP_IMG_WIDTH - fsize; x++)
-		{
-			nx = 0.0;
-			ny = 0.0;
-			for (j = 0; j < fsize; j++)
-				for (i = 0; i < fsize; i++) {
-					val = (x + i) + (j + y) * DPFP_IMG_WIDTH;
-					nx += fbuf[j * fsize + i] * phix[val];
-					ny += fbuf[j * fsize + i] * phiy[val];
-				}
-			val = x + y * DPFP_IMG_WIDTH;
-			phi2x[val] = nx;
-			phi2y[val] = ny;
-		}
 
-	/* 5 - local ridge orientation -> theta */
-	for (y = 0; y < DPFP_IMG_HEIGHT - fsize; y++)
-		for (x = 0; x < DPFP_IMG_WIDTH - fsize; x++) {
-			val = x + y * DPFP_IMG_WIDTH;
-			ffbuf[val] = atan2(phi2y[val], phi2x[val]) * 0.5;
-		}
+	gettimeofday(&tv, NULL);
+	t2 = TV_TO_DOUBLE(tv);
+	dbgf(DBG_INFO, "took %.6lf seconds", t2 - t1);
 
-free:
-	if (phix)
-		free(phix);
+	return 0;
+}
 
-	if (phiy)
-		free(phiy);
+/* The orientation of a block comes from the sums over the block of
+ * 2 dx dy and dx^2 - dy^2, where dx and dy are the backward differences at
+ * each pixel. Neighbouring blocks share nearly all of their pixels, so
+ * rather than differentiating the whole block again for every pixel, each
+ * row of gradient products is computed once and summed with running sums
+ * like the mean filter: down the columns, then along the row. The products
+ * and their sums are integers, so the result is exactly what summing each
+ * block separately gives. */
+
+#ifdef __SSE2__
+/* dx dy and dx^2 - dy^2 for pixels [1, DPFP_IMG_WIDTH) of row y */
+static void gradient_row(const unsigned char *imgbuf, int y, int32_t *gxy,
+	int32_t *gxx_yy)
+{
+	const unsigned char *row = imgbuf + y * DPFP_IMG_WIDTH;
+	const unsigned char *up = row - DPFP_IMG_WIDTH;
+	const __m128i zero = _mm_setzero_si128();
+	int x;
+
+	/* 8 pixels at a time, the last block overlapping the one before */
+	for (x = 1; x < DPFP_IMG_WIDTH; x += 8) {
+		__m128i p, l, u, dx, dy, ndy;
+
+		if (x > DPFP_IMG_WIDTH - 8)
+			x = DPFP_IMG_WIDTH - 8;
+		p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (row + x)),
+			zero);
+		l = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i *) (row + x - 1)), zero);
+		u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (up + x)),
+			zero);
+		dx = _mm_sub_epi16(p, l);
+		dy = _mm_sub_epi16(p, u);
+		ndy = _mm_sub_epi16(zero, dy);
+
+		/* pmaddwd on (dx, 0) x (dy, 0) and (dx, dy) x (dx, -dy) pairs
+		 * gives each product in 32 bits */
+		_mm_storeu_si128((__m128i *) (gxy + x), _mm_madd_epi16(
+			_mm_unpacklo_epi16(dx, zero), _mm_unpacklo_epi16(dy, zero)));
+		_mm_storeu_si128((__m128i *) (gxy + x + 4), _mm_madd_epi16(
+			_mm_unpackhi_epi16(dx, zero), _mm_unpackhi_epi16(dy, zero)));
+		_mm_storeu_si128((__m128i *) (gxx_yy + x), _mm_madd_epi16(
+			_mm_unpacklo_epi16(dx, dy), _mm_unpacklo_epi16(dx, ndy)));
+		_mm_storeu_si128((__m128i *) (gxx_yy + x + 4), _mm_madd_epi16(
+			_mm_unpackhi_epi16(dx, dy), _mm_unpackhi_epi16(dx, ndy)));
+		if (x == DPFP_IMG_WIDTH - 8)
+			break;
+	}
+}
+#else
+static void gradient_row(const unsigned char *imgbuf, int y, int32_t *gxy,
+	int32_t *gxx_yy)
+{
+	const unsigned char *row = imgbuf + y * DPFP_IMG_WIDTH;
+	const unsigned char *up = row - DPFP_IMG_WIDTH;
+	int x;
 
-	if (phi2x)
-		free(phi2x);
+	for (x = 1; x < DPFP_IMG_WIDTH; x++) {
+		int32_t dx = row[x] - row[x - 1];
+		int32_t dy = row[x] - up[x];
 
-	if (phi2y)
-		free(phi2y);
+		gxy[x] = dx * dy;
+		gxx_yy[x] = dx * dx - dy * dy;
+	}
+}
+#endif
 
-	if (fbuf)
-		free(fbuf);
+/* Add the gradient products of row add to the column sums and take those
+ * of row sub (if not negative) away */
+static void update_gradient_sums(const unsigned char *imgbuf, int add,
+	int sub, int32_t *col_xy, int32_t *col_xx_yy)
+{
+	int32_t gxy[DPFP_IMG_WIDTH];
+	int32_t gxx_yy[DPFP_IMG_WIDTH];
+	int x;
+
+	gradient_row(imgbuf, add, gxy, gxx_yy);
+	for (x = 1; x < DPFP_IMG_WIDTH; x++) {
+		col_xy[x] += gxy[x];
+		col_xx_yy[x] += gxx_yy[x];
+	}
 
-	gettimeofday(&tv, NULL);
-	t2 = TV_TO_DOUBLE(tv);
-	dbgf(DBG_INFO, "took %.6lf seconds", t2 - t1);
+	if (sub < 0)
+		return;
 
-	return result;
+	gradient_row(imgbuf, sub, gxy, gxx_yy);
+	for (x = 1; x < DPFP_IMG_WIDTH; x++) {
+		col_xy[x] -= gxy[x];
+		col_xx_yy[x] -= gxx_yy[x];
+	}
 }
 
-#define P(x,y)      ((int32_t) imgbuf[(x) + (y) * DPFP_IMG_WIDTH])
+/* Steps 1-3 for the blocks centered on rows [first, last) of imgbuf. With
+ * phi, out gets (cos, sin) of the angle 2 theta for step 4, which is just
+ * the normalized (Ny, Nx); otherwise it gets 2 theta scaled by scale.
+ * Only rows at least block_size + 1 away from the edge of the image are
+ * computed. */
+static void direction_rows(const unsigned char *imgbuf, double *out,
+	double scale, int phi, int block_size, int first, int last)
+{
+	int32_t col_xy[DPFP_IMG_WIDTH];
+	int32_t col_xx_yy[DPFP_IMG_WIDTH];
+	/* arguments of atan2 for a row of blocks */
+	double nxrow[DPFP_IMG_WIDTH];
+	double nyrow[DPFP_IMG_WIDTH];
+	int lo = block_size + 1;
+	int hi = DPFP_IMG_WIDTH - block_size - 1;
+	int x, y;
+
+	if (first < block_size + 1)
+		first = block_size + 1;
+	if (last > DPFP_IMG_HEIGHT - block_size - 1)
+		last = DPFP_IMG_HEIGHT - block_size - 1;
+	if (first >= last || lo >= hi)
+		return;
+
+	/* 1 - divide the image in blocks; the column sums cover the rows of
+	 * the block centered on row first */
+	memset(col_xy, 0, sizeof(col_xy));
+	memset(col_xx_yy, 0, sizeof(col_xx_yy));
+	for (y = first - block_size; y <= first + block_size; y++)
+		update_gradient_sums(imgbuf, y, -1, col_xy, col_xx_yy);
+
+	for (y = first; y < last; y++) {
+		/* 2 - the gradient sums of the block centered at lo,y */
+		int64_t sxy = 0, sxx_yy = 0;
+		double *outrow = out + y * DPFP_IMG_WIDTH * (phi ? 2 : 1);
+
+		for (x = lo - block_size; x <= lo + block_size; x++) {
+			sxy += col_xy[x];
+			sxx_yy += col_xx_yy[x];
+		}
+
+		for (x = lo; x < hi; x++) {
+			/* 3 - compute orientation (-pi/2 .. pi/2) */
+			if (phi) {
+				double nx = 2.0 * sxy, ny = sxx_yy;
+				double r = sqrt(nx * nx + ny * ny);
+
+				/* cos and sin of atan2(0, 0) */
+				outrow[x * 2] = r > 0 ? ny / r : 1.0;
+				outrow[x * 2 + 1] = r > 0 ? nx / r : 0.0;
+			} else {
+				nxrow[x] = 2.0 * sxy;
+				nyrow[x] = sxx_yy;
+			}
+
+			sxy += col_xy[x + block_size + 1]
+				- col_xy[x - block_size];
+			sxx_yy += col_xx_yy[x + block_size + 1]
+				- col_xx_yy[x - block_size];
+		}
+
+		if (!phi) {
+			dpfp_math_atan2(nxrow + lo, nyrow + lo, outrow + lo, hi - lo);
+			for (x = lo; x < hi; x++)
+				outrow[x] *= scale;
+		}
+
+		if (y + 1 < last)
+			update_gradient_sums(imgbuf, y + block_size + 1,
+				y - block_size, col_xy, col_xx_yy);
+	}
+}
+
+/* Block orientation for rows [first, last), scaled by scale */
+void dpfp_direction_rows(const unsigned char *imgbuf, double *out,
+	double scale, int block_size, int first, int last)
+{
+	direction_rows(imgbuf, out, scale, 0, block_size, first, last);
+}
+
+/* Block orientation for rows [first, last) as the (Phi_x, Phi_y) pairs
+ * dpfp_direction_low_pass takes. Rows and columns that are not computed
+ * should hold (1, 0), which is an orientation of 0. */
+void dpfp_direction_vec_rows(const unsigned char *imgbuf, double *phi,
+	int block_size, int first, int last)
+{
+	direction_rows(imgbuf, phi, 1.0, 1, block_size, first, last);
+}
+
+/* Fill a field of (Phi_x, Phi_y) pairs with orientation 0 */
+void dpfp_direction_vec_clear(double *phi)
+{
+	int i;
+
+	for (i = 0; i < DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT; i++) {
+		phi[2 * i] = 1.0;
+		phi[2 * i + 1] = 0.0;
+	}
+}
 
 int dpfp_fprint_get_direction(struct dpfp_fprint *fp, struct dpfp_ffield *ff,
 	int block_size, int filter_size)
 {
 	struct timeval tv;
 	double t1, t2;
-	int i, j;
-	int u, v;
-	int x, y;
 	int result = 0;
-	double nx, ny;
 	double *ffbuf = ff->pimg;
-	double *theta = NULL;
-	unsigned char *imgbuf = fp->data;
-	int diff_size = block_size * 2 + 1;
-	double dx[diff_size * diff_size], dy[diff_size * diff_size];
+	double *phi = NULL;
 
 	gettimeofday(&tv, NULL);
 	t1 = TV_TO_DOUBLE(tv);
 
-	/* allocate memory for the orientation values */
+	/* allocate memory for the orientation field */
 	if (filter_size > 0) {
-		int theta_size = DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT * sizeof(double);
-		theta = malloc(theta_size);
-		if (theta == NULL) {
+		phi = malloc(DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT * 2
+			* sizeof(double));
+		if (phi == NULL) {
 			errno = ENOMEM;
 			return -1;
 		}
 
-		memset(theta, 0, theta_size);
+		dpfp_direction_vec_clear(phi);
+		dpfp_direction_vec_rows(fp->data, phi, block_size, 0,
+			DPFP_IMG_HEIGHT);
+	} else {
+		dpfp_direction_rows(fp->data, ffbuf, 0.5, block_size, 0,
+			DPFP_IMG_HEIGHT);
 	}
 
-	/* 1 - divide the image in blocks */
-	for (y = block_size + 1; y < DPFP_IMG_HEIGHT - block_size - 1; y++)
-		for (x = block_size + 1; x < DPFP_IMG_WIDTH - block_size - 1; x++) {
-			/* 2 - for the block centered at x,y compute the gradient */
-			for (j = 0; j < diff_size; j++)
-				for (i = 0; i < diff_size; i++) {
-					dx[i * diff_size + j] = (double)
-						(P(x + i - block_size,     y + j - block_size) -
-						 P(x + i - block_size - 1, y + j - block_size));
-					dy[i * diff_size + j] = (double)
-						(P(x + i - block_size, y + j - block_size) -
-						 P(x + i - block_size, y + j - block_size - 1));
-				}
-
-			/* 3 - compute orientation */
-			nx = 0.0;
-			ny = 0.0;
-			for (v = 0; v < diff_size; v++)
-				for (u = 0; u < diff_size; u++) {
-					nx += 2 * dx[u * diff_size + v] * dy[u * diff_size + v];
-					ny += dx[u * diff_size + v] * dx[u * diff_size + v]
-						- dy[u * diff_size + v] * dy[u * diff_size + v];
-				}
-			/* compute angle (-pi/2 .. pi/2) */
-			if (filter_size > 0)
-				theta[x + y * DPFP_IMG_WIDTH] = atan2(nx, ny);
-			else
-				ffbuf[x + y * DPFP_IMG_WIDTH] = atan2(nx, ny) * 0.5;
-		}
-
 	gettimeofday(&tv, NULL);
 	t2 = TV_TO_DOUBLE(tv);
 	dbgf(DBG_INFO, "took %.6lf seconds", t2 - t1);
 
 	if (filter_size > 0)
-		result = fprint_direction_low_pass(theta, ffbuf, filter_size);
+		result = dpfp_direction_low_pass(phi, ffbuf, filter_size);
 
-	if (theta)
-		free(theta);
+	if (phi)
+		free(phi);
 
 	return result;
 }
@@ -351,30 +610,209 @@ int dpfp_fprint_get_direction(struct dpfp_fprint *fp, struct dpfp_ffield *ff,
 #define LPSIZE      3
 #define LPFACTOR    (1.0 / ((LPSIZE * 2 + 1) * (LPSIZE * 2 + 1)))
 
-int dpfp_fprint_get_frequency(struct dpfp_fprint *fp,
-	struct dpfp_ffield *direction, struct dpfp_ffield *frequency)
+/* The oriented window only depends on the direction, which is quantized to
+ * FREQ_BINS steps over pi. For each of them, the offsets of the samples
+ * from the centre pixel are computed once: as x and y for the pixels near
+ * the edge, which are clipped, and as an offset into the image for all
+ * others. Sampling a window is then a gather and a sum.
+ *
+ * The offsets are rounded down. The sample positions used to be x + o
+ * truncated towards zero, and floor(x + o) = x + floor(o) for integer x.
+ * The two only differ where x + o is negative, and there the clipping
+ * takes both to 0, so the same pixels are sampled. */
+#define FREQ_BINS	64
+#define FREQ_SAMPLES	(BLOCK_L * BLOCK_W)
+
+static int8_t freq_dx[FREQ_BINS][FREQ_SAMPLES];
+static int8_t freq_dy[FREQ_BINS][FREQ_SAMPLES];
+static int16_t freq_offset[FREQ_BINS][FREQ_SAMPLES];
+/* largest |dx| or |dy| in any window */
+static int freq_reach;
+static pthread_once_t freq_once = PTHREAD_ONCE_INIT;
+
+static void build_freq_tables(void)
+{
+	int b, k, d;
+
+	for (b = 0; b < FREQ_BINS; b++) {
+		double dir = -M_PI / 2 + b * M_PI / FREQ_BINS;
+		double cosdir = -sin(dir);  /* ever > 0 */
+		double sindir = cos(dir);   /* -1 ... 1 */
+
+		for (k = 0; k < BLOCK_L; k++)
+			for (d = 0; d < BLOCK_W; d++) {
+				int i = k * BLOCK_W + d;
+				int dx = (int) floor((d - BLOCK_W2) * cosdir
+					+ (k - BLOCK_L2) * sindir);
+				int dy = (int) floor((d - BLOCK_W2) * sindir
+					- (k - BLOCK_L2) * cosdir);
+
+				freq_dx[b][i] = dx;
+				freq_dy[b][i] = dy;
+				freq_offset[b][i] = dx + dy * DPFP_IMG_WIDTH;
+				if (abs(dx) > freq_reach)
+					freq_reach = abs(dx);
+				if (abs(dy) > freq_reach)
+					freq_reach = abs(dy);
+			}
+	}
+}
+
+/* Steps 2 to 4 for the block centered on x,y, whose ridges run in
+ * direction dir: 0 if the signature has no clear peaks */
+static double block_frequency(const unsigned char *imgbuf, double dir,
+	int x, int y)
+{
+	int bin = (int) floor((dir + M_PI / 2) * (FREQ_BINS / M_PI) + 0.5)
+		& (FREQ_BINS - 1);
+	int peak_pos[BLOCK_L]; /* peak positions */
+	int peak_cnt;          /* peak count     */
+	double peak_freq;         /* peak frequence */
+	int Xsig[BLOCK_L];        /* x signature, times BLOCK_W */
+	int pmin, pmax;
+	int k, d;
+
+	/* 2 - oriented window of size l x w (32 x 16) in the ridge dir */
+	/* 3 - compute the x-signature X[0], X[1], ... X[l-1] */
+	if (x >= freq_reach && x < DPFP_IMG_WIDTH - freq_reach
+			&& y >= freq_reach && y < DPFP_IMG_HEIGHT - freq_reach) {
+		const unsigned char *p = imgbuf + x + y * DPFP_IMG_WIDTH;
+		const int16_t *offset = freq_offset[bin];
+
+		for (k = 0; k < BLOCK_L; k++, offset += BLOCK_W) {
+			int sum = 0;
+			for (d = 0; d < BLOCK_W; d++)
+				sum += p[offset[d]];
+			Xsig[k] = sum;
+		}
+	} else {
+		const int8_t *dx = freq_dx[bin];
+		const int8_t *dy = freq_dy[bin];
+
+		for (k = 0; k < BLOCK_L; k++) {
+			int sum = 0;
+			for (d = 0; d < BLOCK_W; d++, dx++, dy++) {
+				int u = x + *dx;
+				int v = y + *dy;
+				/* clipping */
+				if (u < 0)
+					u = 0;
+				else if (u > DPFP_IMG_WIDTH - 1)
+					u = DPFP_IMG_WIDTH - 1;
+
+				if (v < 0)
+					v = 0;
+				else if (v > DPFP_IMG_HEIGHT - 1)
+					v = DPFP_IMG_HEIGHT - 1;
+
+				sum += imgbuf[u + (v * DPFP_IMG_WIDTH)];
+			}
+			Xsig[k] = sum;
+		}
+	}
+
+	/* Let T(i,j) be the avg number of pixels between 2 peaks */
+	/* find peaks in the x signature */
+	peak_cnt = 0;
+	/* test if the max - min or peak to peak value too small is,
+	   then we ignore this point */
+	pmax = pmin = Xsig[0];
+	for (k = 1; k < BLOCK_L; k++) {
+		if (pmin>Xsig[k]) pmin = Xsig[k];
+		if (pmax<Xsig[k]) pmax = Xsig[k];
+	}
+
+	if (pmax - pmin > 64 * BLOCK_W)
+		for (k = 1; k < BLOCK_L-1; k++)
+			if ((Xsig[k-1] < Xsig[k]) &&
+					(Xsig[k] >= Xsig[k+1])) 
+				peak_pos[peak_cnt++] = k;
+
+	/* compute mean value */
+	peak_freq = 0.0;
+	if (peak_cnt >= 2) {
+		for (k = 0; k < peak_cnt - 1; k++)
+			peak_freq += peak_pos[k + 1] - peak_pos[k];
+		peak_freq /= peak_cnt - 1;
+	}
+
+	/* 4 - must lie in a certain range [1/25-1/3] */
+	/*     changed to range [1/30-1/2] */
+	if (peak_freq > 30.0 || peak_freq < 2.0)
+		return 0.0;
+	return 1.0 / peak_freq;
+}
+
+/* Positions from lo to hi - 1 inclusive, stride apart, and always hi - 1 */
+static int stride_grid(int *grid, int lo, int hi, int stride)
+{
+	int n = 0;
+	int pos;
+
+	for (pos = lo; pos < hi - 1; pos += stride)
+		grid[n++] = pos;
+	grid[n++] = hi - 1;
+	return n;
+}
+
+/* Fill in out between the grid points, linearly along the grid rows first,
+ * then down every column */
+static void interpolate_grid(double *out, const int *gx, int nx,
+	const int *gy, int ny)
+{
+	int i, j, x, y;
+
+	for (j = 0; j < ny; j++) {
+		double *row = out + gy[j] * DPFP_IMG_WIDTH;
+		for (i = 0; i + 1 < nx; i++)
+			for (x = gx[i] + 1; x < gx[i + 1]; x++)
+				row[x] = row[gx[i]] + (row[gx[i + 1]] - row[gx[i]])
+					* (x - gx[i]) / (gx[i + 1] - gx[i]);
+	}
+
+	for (j = 0; j + 1 < ny; j++) {
+		const double *top = out + gy[j] * DPFP_IMG_WIDTH;
+		const double *bottom = out + gy[j + 1] * DPFP_IMG_WIDTH;
+		for (y = gy[j] + 1; y < gy[j + 1]; y++) {
+			double t = (double) (y - gy[j]) / (gy[j + 1] - gy[j]);
+			double *row = out + y * DPFP_IMG_WIDTH;
+			for (x = gx[0]; x <= gx[nx - 1]; x++)
+				row[x] = top[x] + (bottom[x] - top[x]) * t;
+		}
+	}
+}
+
+/* Estimate the ridge frequency of the blocks centered every stride pixels
+ * across and down, and interpolate in between. A stride of 1 estimates it
+ * everywhere. */
+int dpfp_fprint_get_frequency_stride(struct dpfp_fprint *fp,
+	struct dpfp_ffield *direction, struct dpfp_ffield *frequency,
+	int stride)
 {
 	struct timeval tv;
 	double t1, t2;
 	int x, y;
-	int u, v;
-	int d, k;
+	int i, j, k;
 	double *out;
 	double *freq = frequency->pimg;
 	double *orientation = direction->pimg;
 	unsigned char *imgbuf = fp->data;
 	size_t size = DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT * sizeof(double);
+	int gx[DPFP_IMG_WIDTH], gy[DPFP_IMG_HEIGHT];
+	int nx, ny;
+	double colsum[DPFP_IMG_WIDTH];
+	double sum;
 
-	double dir = 0.0, cosdir = 0.0, sindir = 0.0;
-	int peak_pos[BLOCK_L]; /* peak positions */
-	int peak_cnt;          /* peak count     */
-	double peak_freq;         /* peak frequence */
-	double Xsig[BLOCK_L];     /* x signature    */
-	double pmin, pmax;
+	if (stride < 1) {
+		errno = EINVAL;
+		return -1;
+	}
 
 	gettimeofday(&tv, NULL);
 	t1 = TV_TO_DOUBLE(tv);
 
+	pthread_once(&freq_once, build_freq_tables);
+
 	/* allocate memory for the output */
 	out = malloc(size);
 	if (out == NULL) {
@@ -386,95 +824,59 @@ int dpfp_fprint_get_frequency(struct dpfp_fprint *fp,
 	memset(freq, 0, size);
 
 	/* 1 - Divide G into blocks of BLOCK_W x BLOCK_W - (16 x 16) */
-	for (y = BLOCK_L2; y < DPFP_IMG_HEIGHT - BLOCK_L2; y++)
-		for (x = BLOCK_L2; x < DPFP_IMG_WIDTH - BLOCK_L2; x++) {
-			/* 2 - oriented window of size l x w (32 x 16) in the ridge dir */
-			dir = orientation[(x + BLOCK_W2) + (y + BLOCK_W2) * DPFP_IMG_WIDTH];
-			cosdir = -sin(dir);  /* ever > 0 */
-			sindir = cos(dir);   /* -1 ... 1 */
-
-			/* 3 - compute the x-signature X[0], X[1], ... X[l-1] */
-			for (k = 0; k < BLOCK_L; k++) {
-				Xsig[k] = 0.0;
-				for (d = 0; d < BLOCK_W; d++) {
-					u = (int) (x + (d - BLOCK_W2) * cosdir
-							+ (k - BLOCK_L2) * sindir);
-					v = (int) (y + (d - BLOCK_W2) * sindir
-							- (k - BLOCK_L2) * cosdir);
-					/* clipping */
-					if (u < 0)
-						u = 0;
-					else if (u > DPFP_IMG_WIDTH - 1)
-						u = DPFP_IMG_WIDTH - 1;
-
-					if (v < 0)
-						v = 0;
-					else if (v > DPFP_IMG_HEIGHT - 1)
-						v = DPFP_IMG_HEIGHT - 1;
-
-					Xsig[k] += imgbuf[u + (v * DPFP_IMG_WIDTH)];
-				}
-				Xsig[k] /= BLOCK_W;
-			}
+	nx = stride_grid(gx, BLOCK_L2, DPFP_IMG_WIDTH - BLOCK_L2, stride);
+	ny = stride_grid(gy, BLOCK_L2, DPFP_IMG_HEIGHT - BLOCK_L2, stride);
+	for (j = 0; j < ny; j++)
+		for (i = 0; i < nx; i++) {
+			x = gx[i];
+			y = gy[j];
+			out[x + y * DPFP_IMG_WIDTH] = block_frequency(imgbuf,
+				orientation[(x + BLOCK_W2)
+					+ (y + BLOCK_W2) * DPFP_IMG_WIDTH], x, y);
+		}
 
-			/* Let T(i,j) be the avg number of pixels between 2 peaks */
-			/* find peaks in the x signature */
-			peak_cnt = 0;
-			/* test if the max - min or peak to peak value too small is,
-			   then we ignore this point */
-			pmax = pmin = Xsig[0];
-			for (k = 1; k < BLOCK_L; k++) {
-				if (pmin>Xsig[k]) pmin = Xsig[k];
-				if (pmax<Xsig[k]) pmax = Xsig[k];
-			}
+	/* 5 - interpolated ridge period for the unknown points */
+	for (j = 0; j < ny; j++)
+		for (i = 0; i < nx; i++) {
+			double *p = out + gx[i] + gy[j] * DPFP_IMG_WIDTH;
+			if (*p >= EPSILON)
+				continue;
+			if (j > 0 && out[gx[i] + gy[j - 1] * DPFP_IMG_WIDTH]
+					> EPSILON)
+				*p = out[gx[i] + gy[j - 1] * DPFP_IMG_WIDTH];
+			else if (i > 0 && out[gx[i - 1] + gy[j] * DPFP_IMG_WIDTH]
+					> EPSILON)
+				*p = out[gx[i - 1] + gy[j] * DPFP_IMG_WIDTH];
+		}
 
-			if ((pmax - pmin) > 64.0)
-				for (k = 1; k < BLOCK_L-1; k++)
-					if ((Xsig[k-1] < Xsig[k]) &&
-							(Xsig[k] >= Xsig[k+1])) 
-						peak_pos[peak_cnt++] = k;
-
-			/* compute mean value */
-			peak_freq = 0.0;
-			if (peak_cnt >= 2) {
-				for (k = 0; k < peak_cnt - 1; k++)
-					peak_freq += peak_pos[k + 1] - peak_pos[k];
-				peak_freq /= peak_cnt - 1;
-			}
+	if (stride > 1)
+		interpolate_grid(out, gx, nx, gy, ny);
 
-			/* 4 - must lie in a certain range [1/25-1/3] */
-			/*     changed to range [1/30-1/2] */
-			if (peak_freq > 30.0)
-				out[x + y * DPFP_IMG_WIDTH] = 0.0;
-			else if (peak_freq < 2.0)
-				out[x + y * DPFP_IMG_WIDTH] = 0.0;
-			else
-				out[x + y * DPFP_IMG_WIDTH] = 1.0 / peak_freq;
-		}
+	/* 6 - Inter-ridges distance change slowly in a local neighbourhood;
+	 * the mean over LPSIZE around each point, with running sums down the
+	 * columns and along the rows */
+	memset(colsum, 0, sizeof(colsum));
+	for (y = BLOCK_L2 - LPSIZE; y <= BLOCK_L2 + LPSIZE; y++)
+		for (x = 0; x < DPFP_IMG_WIDTH; x++)
+			colsum[x] += out[x + y * DPFP_IMG_WIDTH];
 
-	/* 5 - interpolated ridge period for the unknown points */
-	for (y = BLOCK_L2; y < DPFP_IMG_HEIGHT - BLOCK_L2; y++)
-		for (x = BLOCK_L2; x < DPFP_IMG_WIDTH - BLOCK_L2; x++)
-			if (out[x + y * DPFP_IMG_WIDTH] < EPSILON) {
-				if (out[x + (y - 1) * DPFP_IMG_WIDTH] > EPSILON)
-					out[x + (y * DPFP_IMG_WIDTH)] =
-						out[x + (y - 1) * DPFP_IMG_WIDTH];
-				else if (out[x - 1 + (y * DPFP_IMG_WIDTH)] > EPSILON)
-					out[x + (y * DPFP_IMG_WIDTH)] =
-						out[x - 1 + (y * DPFP_IMG_WIDTH)];
-			}
+	for (y = BLOCK_L2; y < DPFP_IMG_HEIGHT - BLOCK_L2; y++) {
+		const double *add, *sub;
 
-	/* 6 - Inter-ridges distance change slowly in a local neighbourhood */
-	for (y = BLOCK_L2; y < DPFP_IMG_HEIGHT - BLOCK_L2; y++)
+		sum = 0.0;
+		for (x = BLOCK_L2 - LPSIZE; x <= BLOCK_L2 + LPSIZE; x++)
+			sum += colsum[x];
 		for (x = BLOCK_L2; x < DPFP_IMG_WIDTH - BLOCK_L2; x++) {
-			k = x + y * DPFP_IMG_WIDTH;
-			peak_freq = 0.0;
-			for (v = -LPSIZE; v <= LPSIZE; v++)
-				for (u = -LPSIZE; u <= LPSIZE; u++)
-					peak_freq += out[(x + u) + (y + v) * DPFP_IMG_WIDTH];
-			freq[k] = peak_freq * LPFACTOR;
+			freq[x + y * DPFP_IMG_WIDTH] = sum * LPFACTOR;
+			sum += colsum[x + LPSIZE + 1] - colsum[x - LPSIZE];
 		}
 
+		add = out + (y + LPSIZE + 1) * DPFP_IMG_WIDTH;
+		sub = out + (y - LPSIZE) * DPFP_IMG_WIDTH;
+		for (k = 0; k < DPFP_IMG_WIDTH; k++)
+			colsum[k] += add[k] - sub[k];
+	}
+
 	free(out);
 
 	gettimeofday(&tv, NULL);
@@ -484,7 +886,12 @@ int dpfp_fprint_get_frequency(struct dpfp_fprint *fp,
 	return 0;
 }
 
-#undef P
+int dpfp_fprint_get_frequency(struct dpfp_fprint *fp,
+	struct dpfp_ffield *direction, struct dpfp_ffield *frequency)
+{
+	return dpfp_fprint_get_frequency_stride(fp, direction, frequency, 1);
+}
+
 #define P(x,y)      imgbuf[(x) + (y) * DPFP_IMG_WIDTH]
 
 /* Use a structural operator to dilate the image 
@@ -541,6 +948,10 @@ int dpfp_fprint_get_mask(struct dpfp_fprint *fp, struct dpfp_ffield *direction,
 	double *freq = frequency->pimg;
 	double freqmin = 1.0 / 25, freqmax = 1.0 / 3;
 
+	/* the mask only depends on the frequency field */
+	(void) fp;
+	(void) direction;
+
 	gettimeofday(&tv, NULL);
 	t1 = TV_TO_DOUBLE(tv);
 
@@ -635,18 +1046,14 @@ int dpfp_fprint_get_mask(struct dpfp_fprint *fp, struct dpfp_ffield *direction,
 **            u=-Wg/2 v=-Wg/2
 **
 */
-/* helper function computing the gabor filter factor r2 is r*r */
-static double enhance_gabor(double x, double y, double phi, double f, double r2)
-{
-	double dy2 = 1.0 / r2, dx2 = 1.0 / r2;
-	double x2, y2;
-
-	phi += M_PI / 2;
-	x2 = -x * sin(phi) + y * cos(phi);
-	y2 =  x * cos(phi) + y * sin(phi);
-
-	return exp(-0.5 * (x2 * x2 * dx2 + y2 * y2 * dy2)) * cos(2 * M_PI * x2 * f);
-}
+/* With dx = dy, x'^2 + y'^2 = x^2 + y^2, so the exponential part of h does
+ * not depend on phi and is computed once for the whole image. The cosine
+ * part is computed for every tap of a pixel's window in one go, and only
+ * needs the fast tier as the result ends up as 8 bits. With phi turned by
+ * pi/2 as the ridges run across it, 2.PI.f.x' = -2.PI.f.(x.cos(O) +
+ * y.sin(O)). */
+#define GABOR_WG2	8 /* from -8 to 8 are 17 */
+#define GABOR_TAPS	((GABOR_WG2 * 2 + 1) * (GABOR_WG2 * 2 + 1))
 
 /* Enhance a fingerprint image */
 int dpfp_fprint_enhance_gabor(struct dpfp_fprint *fp,
@@ -655,14 +1062,18 @@ int dpfp_fprint_enhance_gabor(struct dpfp_fprint *fp,
 {
 	struct timeval tv;
 	double t1, t2;
-	int Wg2 = 8; /* from -5 to 5 are 11 */
-	int i, j;
+	int Wg2 = GABOR_WG2;
+	int i, j, k;
 	int u,v;
 	double *orientation = direction->pimg;
 	double *frequence = frequency->pimg;
 	unsigned char *enhanced = malloc(DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT);
 	unsigned char *imgbuf = fp->data;
-	double sum, f, o;
+	double envelope[GABOR_TAPS];
+	double wave[GABOR_TAPS];
+	double sino[DPFP_IMG_WIDTH];
+	double coso[DPFP_IMG_WIDTH];
+	double sum, a, b;
 
 	gettimeofday(&tv, NULL);
 	t1 = TV_TO_DOUBLE(tv);
@@ -676,17 +1087,37 @@ int dpfp_fprint_enhance_gabor(struct dpfp_fprint *fp,
 	/* take square */
 	radius = radius * radius;
 
-	for (j = Wg2; j < DPFP_IMG_HEIGHT - Wg2; j++)
+	k = 0;
+	for (v = -Wg2; v <= Wg2; v++)
+		for (u = -Wg2; u <= Wg2; u++)
+			envelope[k++] = -0.5 * (u * u + v * v) / radius;
+	dpfp_math_exp(envelope, envelope, GABOR_TAPS, DPFP_MATH_PRECISE);
+
+	for (j = Wg2; j < DPFP_IMG_HEIGHT - Wg2; j++) {
+		dpfp_math_sincos(orientation + j * DPFP_IMG_WIDTH, sino, coso,
+			DPFP_IMG_WIDTH, DPFP_MATH_PRECISE);
+
 		for (i = Wg2; i < DPFP_IMG_WIDTH - Wg2; i++)
 			if (mask == NULL || mask->data[i + j * DPFP_IMG_WIDTH] != 0) {
-				sum = 0.0;
-				o = orientation[i + j * DPFP_IMG_WIDTH];
-				f = frequence[i + j * DPFP_IMG_WIDTH];
+				a = 2 * M_PI * frequence[i + j * DPFP_IMG_WIDTH];
+				b = a * sino[i];
+				a *= coso[i];
+
+				k = 0;
 				for (v = -Wg2; v <= Wg2; v++)
 					for (u = -Wg2; u <= Wg2; u++)
-						sum += enhance_gabor((double) u, (double) v, o, f,
-								radius) *
-								imgbuf[(i - u) + (j - v) * DPFP_IMG_WIDTH];
+						wave[k++] = u * a + v * b;
+				dpfp_math_sincos(wave, NULL, wave, GABOR_TAPS,
+					DPFP_MATH_FAST);
+
+				sum = 0.0;
+				k = 0;
+				for (v = -Wg2; v <= Wg2; v++) {
+					const unsigned char *row = imgbuf + i
+						+ (j - v) * DPFP_IMG_WIDTH;
+					for (u = -Wg2; u <= Wg2; u++, k++)
+						sum += envelope[k] * wave[k] * row[-u];
+				}
 
 				/* printf("%6.1f ", sum);*/
 				if (sum > 255.0)
@@ -696,6 +1127,7 @@ int dpfp_fprint_enhance_gabor(struct dpfp_fprint *fp,
 
 				enhanced[i + j * DPFP_IMG_WIDTH] = (unsigned char) sum;
 			}
+	}
 	
 	memcpy(imgbuf, enhanced, DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT);
 	free(enhanced);
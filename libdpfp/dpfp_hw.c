@@ -19,6 +19,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
@@ -27,31 +28,93 @@
 #include "dpfp.h"
 #include "dpfp_private.h"
 
-int dpfp_set_mode(struct dpfp_dev *dev, unsigned char mode)
+/* Wait until no recovery is running, then register an operation that a
+ * recovery must not overlap */
+void dpfp_io_begin(struct dpfp_dev *dev)
+{
+	pthread_mutex_lock(&dev->io_lock);
+	while (dev->recovering)
+		pthread_cond_wait(&dev->io_cond, &dev->io_lock);
+	dev->io_busy++;
+	pthread_mutex_unlock(&dev->io_lock);
+}
+
+void dpfp_io_end(struct dpfp_dev *dev)
 {
+	pthread_mutex_lock(&dev->io_lock);
+	if (--dev->io_busy == 0)
+		pthread_cond_broadcast(&dev->io_cond);
+	pthread_mutex_unlock(&dev->io_lock);
+}
+
+/* dpfp_set_mode without the bracketing, for use during recovery */
+int dpfp_write_mode(struct dpfp_dev *dev, unsigned char mode)
+{
+	int r;
+
 	/* FIXME: only allow known modes */
 
 	dbgf(DBG_INFO, "%x", mode);
-	return usb_control_msg(dev->handle, USB_OUT, USB_RQ, MODE_CONTROL, 0,
-		(char *) &mode, 1, CTRL_TIMEOUT);
+	r = dpfp_control_msg(dev, USB_OUT, USB_RQ, MODE_CONTROL, 0,
+		&mode, 1, CTRL_TIMEOUT);
+	/* remembered for the watchdog to restore after recovery */
+	if (r >= 0)
+		__atomic_store_n(&dev->mode, mode, __ATOMIC_RELAXED);
+	return r;
 }
 
-int dpfp_capture_fprint(struct dpfp_dev *dev, struct dpfp_fprint *fp)
+int dpfp_set_mode(struct dpfp_dev *dev, unsigned char mode)
 {
+	int r;
+
+	dpfp_io_begin(dev);
+	r = dpfp_write_mode(dev, mode);
+	dpfp_io_end(dev);
+	return r;
+}
+
+/* Capture a frame as it comes off the bus, with the whole transfer (both
+ * bulk blocks) bounded by a deadline of timeout milliseconds. Missing the
+ * deadline before the frame starts gives -ETIMEDOUT and the next capture
+ * can simply be retried. Missing it part way through leaves the rest of
+ * the frame on the endpoint, with no way to find the next frame boundary,
+ * so that fails with -EPIPE: the caller must leave and re-enter
+ * DPFP_MODE_SEND_FINGER before capturing again. */
+static int capture_raw(struct dpfp_dev *dev, struct dpfp_fprint *fp,
+	int timeout)
+{
+	uint64_t start = dpfp_telemetry_now();
+	struct timeval tv;
+	double deadline;
 	int trf1, trf2;
+	int remaining;
 
-	/* FIXME 5000 */
+	if (__atomic_load_n(&dev->unplugged, __ATOMIC_RELAXED))
+		return -ENODEV;
 
-	trf1 = usb_bulk_read(dev->handle, EP_DATA, fp->header,
-		DATABLK1_RQSIZE, 5000);
+	gettimeofday(&tv, NULL);
+	deadline = TV_TO_DOUBLE(tv) + timeout / 1000.0;
+
+	trf1 = dpfp_bulk_read(dev, EP_DATA, fp->header,
+		DATABLK1_RQSIZE, timeout);
 	if (trf1 < 0) {
 		dbg(DBG_ERR, "first read failed");
 		return trf1;
 	}
 
-	trf2 = usb_bulk_read(dev->handle, EP_DATA, fp->header + trf1,
-		DATABLK2_RQSIZE, 5000);
-	if (trf2 < 0) {
+	gettimeofday(&tv, NULL);
+	remaining = (deadline - TV_TO_DOUBLE(tv)) * 1000;
+	if (remaining <= 0) {
+		dbg(DBG_ERR, "deadline passed mid-frame, lost frame sync");
+		return -EPIPE;
+	}
+
+	trf2 = dpfp_bulk_read(dev, EP_DATA, fp->header + trf1,
+		DATABLK2_RQSIZE, remaining);
+	if (trf2 == -ETIMEDOUT) {
+		dbg(DBG_ERR, "second read timed out, lost frame sync");
+		return -EPIPE;
+	} else if (trf2 < 0) {
 		dbg(DBG_ERR, "second read failed");
 		return trf2;
 	}
@@ -59,13 +122,54 @@ int dpfp_capture_fprint(struct dpfp_dev *dev, struct dpfp_fprint *fp)
 	fp->header_size = 64;
 	fp->data_size = trf1 + trf2 - 64;
 
+	if (dev->flags & DPFP_OPEN_ENCRYPTED) {
+		int r = dpfp_decrypt_frame(dev, fp);
+		if (r < 0)
+			return r;
+	}
+
+	gettimeofday(&tv, NULL);
+	fp->timestamp = TV_TO_DOUBLE(tv);
+	dpfp_telemetry_record(&dev->telemetry.frame, start);
+	TELEMETRY_INC(dev, frames);
+
 	return 0;
 }
 
-/* Timeout is in seconds. 0 means infinite timeout. */
-int dpfp_get_irq(struct dpfp_dev *dev, unsigned char *buf, int timeout)
+int dpfp_capture_raw(struct dpfp_dev *dev, struct dpfp_fprint *fp,
+	int timeout)
+{
+	int r;
+
+	dpfp_io_begin(dev);
+	r = capture_raw(dev, fp, timeout);
+	dpfp_io_end(dev);
+	return r;
+}
+
+/* Capture a frame within timeout milliseconds. If the device has a
+ * background model, idle frames refresh it and, when enabled, the base image
+ * is subtracted before returning. */
+int dpfp_capture_fprint_timeout(struct dpfp_dev *dev, struct dpfp_fprint *fp,
+	int timeout)
+{
+	int r;
+
+	r = dpfp_capture_raw(dev, fp, timeout);
+	if (r == 0 && dev->background)
+		dpfp_background_apply(dev, fp);
+	return r;
+}
+
+int dpfp_capture_fprint(struct dpfp_dev *dev, struct dpfp_fprint *fp)
+{
+	return dpfp_capture_fprint_timeout(dev, fp, DATA_TIMEOUT);
+}
+
+#ifdef __APPLE__
+static int read_irq_endpoint(struct dpfp_dev *dev, unsigned char *buf,
+	int timeout)
 {
-	uint16_t type;
 	int r;
 	int infinite_timeout = 0;
 
@@ -79,13 +183,46 @@ int dpfp_get_irq(struct dpfp_dev *dev, unsigned char *buf, int timeout)
 	 * See http://thread.gmane.org/gmane.comp.lib.libusb.devel.general/1315 */
 
 retry:
-	r = usb_interrupt_read(dev->handle, EP_INTR, buf, DPFP_IRQ_LENGTH, 1000);
+	r = dpfp_interrupt_read(dev, EP_INTR, buf, DPFP_IRQ_LENGTH, 1000);
 	if (r == -ETIMEDOUT &&
 			((!infinite_timeout && timeout > 0) || infinite_timeout)) {
 		dbg(DBG_INFO, "timeout, retry");
+		TELEMETRY_INC(dev, retries);
 		timeout--;
 		goto retry;
 	}
+
+	return r;
+}
+#else
+static int read_irq_endpoint(struct dpfp_dev *dev, unsigned char *buf,
+	int timeout)
+{
+	/* A single transfer covers the whole timeout, so an idle reader does
+	 * not wake us up every second */
+	return dpfp_interrupt_read(dev, EP_INTR, buf, DPFP_IRQ_LENGTH,
+		timeout * 1000);
+}
+#endif
+
+/* dpfp_get_irq, except that with a listener running, it returns the
+ * interrupts received from read position *pos on (see dpfp_irq_position)
+ * rather than the next one to arrive */
+int dpfp_get_irq_from(struct dpfp_dev *dev, unsigned long *pos,
+	unsigned char *buf, int timeout)
+{
+	uint16_t type;
+	int r;
+
+	if (__atomic_load_n(&dev->unplugged, __ATOMIC_RELAXED))
+		return -ENODEV;
+
+	/* With a listener running, it owns the interrupt endpoint. It can be
+	 * started or stopped from another thread. */
+	if (__atomic_load_n(&dev->irq, __ATOMIC_ACQUIRE))
+		r = dpfp_irq_wait(dev, pos, buf, timeout * 1000);
+	else
+		r = read_irq_endpoint(dev, buf, timeout);
 	
 	if (r < 0) {
 		return r;
@@ -100,13 +237,21 @@ retry:
 	return 0;
 }
 
+/* Timeout is in seconds. 0 means infinite timeout. */
+int dpfp_get_irq(struct dpfp_dev *dev, unsigned char *buf, int timeout)
+{
+	unsigned long pos = dpfp_irq_position(dev);
+
+	return dpfp_get_irq_from(dev, &pos, buf, timeout);
+}
+
 int dpfp_get_hwstat(struct dpfp_dev *dev, unsigned char *data)
 {
 	int r;
 
 	/* The windows driver uses a request of 0x0c here. We use 0x04 to be
 	 * consistent with every other command we know about. */
-	r = usb_control_msg(dev->handle, USB_IN, USB_RQ, HWSTAT_CONTROL, 0,
+	r = dpfp_control_msg(dev, USB_IN, USB_RQ, HWSTAT_CONTROL, 0,
 		data, 1, CTRL_TIMEOUT);
 	dbgf(DBG_INFO, "[%d] %x", r, *data);
 	return r;
@@ -115,7 +260,7 @@ int dpfp_get_hwstat(struct dpfp_dev *dev, unsigned char *data)
 int dpfp_set_hwstat(struct dpfp_dev *dev, unsigned char val)
 {
 	dbgf(DBG_INFO, "set val %x", val);
-	return usb_control_msg(dev->handle, USB_OUT, USB_RQ, HWSTAT_CONTROL, 0,
+	return dpfp_control_msg(dev, USB_OUT, USB_RQ, HWSTAT_CONTROL, 0,
 		&val, 1, CTRL_TIMEOUT);
 }
 
@@ -151,7 +296,7 @@ int dpfp_challenge(struct dpfp_dev *dev, unsigned char *param)
 {
 	dbgf(DBG_INFO, "%x %x %x %x %x",
 		param[0], param[1], param[2], param[3], param[4]);
-	return usb_control_msg(dev->handle, USB_OUT, USB_RQ, CHALLENGE_CONTROL, 0,
+	return dpfp_control_msg(dev, USB_OUT, USB_RQ, CHALLENGE_CONTROL, 0,
 		param, DPFP_CHALLENGE_LENGTH, CTRL_TIMEOUT);
 }
 
@@ -160,7 +305,7 @@ int dpfp_read_response(struct dpfp_dev *dev, unsigned char *buf)
 {
 	int r;
 
-	r = usb_control_msg(dev->handle, USB_IN, USB_RQ, RESPONSE_CONTROL, 0,
+	r = dpfp_control_msg(dev, USB_IN, USB_RQ, RESPONSE_CONTROL, 0,
 		buf, DPFP_RESPONSE_LENGTH, CTRL_TIMEOUT);
 	dbgf(DBG_INFO, "%x %x %x %x", buf[0], buf[1], buf[2], buf[3]);
 	return r;
@@ -169,14 +314,14 @@ int dpfp_read_response(struct dpfp_dev *dev, unsigned char *buf)
 int dpfp_auth_read_challenge(struct dpfp_dev *dev, unsigned char *data)
 {
 	dbgf(DBG_INFO, "read auth challenge");
-	return usb_control_msg(dev->handle, USB_IN, USB_RQ, AUTH_CHALLENGE, 0,
+	return dpfp_control_msg(dev, USB_IN, USB_RQ, AUTH_CHALLENGE, 0,
 		data, DPFP_AUTH_CR_LENGTH, CTRL_TIMEOUT);
 }
 
 int dpfp_auth_write_response(struct dpfp_dev *dev, unsigned char *data)
 {
 	dbgf(DBG_INFO, "write auth response");
-	return usb_control_msg(dev->handle, USB_OUT, USB_RQ, AUTH_RESPONSE, 0,
+	return dpfp_control_msg(dev, USB_OUT, USB_RQ, AUTH_RESPONSE, 0,
 		data, DPFP_AUTH_CR_LENGTH, CTRL_TIMEOUT);
 }
 
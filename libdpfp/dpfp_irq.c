@@ -0,0 +1,346 @@
+/*
+ * Event-driven interrupt handling
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Once started, a listener thread keeps an interrupt transfer pending on
+ * EP_INTR for the lifetime of the device. Each interrupt is written into a
+ * pipe; the application watches the read end (dpfp_irq_get_fd) in its own
+ * poll/epoll loop and calls dpfp_irq_handle_events to dispatch the queued
+ * interrupts to the handlers it registered, in its own thread.
+ *
+ * dpfp_get_irq (and therefore the dpfp_simple_await functions) keep working
+ * while a listener runs: they are fed from the listener instead of reading
+ * the endpoint themselves. The listener keeps the last IRQ_QUEUE interrupts
+ * and every waiter reads them from its own position, which it takes with
+ * dpfp_irq_position before it provokes the interrupt (typically before a
+ * dpfp_set_mode), so an interrupt that arrives early is not lost.
+ *
+ * libusb-0.1 cannot abort a pending read, so the listener re-arms its
+ * transfer every IRQ_IDLE_TIMEOUT. That bounds both the idle wakeup rate and
+ * how long dpfp_irq_stop may take. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define IRQ_IDLE_TIMEOUT	10000
+#define IRQ_MAX_HANDLERS	8
+/* interrupts kept for dpfp_irq_wait */
+#define IRQ_QUEUE		16
+
+struct irq_handler {
+	uint16_t type;
+	dpfp_irq_cb callback;
+	void *user_data;
+};
+
+struct dpfp_irq_listener {
+	struct dpfp_dev *dev;
+	int pipefd[2];
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct irq_handler handlers[IRQ_MAX_HANDLERS];
+	int num_handlers;
+
+	/* the last IRQ_QUEUE interrupts for synchronous dpfp_get_irq
+	 * callers: interrupt number n is in queue[n % IRQ_QUEUE], and seq
+	 * have been received so far */
+	unsigned char queue[IRQ_QUEUE][DPFP_IRQ_LENGTH];
+	unsigned long seq;
+	int last_error;
+
+	unsigned long overruns;
+};
+
+/* dev->irq is set and cleared by whichever thread starts and stops the
+ * listener, while waiters on other threads check for it */
+static struct dpfp_irq_listener *get_listener(struct dpfp_dev *dev)
+{
+	return __atomic_load_n(&dev->irq, __ATOMIC_ACQUIRE);
+}
+
+static void *listener_thread(void *arg)
+{
+	struct dpfp_irq_listener *irq = arg;
+	unsigned char buf[DPFP_IRQ_LENGTH];
+	int r;
+
+	while (1) {
+		r = dpfp_interrupt_read(irq->dev, EP_INTR, buf,
+			DPFP_IRQ_LENGTH, IRQ_IDLE_TIMEOUT);
+
+		pthread_mutex_lock(&irq->lock);
+		if (irq->stop) {
+			pthread_mutex_unlock(&irq->lock);
+			break;
+		}
+
+		if (r == -ETIMEDOUT) {
+			pthread_mutex_unlock(&irq->lock);
+			continue;
+		}
+
+		if (r < 0 || r < DPFP_IRQ_LENGTH) {
+			dbgf(DBG_ERR, "interrupt read failed (%d)", r);
+			irq->last_error = r < 0 ? r : -EIO;
+			pthread_cond_broadcast(&irq->cond);
+			pthread_mutex_unlock(&irq->lock);
+			break;
+		}
+
+		memcpy(irq->queue[irq->seq % IRQ_QUEUE], buf, DPFP_IRQ_LENGTH);
+		irq->seq++;
+		pthread_cond_broadcast(&irq->cond);
+
+		/* A full pipe means the application is not draining events;
+		 * drop rather than stall the endpoint */
+		if (write(irq->pipefd[1], buf, DPFP_IRQ_LENGTH) != DPFP_IRQ_LENGTH)
+			irq->overruns++;
+		pthread_mutex_unlock(&irq->lock);
+	}
+
+	return NULL;
+}
+
+/* Start listening for interrupts on dev */
+int dpfp_irq_start(struct dpfp_dev *dev)
+{
+	struct dpfp_irq_listener *irq;
+	int r;
+
+	if (get_listener(dev))
+		return 0;
+
+	irq = malloc(sizeof(*irq));
+	if (irq == NULL)
+		return -ENOMEM;
+
+	memset(irq, 0, sizeof(*irq));
+	irq->dev = dev;
+
+	if (pipe(irq->pipefd) < 0) {
+		r = -errno;
+		free(irq);
+		return r;
+	}
+
+	fcntl(irq->pipefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(irq->pipefd[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&irq->lock, NULL);
+	pthread_cond_init(&irq->cond, NULL);
+
+	r = pthread_create(&irq->thread, NULL, listener_thread, irq);
+	if (r != 0) {
+		close(irq->pipefd[0]);
+		close(irq->pipefd[1]);
+		free(irq);
+		return -r;
+	}
+
+	__atomic_store_n(&dev->irq, irq, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Tell the listener to stop without waiting for it, so that the listeners
+ * of several devices wind down together rather than one IRQ_IDLE_TIMEOUT
+ * after another. dpfp_irq_stop still has to be called to reap it. */
+void dpfp_irq_request_stop(struct dpfp_dev *dev)
+{
+	struct dpfp_irq_listener *irq = get_listener(dev);
+
+	if (irq == NULL)
+		return;
+
+	pthread_mutex_lock(&irq->lock);
+	irq->stop = 1;
+	pthread_mutex_unlock(&irq->lock);
+}
+
+/* Stop the listener. May block for up to IRQ_IDLE_TIMEOUT. */
+void dpfp_irq_stop(struct dpfp_dev *dev)
+{
+	struct dpfp_irq_listener *irq = get_listener(dev);
+
+	if (irq == NULL)
+		return;
+
+	dpfp_irq_request_stop(dev);
+	pthread_join(irq->thread, NULL);
+
+	__atomic_store_n(&dev->irq, NULL, __ATOMIC_RELEASE);
+	close(irq->pipefd[0]);
+	close(irq->pipefd[1]);
+	pthread_cond_destroy(&irq->cond);
+	pthread_mutex_destroy(&irq->lock);
+	free(irq);
+}
+
+/* Register a handler for interrupts of the given type, or for every
+ * interrupt if type is 0. Handlers run from dpfp_irq_handle_events. */
+int dpfp_irq_add_handler(struct dpfp_dev *dev, uint16_t type,
+	dpfp_irq_cb callback, void *user_data)
+{
+	struct dpfp_irq_listener *irq = get_listener(dev);
+	struct irq_handler *handler;
+
+	if (irq == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&irq->lock);
+	if (irq->num_handlers == IRQ_MAX_HANDLERS) {
+		pthread_mutex_unlock(&irq->lock);
+		return -ENOSPC;
+	}
+
+	handler = &irq->handlers[irq->num_handlers++];
+	handler->type = type;
+	handler->callback = callback;
+	handler->user_data = user_data;
+	pthread_mutex_unlock(&irq->lock);
+
+	return 0;
+}
+
+/* File descriptor which becomes readable when interrupts are queued */
+int dpfp_irq_get_fd(struct dpfp_dev *dev)
+{
+	struct dpfp_irq_listener *irq = get_listener(dev);
+
+	if (irq == NULL)
+		return -1;
+	return irq->pipefd[0];
+}
+
+/* Dispatch all queued interrupts to the registered handlers. Never blocks.
+ * Returns the number of interrupts handled. */
+int dpfp_irq_handle_events(struct dpfp_dev *dev)
+{
+	struct dpfp_irq_listener *irq = get_listener(dev);
+	struct irq_handler handlers[IRQ_MAX_HANDLERS];
+	unsigned char buf[DPFP_IRQ_LENGTH];
+	int num_handlers;
+	int count = 0;
+	int i;
+
+	if (irq == NULL)
+		return -EINVAL;
+
+	while (read(irq->pipefd[0], buf, DPFP_IRQ_LENGTH) == DPFP_IRQ_LENGTH) {
+		uint16_t type = be16_to_cpu(*((uint16_t *) buf));
+
+		/* handlers may add handlers, so work from a snapshot */
+		pthread_mutex_lock(&irq->lock);
+		num_handlers = irq->num_handlers;
+		memcpy(handlers, irq->handlers, sizeof(handlers));
+		pthread_mutex_unlock(&irq->lock);
+
+		for (i = 0; i < num_handlers; i++)
+			if (handlers[i].type == 0 || handlers[i].type == type)
+				handlers[i].callback(dev, type, buf,
+					handlers[i].user_data);
+		count++;
+	}
+
+	return count;
+}
+
+/* Read position of the next interrupt the listener will receive, or 0 if
+ * there is no listener. A caller which is about to provoke an interrupt,
+ * typically by changing the mode, takes its position first, so that it
+ * still gets the interrupt if that arrives before it starts waiting. */
+unsigned long dpfp_irq_position(struct dpfp_dev *dev)
+{
+	struct dpfp_irq_listener *irq = get_listener(dev);
+	unsigned long pos;
+
+	if (irq == NULL)
+		return 0;
+
+	pthread_mutex_lock(&irq->lock);
+	pos = irq->seq;
+	pthread_mutex_unlock(&irq->lock);
+	return pos;
+}
+
+/* dpfp_get_irq backend while a listener is running: return the interrupt
+ * at read position *pos, waiting for it if it has not arrived yet, and
+ * advance *pos. A caller more than IRQ_QUEUE interrupts behind skips to the
+ * oldest one kept. timeout is in milliseconds, 0 is infinite. Returns the
+ * interrupt length like a usb_interrupt_read would. */
+int dpfp_irq_wait(struct dpfp_dev *dev, unsigned long *pos,
+	unsigned char *buf, int timeout)
+{
+	struct dpfp_irq_listener *irq = get_listener(dev);
+	struct timespec ts;
+	struct timeval tv;
+	int r = 0;
+
+	if (irq == NULL)
+		return -EINVAL;
+
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + timeout / 1000;
+	ts.tv_nsec = (tv.tv_usec + (timeout % 1000) * 1000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&irq->lock);
+	/* a position from before the listener was restarted */
+	if (*pos > irq->seq)
+		*pos = irq->seq;
+
+	/* once the listener has given up on the endpoint, only what it
+	 * received before is left */
+	while (irq->seq == *pos && !irq->last_error && r == 0) {
+		if (timeout > 0)
+			r = pthread_cond_timedwait(&irq->cond, &irq->lock, &ts);
+		else
+			pthread_cond_wait(&irq->cond, &irq->lock);
+	}
+
+	if (irq->seq != *pos) {
+		if (irq->seq - *pos > IRQ_QUEUE) {
+			dbgf(DBG_WARN, "missed %lu interrupts",
+				irq->seq - *pos - IRQ_QUEUE);
+			*pos = irq->seq - IRQ_QUEUE;
+		}
+		memcpy(buf, irq->queue[*pos % IRQ_QUEUE], DPFP_IRQ_LENGTH);
+		(*pos)++;
+		r = DPFP_IRQ_LENGTH;
+	} else if (irq->last_error) {
+		r = irq->last_error;
+	} else {
+		r = -ETIMEDOUT;
+	}
+	pthread_mutex_unlock(&irq->lock);
+
+	return r;
+}
@@ -0,0 +1,549 @@
+/*
+ * Multi-reader device manager
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The manager opens every attached reader and drives them all on behalf of
+ * the application:
+ *  - one event thread polls the interrupt listeners of every reader
+ *  - each streaming reader has a thread which only moves frames off the
+ *    bus (libusb-0.1 transfers block, so this cannot be shared)
+ *  - a small pool of worker threads delivers frames and finger events to
+ *    the application callback, tagged with the reader index.
+ *
+ * Events from one reader are delivered in order and never concurrently;
+ * events from different readers are delivered in parallel. */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define MGR_MAX_READERS	64
+#define MGR_BUFS	2
+/* queued finger/error events per reader; the last slot is kept for
+ * reporting that the ones after it were dropped */
+#define MGR_EVENT_QUEUE	4
+
+struct mgr_event {
+	struct mgr_reader *reader;
+	enum dpfp_event_type type;
+	int buf;
+	int status;
+};
+
+struct mgr_reader {
+	struct dpfp_manager *mgr;
+	int idx;
+	struct dpfp_dev *dev;
+
+	struct dpfp_fprint *bufs[MGR_BUFS];
+	int buf_free[MGR_BUFS];
+	int queued_events;
+	/* an event of this reader is being delivered */
+	int busy;
+
+	int stop;
+	int has_thread;
+	pthread_t thread;
+
+	unsigned long frames;
+	unsigned long errors;
+	unsigned long dropped;
+	double first_frame;
+	double last_frame;
+};
+
+struct dpfp_manager {
+	struct mgr_reader readers[MGR_MAX_READERS];
+	int num_readers;
+
+	dpfp_manager_cb callback;
+	void *user_data;
+
+	struct mgr_event *queue;
+	int queue_len;
+	int queue_size;
+
+	pthread_t *workers;
+	int num_workers;
+	pthread_t event_thread;
+	int wake_pipe[2];
+	int stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* Called with the lock held */
+static void queue_event(struct dpfp_manager *mgr, struct mgr_reader *reader,
+	enum dpfp_event_type type, int buf, int status)
+{
+	struct mgr_event *event = &mgr->queue[mgr->queue_len++];
+
+	event->reader = reader;
+	event->type = type;
+	event->buf = buf;
+	event->status = status;
+	pthread_cond_broadcast(&mgr->cond);
+}
+
+/* Called with the lock held. Queue a finger or error event of reader,
+ * unless it already has MGR_EVENT_QUEUE of them queued. The event that
+ * fills the last slot is replaced by an -EOVERFLOW error, so that the
+ * application knows it has missed events. */
+static void queue_reader_event(struct dpfp_manager *mgr,
+	struct mgr_reader *reader, enum dpfp_event_type type, int status)
+{
+	if (reader->queued_events >= MGR_EVENT_QUEUE) {
+		reader->dropped++;
+		return;
+	}
+
+	if (reader->queued_events == MGR_EVENT_QUEUE - 1) {
+		reader->dropped++;
+		type = DPFP_EVENT_ERROR;
+		status = -EOVERFLOW;
+	}
+
+	reader->queued_events++;
+	queue_event(mgr, reader, type, -1, status);
+}
+
+/* Called with the lock held. Finds the oldest event whose reader is idle
+ * and removes it from the queue. */
+static int dequeue_event(struct dpfp_manager *mgr, struct mgr_event *out)
+{
+	int i;
+
+	for (i = 0; i < mgr->queue_len; i++) {
+		if (mgr->queue[i].reader->busy)
+			continue;
+
+		*out = mgr->queue[i];
+		memmove(&mgr->queue[i], &mgr->queue[i + 1],
+			(mgr->queue_len - i - 1) * sizeof(*mgr->queue));
+		mgr->queue_len--;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct dpfp_manager *mgr = arg;
+	struct mgr_event event;
+	struct dpfp_fprint *fp;
+
+	pthread_mutex_lock(&mgr->lock);
+	while (1) {
+		while (!mgr->stop && !dequeue_event(mgr, &event))
+			pthread_cond_wait(&mgr->cond, &mgr->lock);
+		if (mgr->stop)
+			break;
+
+		event.reader->busy = 1;
+		pthread_mutex_unlock(&mgr->lock);
+
+		fp = event.buf >= 0 ? event.reader->bufs[event.buf] : NULL;
+		mgr->callback(mgr, event.reader->idx, event.type, fp,
+			event.status, mgr->user_data);
+
+		pthread_mutex_lock(&mgr->lock);
+		event.reader->busy = 0;
+		if (event.buf >= 0)
+			event.reader->buf_free[event.buf] = 1;
+		else
+			event.reader->queued_events--;
+		pthread_cond_broadcast(&mgr->cond);
+	}
+	pthread_mutex_unlock(&mgr->lock);
+
+	return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct mgr_reader *reader = arg;
+	struct dpfp_manager *mgr = reader->mgr;
+	int buf;
+	int r;
+
+	pthread_mutex_lock(&mgr->lock);
+	while (1) {
+		buf = -1;
+		while (!reader->stop) {
+			for (buf = 0; buf < MGR_BUFS; buf++)
+				if (reader->buf_free[buf])
+					break;
+			if (buf < MGR_BUFS)
+				break;
+			pthread_cond_wait(&mgr->cond, &mgr->lock);
+		}
+		if (reader->stop)
+			break;
+
+		reader->buf_free[buf] = 0;
+		pthread_mutex_unlock(&mgr->lock);
+
+		r = dpfp_capture_fprint(reader->dev, reader->bufs[buf]);
+
+		pthread_mutex_lock(&mgr->lock);
+		if (r < 0) {
+			reader->errors++;
+			reader->buf_free[buf] = 1;
+			queue_reader_event(mgr, reader, DPFP_EVENT_ERROR, r);
+			if (r != -ETIMEDOUT)
+				break;
+			continue;
+		}
+
+		if (reader->frames++ == 0)
+			reader->first_frame = reader->bufs[buf]->timestamp;
+		reader->last_frame = reader->bufs[buf]->timestamp;
+		reader->bufs[buf]->seq = reader->frames - 1;
+		queue_event(mgr, reader, DPFP_EVENT_FRAME, buf, 0);
+	}
+
+	/* Gave up on an error: nobody is going to join this thread, and the
+	 * reader has to be startable again */
+	if (!reader->stop) {
+		reader->has_thread = 0;
+		pthread_detach(pthread_self());
+	}
+	pthread_mutex_unlock(&mgr->lock);
+
+	return NULL;
+}
+
+static void irq_handler(struct dpfp_dev *dev, uint16_t type,
+	unsigned char *irqbuf, void *user_data)
+{
+	struct mgr_reader *reader = user_data;
+	struct dpfp_manager *mgr = reader->mgr;
+	enum dpfp_event_type event;
+
+	if (type == DPFP_IRQDATA_FINGER_ON)
+		event = DPFP_EVENT_FINGER_ON;
+	else if (type == DPFP_IRQDATA_FINGER_OFF)
+		event = DPFP_EVENT_FINGER_OFF;
+	else
+		return;
+
+	pthread_mutex_lock(&mgr->lock);
+	queue_reader_event(mgr, reader, event, 0);
+	pthread_mutex_unlock(&mgr->lock);
+}
+
+/* Single poll loop over the interrupt listeners of every reader */
+static void *event_thread(void *arg)
+{
+	struct dpfp_manager *mgr = arg;
+	struct pollfd fds[MGR_MAX_READERS + 1];
+	int i;
+
+	for (i = 0; i < mgr->num_readers; i++) {
+		fds[i].fd = dpfp_irq_get_fd(mgr->readers[i].dev);
+		fds[i].events = POLLIN;
+	}
+	fds[mgr->num_readers].fd = mgr->wake_pipe[0];
+	fds[mgr->num_readers].events = POLLIN;
+
+	while (1) {
+		if (poll(fds, mgr->num_readers + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[mgr->num_readers].revents)
+			break;
+
+		for (i = 0; i < mgr->num_readers; i++)
+			if (fds[i].revents & POLLIN)
+				dpfp_irq_handle_events(mgr->readers[i].dev);
+	}
+
+	return NULL;
+}
+
+static void manager_free(struct dpfp_manager *mgr)
+{
+	int i, j;
+
+	/* Each listener can take up to a whole idle timeout to notice, so
+	 * have them all stop before waiting for the first one */
+	for (i = 0; i < mgr->num_readers; i++)
+		dpfp_irq_request_stop(mgr->readers[i].dev);
+
+	for (i = 0; i < mgr->num_readers; i++) {
+		struct mgr_reader *reader = &mgr->readers[i];
+
+		dpfp_close(reader->dev);
+		for (j = 0; j < MGR_BUFS; j++)
+			if (reader->bufs[j])
+				dpfp_fprint_free(reader->bufs[j]);
+	}
+
+	pthread_cond_destroy(&mgr->cond);
+	pthread_mutex_destroy(&mgr->lock);
+	free(mgr->workers);
+	free(mgr->queue);
+	free(mgr);
+}
+
+/* Open every attached reader and start driving them. Events are delivered
+ * to callback from a pool of num_workers threads. Returns NULL with errno
+ * ENODEV if no reader could be opened. */
+struct dpfp_manager *dpfp_manager_open(int num_workers,
+	dpfp_manager_cb callback, void *user_data)
+{
+	struct dpfp_dev *devs[MGR_MAX_READERS];
+	struct dpfp_manager *mgr;
+	int num_devs;
+	int i, j;
+
+	if (num_workers < 1 || callback == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mgr = malloc(sizeof(*mgr));
+	if (mgr == NULL)
+		return NULL;
+
+	memset(mgr, 0, sizeof(*mgr));
+	mgr->callback = callback;
+	mgr->user_data = user_data;
+	pthread_mutex_init(&mgr->lock, NULL);
+	pthread_cond_init(&mgr->cond, NULL);
+
+	num_devs = dpfp_open_all(devs, MGR_MAX_READERS);
+	if (num_devs <= 0) {
+		manager_free(mgr);
+		errno = ENODEV;
+		return NULL;
+	}
+
+	/* Every reader can have all of its buffers and events queued at once.
+	 * The queue has to be there before the first interrupt handler. */
+	mgr->queue_size = num_devs * (MGR_BUFS + MGR_EVENT_QUEUE);
+	mgr->queue = calloc(mgr->queue_size, sizeof(*mgr->queue));
+	mgr->workers = calloc(num_workers, sizeof(*mgr->workers));
+	if (mgr->queue == NULL || mgr->workers == NULL)
+		goto err;
+
+	/* manager_free closes the readers counted in num_readers, the error
+	 * path closes the rest */
+	for (i = 0; i < num_devs; i++) {
+		struct mgr_reader *reader = &mgr->readers[i];
+
+		reader->mgr = mgr;
+		reader->idx = i;
+		reader->dev = devs[i];
+		mgr->num_readers++;
+		for (j = 0; j < MGR_BUFS; j++) {
+			reader->bufs[j] = dpfp_fprint_alloc();
+			if (reader->bufs[j] == NULL)
+				goto err;
+			reader->buf_free[j] = 1;
+		}
+
+		if (dpfp_irq_start(reader->dev) < 0
+				|| dpfp_irq_add_handler(reader->dev, 0, irq_handler,
+					reader) < 0)
+			goto err;
+	}
+
+	if (pipe(mgr->wake_pipe) < 0)
+		goto err;
+
+	if (pthread_create(&mgr->event_thread, NULL, event_thread, mgr) != 0)
+		goto err_pipe;
+
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&mgr->workers[i], NULL, worker_thread,
+				mgr) != 0)
+			break;
+		mgr->num_workers++;
+	}
+
+	if (mgr->num_workers == 0) {
+		dpfp_manager_close(mgr);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return mgr;
+
+err_pipe:
+	close(mgr->wake_pipe[0]);
+	close(mgr->wake_pipe[1]);
+err:
+	for (i = mgr->num_readers; i < num_devs; i++)
+		dpfp_close(devs[i]);
+	manager_free(mgr);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* Put reader idx (or every reader, if idx is -1) into DPFP_MODE_SEND_FINGER
+ * and start streaming frames from it */
+int dpfp_manager_start_capture(struct dpfp_manager *mgr, int idx)
+{
+	int running;
+	int i;
+	int r;
+
+	for (i = 0; i < mgr->num_readers; i++) {
+		struct mgr_reader *reader = &mgr->readers[i];
+
+		if (idx >= 0 && idx != i)
+			continue;
+
+		pthread_mutex_lock(&mgr->lock);
+		running = reader->has_thread;
+		pthread_mutex_unlock(&mgr->lock);
+		if (running)
+			continue;
+
+		r = dpfp_set_mode(reader->dev, DPFP_MODE_SEND_FINGER);
+		if (r < 0)
+			return r;
+
+		/* has_thread is set before the thread runs, which clears it
+		 * again if it exits on an error */
+		pthread_mutex_lock(&mgr->lock);
+		reader->stop = 0;
+		reader->frames = 0;
+		reader->has_thread = 1;
+		pthread_mutex_unlock(&mgr->lock);
+
+		r = pthread_create(&reader->thread, NULL, reader_thread, reader);
+		if (r != 0) {
+			pthread_mutex_lock(&mgr->lock);
+			reader->has_thread = 0;
+			pthread_mutex_unlock(&mgr->lock);
+			return -r;
+		}
+	}
+
+	return 0;
+}
+
+/* Stop streaming from reader idx, or from every reader if idx is -1. Must
+ * not be called from the callback. */
+void dpfp_manager_stop_capture(struct dpfp_manager *mgr, int idx)
+{
+	int i;
+
+	for (i = 0; i < mgr->num_readers; i++) {
+		struct mgr_reader *reader = &mgr->readers[i];
+
+		if (idx >= 0 && idx != i)
+			continue;
+
+		/* with stop set, the thread leaves has_thread for us */
+		pthread_mutex_lock(&mgr->lock);
+		if (!reader->has_thread) {
+			pthread_mutex_unlock(&mgr->lock);
+			continue;
+		}
+		reader->stop = 1;
+		pthread_cond_broadcast(&mgr->cond);
+		pthread_mutex_unlock(&mgr->lock);
+
+		pthread_join(reader->thread, NULL);
+		pthread_mutex_lock(&mgr->lock);
+		reader->has_thread = 0;
+		pthread_mutex_unlock(&mgr->lock);
+	}
+}
+
+void dpfp_manager_close(struct dpfp_manager *mgr)
+{
+	int i;
+
+	dpfp_manager_stop_capture(mgr, -1);
+
+	pthread_mutex_lock(&mgr->lock);
+	mgr->stop = 1;
+	pthread_cond_broadcast(&mgr->cond);
+	pthread_mutex_unlock(&mgr->lock);
+
+	for (i = 0; i < mgr->num_workers; i++)
+		pthread_join(mgr->workers[i], NULL);
+
+	if (write(mgr->wake_pipe[1], "", 1) != 1)
+		dbgf(DBG_ERR, "failed to wake event thread (%d)", errno);
+	pthread_join(mgr->event_thread, NULL);
+	close(mgr->wake_pipe[0]);
+	close(mgr->wake_pipe[1]);
+
+	manager_free(mgr);
+}
+
+int dpfp_manager_get_num_readers(struct dpfp_manager *mgr)
+{
+	return mgr->num_readers;
+}
+
+struct dpfp_dev *dpfp_manager_get_dev(struct dpfp_manager *mgr, int idx)
+{
+	if (idx < 0 || idx >= mgr->num_readers)
+		return NULL;
+	return mgr->readers[idx].dev;
+}
+
+/* Capture statistics for reader idx, or totals over all readers if idx is
+ * -1. The frame rate is measured from the first to the latest frame of the
+ * current streaming session. */
+int dpfp_manager_get_stats(struct dpfp_manager *mgr, int idx,
+	struct dpfp_reader_stats *stats)
+{
+	int i;
+
+	if (idx >= mgr->num_readers)
+		return -EINVAL;
+
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&mgr->lock);
+	for (i = 0; i < mgr->num_readers; i++) {
+		struct mgr_reader *reader = &mgr->readers[i];
+
+		if (idx >= 0 && idx != i)
+			continue;
+
+		stats->frames += reader->frames;
+		stats->errors += reader->errors;
+		stats->dropped += reader->dropped;
+		if (reader->frames > 1)
+			stats->fps += (reader->frames - 1) /
+				(reader->last_frame - reader->first_frame);
+	}
+	pthread_mutex_unlock(&mgr->lock);
+
+	return 0;
+}
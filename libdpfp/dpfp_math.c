@@ -0,0 +1,387 @@
+/*
+ * Vector math for the image processing code
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* sin/cos, atan2, exp and pow over arrays, two doubles at a time with SSE2.
+ * Without SSE2 they simply call libm for each element. An odd last element
+ * goes through the same code as the rest, so the result for an element
+ * does not depend on where it is in the array.
+ *
+ * Each function but atan2 takes an accuracy tier. Errors below are the
+ * worst seen against libm over a few million arguments across each domain
+ * (examples/check_math):
+ *
+ *                   DPFP_MATH_PRECISE        DPFP_MATH_FAST
+ *   sincos          2 ulp                    2e-9 absolute
+ *                   |x| < 2^20 pi/2; larger arguments go to libm
+ *   atan2           2 ulp                    (precise only)
+ *   exp             3 ulp                    8e-9 relative
+ *                   results below 2^-1022 are flushed to 0
+ *   pow             3 (1 + |y ln x|) ulp     6e-9 (1 + |y ln x|) relative
+ *                   x zero or normal, y > 0
+ *
+ * NaN arguments are not handled.
+ *
+ * The precise tier is as good as libm for anything the image processing
+ * does with the result. The fast tier drops polynomial terms and is meant
+ * for values that end up quantized to 8 bits or compared with each other. */
+
+#include <math.h>
+#include <stdint.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* pi/2 in three parts of 33 bits, so k * part is exact for |k| < 2^20 */
+#define PIO2_1		1.57079632673412561417e+00
+#define PIO2_2		6.07710050630396597660e-11
+#define PIO2_3		2.02226624871116645580e-21
+#define SINCOS_MAX	(1048576.0 * M_PI_2)
+
+/* minimax sin and cos on [-pi/4, pi/4] */
+#define SIN_1	-1.66666666666666324348e-01
+#define SIN_2	8.33333333332248946124e-03
+#define SIN_3	-1.98412698298579493134e-04
+#define SIN_4	2.75573137070700676789e-06
+#define SIN_5	-2.50507602534068634195e-08
+#define SIN_6	1.58969099521155010221e-10
+#define COS_1	4.16666666666666019037e-02
+#define COS_2	-1.38888888888741095749e-03
+#define COS_3	2.48015872894767294178e-05
+#define COS_4	-2.75573143513906633035e-07
+#define COS_5	2.08757232129817482790e-09
+#define COS_6	-1.13596475577881948265e-11
+
+/* ln 2 in two parts, the first of 32 bits */
+#define LN2_HI		6.93147180369123816490e-01
+#define LN2_LO		1.90821492927058770002e-10
+#define EXP_MIN		-708.0
+#define EXP_MAX		709.782712893384
+
+/* atan on [0, 0.66], from Cephes */
+#define ATAN_P0	-8.750608600031904122785e-1
+#define ATAN_P1	-1.615753718733365076637e1
+#define ATAN_P2	-7.500855792314704667340e1
+#define ATAN_P3	-1.228866684490136173410e2
+#define ATAN_P4	-6.485021904942025371773e1
+#define ATAN_Q0	2.485846490142306297962e1
+#define ATAN_Q1	1.650270098316988542046e2
+#define ATAN_Q2	4.328810604912902668951e2
+#define ATAN_Q3	4.853903996359136964868e2
+#define ATAN_Q4	1.945506571482613964425e2
+
+static inline __m128d select_pd(__m128d mask, __m128d a, __m128d b)
+{
+	return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+/* c[0] + z (c[1] + z (c[2] + ...)) over n coefficients */
+static inline __m128d poly_pd(__m128d z, const double *c, int n)
+{
+	__m128d p = _mm_set1_pd(c[n - 1]);
+
+	while (--n > 0)
+		p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(c[n - 1]));
+	return p;
+}
+
+/* A mask of each lane whose integer has the given bit set; the integers
+ * are the two lowest 32 bit ones of q */
+static inline __m128d lane_bit(__m128i q, int bit)
+{
+	q = _mm_shuffle_epi32(q, _MM_SHUFFLE(1, 1, 0, 0));
+	q = _mm_and_si128(q, _mm_set1_epi32(bit));
+	return _mm_castsi128_pd(_mm_cmpeq_epi32(q, _mm_set1_epi32(bit)));
+}
+
+static const double sin_coef[] = { SIN_1, SIN_2, SIN_3, SIN_4, SIN_5, SIN_6 };
+static const double cos_coef[] = { COS_1, COS_2, COS_3, COS_4, COS_5, COS_6 };
+
+/* Reduce x to r in [-pi/4, pi/4] and the quadrant k, then pick and negate
+ * the sin and cos of r */
+static __m128d sincos_pd(__m128d x, __m128d *cos, int terms)
+{
+	__m128i k = _mm_cvtpd_epi32(_mm_mul_pd(x, _mm_set1_pd(M_2_PI)));
+	__m128d kd = _mm_cvtepi32_pd(k);
+	const __m128d sign = _mm_set1_pd(-0.0);
+	__m128d r, z, s, c, swap;
+
+	r = _mm_sub_pd(x, _mm_mul_pd(kd, _mm_set1_pd(PIO2_1)));
+	r = _mm_sub_pd(r, _mm_mul_pd(kd, _mm_set1_pd(PIO2_2)));
+	r = _mm_sub_pd(r, _mm_mul_pd(kd, _mm_set1_pd(PIO2_3)));
+	z = _mm_mul_pd(r, r);
+
+	s = _mm_mul_pd(_mm_mul_pd(r, z), poly_pd(z, sin_coef, terms));
+	s = _mm_add_pd(r, s);
+	c = _mm_mul_pd(_mm_mul_pd(z, z), poly_pd(z, cos_coef, terms));
+	c = _mm_add_pd(_mm_sub_pd(_mm_set1_pd(1.0),
+		_mm_mul_pd(z, _mm_set1_pd(0.5))), c);
+
+	/* quadrant 1 swaps them and negates cos, 2 negates both, 3 swaps
+	 * them and negates sin */
+	swap = lane_bit(k, 1);
+	*cos = _mm_xor_pd(select_pd(swap, s, c), _mm_and_pd(sign,
+		lane_bit(_mm_add_epi32(k, _mm_set1_epi32(1)), 2)));
+	return _mm_xor_pd(select_pd(swap, c, s), _mm_and_pd(sign,
+		lane_bit(k, 2)));
+}
+
+/* 1/n! */
+static const double exp_coef[] = {
+	1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720,
+	1.0 / 5040, 1.0 / 40320, 1.0 / 362880, 1.0 / 3628800,
+	1.0 / 39916800, 1.0 / 479001600,
+};
+
+/* exp(x) = 2^k exp(r) with |r| <= ln(2) / 2 */
+static __m128d exp_pd(__m128d x, int terms)
+{
+	__m128d cx = _mm_min_pd(_mm_max_pd(x, _mm_set1_pd(EXP_MIN)),
+		_mm_set1_pd(EXP_MAX));
+	__m128i k = _mm_cvtpd_epi32(_mm_mul_pd(cx, _mm_set1_pd(M_LOG2E)));
+	__m128d kd = _mm_cvtepi32_pd(k);
+	__m128d r, p;
+	__m128i e;
+
+	r = _mm_sub_pd(cx, _mm_mul_pd(kd, _mm_set1_pd(LN2_HI)));
+	r = _mm_sub_pd(r, _mm_mul_pd(kd, _mm_set1_pd(LN2_LO)));
+	p = poly_pd(r, exp_coef, terms);
+
+	/* 2^(k - 1) * 2, as k reaches 1024 just below EXP_MAX */
+	e = _mm_add_epi32(k, _mm_set1_epi32(1022));
+	e = _mm_slli_epi64(_mm_unpacklo_epi32(e, _mm_setzero_si128()), 52);
+	p = _mm_mul_pd(_mm_add_pd(p, p), _mm_castsi128_pd(e));
+
+	p = _mm_andnot_pd(_mm_cmplt_pd(x, _mm_set1_pd(EXP_MIN)), p);
+	return select_pd(_mm_cmpgt_pd(x, _mm_set1_pd(EXP_MAX)),
+		_mm_set1_pd(INFINITY), p);
+}
+
+/* 1/(2n + 1) */
+static const double log_coef[] = {
+	1.0 / 3, 1.0 / 5, 1.0 / 7, 1.0 / 9, 1.0 / 11, 1.0 / 13, 1.0 / 15,
+	1.0 / 17, 1.0 / 19,
+};
+
+/* ln(x) as hi + lo for positive normal x: x = 2^e m with m in
+ * [sqrt(1/2), sqrt(2)), and ln(m) = 2 atanh(s) with s = (m - 1)/(m + 1),
+ * whose series converges quickly as |s| < 0.172 */
+static void log_pd(__m128d x, __m128d *hi, __m128d *lo, int terms)
+{
+	const __m128i mant = _mm_set_epi32(0x000fffff, -1, 0x000fffff, -1);
+	__m128i bits = _mm_castpd_si128(x);
+	__m128i ebits = _mm_srli_epi64(bits, 52);
+	__m128d m, e, big, s, z, p;
+
+	e = _mm_cvtepi32_pd(_mm_shuffle_epi32(ebits, _MM_SHUFFLE(3, 3, 2, 0)));
+	e = _mm_sub_pd(e, _mm_set1_pd(1023.0));
+	m = _mm_or_pd(_mm_castsi128_pd(_mm_and_si128(bits, mant)),
+		_mm_set1_pd(1.0));
+
+	big = _mm_cmpgt_pd(m, _mm_set1_pd(M_SQRT2));
+	m = select_pd(big, _mm_mul_pd(m, _mm_set1_pd(0.5)), m);
+	e = _mm_add_pd(e, _mm_and_pd(big, _mm_set1_pd(1.0)));
+
+	s = _mm_div_pd(_mm_sub_pd(m, _mm_set1_pd(1.0)),
+		_mm_add_pd(m, _mm_set1_pd(1.0)));
+	s = _mm_add_pd(s, s);
+	z = _mm_mul_pd(s, s);
+	z = _mm_mul_pd(z, _mm_set1_pd(0.25));
+	p = _mm_mul_pd(_mm_mul_pd(s, z), poly_pd(z, log_coef, terms));
+
+	*hi = _mm_add_pd(_mm_mul_pd(e, _mm_set1_pd(LN2_HI)), s);
+	*lo = _mm_add_pd(_mm_mul_pd(e, _mm_set1_pd(LN2_LO)), p);
+}
+
+/* Fold onto atan(a) for a in [0, 0.66], then unfold by octant, the sign of
+ * x and then that of y */
+static __m128d atan2_pd(__m128d y, __m128d x)
+{
+	const __m128d sign = _mm_set1_pd(-0.0);
+	const __m128d one = _mm_set1_pd(1.0);
+	__m128d ax = _mm_andnot_pd(sign, x);
+	__m128d ay = _mm_andnot_pd(sign, y);
+	__m128d swap = _mm_cmpgt_pd(ay, ax);
+	__m128d num = _mm_min_pd(ax, ay);
+	__m128d den = _mm_max_pd(ax, ay);
+	__m128d a, big, z, p, q, r;
+
+	/* atan2(0, 0) is 0 */
+	den = _mm_max_pd(den, _mm_set1_pd(1e-300));
+	a = _mm_div_pd(num, den);
+
+	big = _mm_cmpgt_pd(a, _mm_set1_pd(0.66));
+	a = select_pd(big, _mm_div_pd(_mm_sub_pd(a, one), _mm_add_pd(a, one)),
+		a);
+
+	z = _mm_mul_pd(a, a);
+	p = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(ATAN_P0), z),
+		_mm_set1_pd(ATAN_P1));
+	p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(ATAN_P2));
+	p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(ATAN_P3));
+	p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(ATAN_P4));
+	q = _mm_add_pd(z, _mm_set1_pd(ATAN_Q0));
+	q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(ATAN_Q1));
+	q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(ATAN_Q2));
+	q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(ATAN_Q3));
+	q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(ATAN_Q4));
+	r = _mm_add_pd(a, _mm_mul_pd(_mm_mul_pd(a, z), _mm_div_pd(p, q)));
+	r = _mm_add_pd(r, _mm_and_pd(big, _mm_set1_pd(M_PI_4)));
+
+	r = select_pd(swap, _mm_sub_pd(_mm_set1_pd(M_PI_2), r), r);
+	r = select_pd(_mm_castsi128_pd(_mm_srai_epi32(_mm_shuffle_epi32(
+		_mm_castpd_si128(x), _MM_SHUFFLE(3, 3, 1, 1)), 31)),
+		_mm_sub_pd(_mm_set1_pd(M_PI), r), r);
+	return _mm_or_pd(r, _mm_and_pd(sign, y));
+}
+
+/* Two elements of in starting at i, or the last one and a copy of it */
+static inline __m128d load_pd(const double *in, int i, int n)
+{
+	return i + 1 < n ? _mm_loadu_pd(in + i) : _mm_set1_pd(in[i]);
+}
+
+static inline void store_pd(double *out, int i, int n, __m128d v)
+{
+	if (i + 1 < n)
+		_mm_storeu_pd(out + i, v);
+	else
+		_mm_store_sd(out + i, v);
+}
+
+/* sin and cos of x[i] into s[i] and c[i]; either may be NULL, and either
+ * may be x itself */
+void dpfp_math_sincos(const double *x, double *s, double *c, int n,
+	enum dpfp_math_accuracy acc)
+{
+	int terms = acc == DPFP_MATH_FAST ? 4 : 6;
+	const __m128d max = _mm_set1_pd(SINCOS_MAX);
+	int i;
+
+	for (i = 0; i < n; i += 2) {
+		__m128d v = load_pd(x, i, n);
+		__m128d sv, cv;
+
+		if (_mm_movemask_pd(_mm_cmpnlt_pd(_mm_andnot_pd(
+				_mm_set1_pd(-0.0), v), max))) {
+			int j;
+
+			for (j = i; j < i + 2 && j < n; j++) {
+				double xj = x[j];
+				if (s)
+					s[j] = sin(xj);
+				if (c)
+					c[j] = cos(xj);
+			}
+			continue;
+		}
+
+		sv = sincos_pd(v, &cv, terms);
+		if (s)
+			store_pd(s, i, n, sv);
+		if (c)
+			store_pd(c, i, n, cv);
+	}
+}
+
+/* out[i] = atan2(y[i], x[i]), always to the precise tier */
+void dpfp_math_atan2(const double *y, const double *x, double *out, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i += 2)
+		store_pd(out, i, n, atan2_pd(load_pd(y, i, n),
+			load_pd(x, i, n)));
+}
+
+/* out[i] = exp(x[i]) */
+void dpfp_math_exp(const double *x, double *out, int n,
+	enum dpfp_math_accuracy acc)
+{
+	int terms = acc == DPFP_MATH_FAST ? 8 : 13;
+	int i;
+
+	for (i = 0; i < n; i += 2)
+		store_pd(out, i, n, exp_pd(load_pd(x, i, n), terms));
+}
+
+/* out[i] = pow(x[i], y) */
+void dpfp_math_pow(const double *x, double y, double *out, int n,
+	enum dpfp_math_accuracy acc)
+{
+	int log_terms = acc == DPFP_MATH_FAST ? 4 : 9;
+	int exp_terms = acc == DPFP_MATH_FAST ? 8 : 13;
+	const __m128d yv = _mm_set1_pd(y);
+	int i;
+
+	for (i = 0; i < n; i += 2) {
+		__m128d v = load_pd(x, i, n);
+		__m128d hi, lo, p;
+
+		log_pd(v, &hi, &lo, log_terms);
+		p = exp_pd(_mm_add_pd(_mm_mul_pd(hi, yv), _mm_mul_pd(lo, yv)),
+			exp_terms);
+		p = _mm_andnot_pd(_mm_cmpeq_pd(v, _mm_setzero_pd()), p);
+		store_pd(out, i, n, p);
+	}
+}
+#else
+void dpfp_math_sincos(const double *x, double *s, double *c, int n,
+	enum dpfp_math_accuracy acc)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		double xi = x[i];
+		if (s)
+			s[i] = sin(xi);
+		if (c)
+			c[i] = cos(xi);
+	}
+}
+
+void dpfp_math_atan2(const double *y, const double *x, double *out, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		out[i] = atan2(y[i], x[i]);
+}
+
+void dpfp_math_exp(const double *x, double *out, int n,
+	enum dpfp_math_accuracy acc)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		out[i] = exp(x[i]);
+}
+
+void dpfp_math_pow(const double *x, double y, double *out, int n,
+	enum dpfp_math_accuracy acc)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		out[i] = pow(x[i], y);
+}
+#endif
@@ -0,0 +1,449 @@
+/*
+ * Pipelined capture and minutiae extraction
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A capture thread (SCHED_FIFO when we are allowed to) does nothing but
+ * move frames off the bus, so the USB link never waits for the CPU. Frames
+ * are handed round-robin to worker threads which run the enhancement and
+ * minutiae detection chain and deliver the result to the application.
+ *
+ * Every worker is connected to the capture thread by two single-producer
+ * single-consumer rings of buffer indices: one carries captured frames to
+ * the worker, the other carries processed buffers back for reuse. Neither
+ * side ever takes a lock; a worker with nothing to do sleeps on a
+ * semaphore which the capture thread posts for each frame.
+ *
+ * When every worker is busy and its ring full, new frames are dropped
+ * rather than stalling the capture thread, and throughput settles at the
+ * processing rate. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+/* frames queued per worker, power of two */
+#define PIPE_DEPTH		2
+#define PIPE_RING_SIZE		(PIPE_DEPTH * 2)
+#define PIPE_MAX_WORKERS	16
+
+struct spsc_ring {
+	/* written by the consumer only */
+	unsigned int head;
+	char pad1[60];
+	/* written by the producer only */
+	unsigned int tail;
+	char pad2[60];
+	int slots[PIPE_RING_SIZE];
+};
+
+struct pipe_worker {
+	struct dpfp_pipeline *pl;
+	pthread_t thread;
+	sem_t sem;
+	/* capture thread -> worker */
+	struct spsc_ring in;
+	/* worker -> capture thread */
+	struct spsc_ring out;
+
+	/* scratch for the processing chain */
+	struct dpfp_fprint *mask;
+	struct dpfp_ffield *direction;
+	struct dpfp_ffield *frequency;
+	struct dpfp_mset *mset;
+};
+
+struct dpfp_pipeline {
+	struct dpfp_dev *dev;
+	struct dpfp_fprint *base;
+	dpfp_pipeline_cb callback;
+	void *user_data;
+
+	struct dpfp_fprint **bufs;
+	int num_bufs;
+	/* buffers owned by the capture thread */
+	int *free_bufs;
+	int num_free;
+
+	struct pipe_worker workers[PIPE_MAX_WORKERS];
+	int num_workers;
+	int next_worker;
+
+	pthread_t capture_thread;
+	int stop;
+
+	unsigned long captured;
+	unsigned long processed;
+	unsigned long dropped;
+};
+
+static int ring_push(struct spsc_ring *ring, int val)
+{
+	unsigned int tail = ring->tail;
+
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+			== PIPE_RING_SIZE)
+		return 0;
+
+	ring->slots[tail % PIPE_RING_SIZE] = val;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int ring_pop(struct spsc_ring *ring, int *val)
+{
+	unsigned int head = ring->head;
+
+	if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	*val = ring->slots[head % PIPE_RING_SIZE];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static unsigned int ring_count(struct spsc_ring *ring)
+{
+	return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/* Run the full enhancement and minutiae detection chain on fp, using the
+ * caller's scratch buffers. fp is modified. If enhanced is not NULL, it is
+ * set to the time at which enhancement finished. */
+struct dpfp_mset *dpfp_process_frame(struct dpfp_fprint *fp,
+	struct dpfp_fprint *base, struct dpfp_fprint *mask,
+	struct dpfp_ffield *direction, struct dpfp_ffield *frequency,
+	struct dpfp_mset *mset, double *enhanced)
+{
+	/* Basic enhancements: subtract base image, flip to correct orientation */
+	if (dpfp_fprint_rotate_subtract(fp, fp, base) < 0)
+		dpfp_fprint_rotate_subtract(fp, fp, NULL);
+
+	/* More advanced enhancements */
+	dpfp_fprint_soften_mean(fp, 3);
+	dpfp_fprint_get_direction(fp, direction, 7, 8);
+	dpfp_fprint_get_frequency(fp, direction, frequency);
+	dpfp_fprint_get_mask(fp, direction, frequency, mask);
+	dpfp_fprint_enhance_gabor(fp, direction, frequency, mask, 4.0);
+	dpfp_fprint_binarize(fp, 0x80);
+
+	if (enhanced) {
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		*enhanced = TV_TO_DOUBLE(tv);
+	}
+
+	/* Minutiae detection */
+	dpfp_fprint_thin(fp);
+	mset->count = 0;
+	dpfp_fprint_detect_minutiae(fp, mset);
+	return dpfp_mset_remove_noise(mset, mask);
+}
+
+/* Extract the minutiae of a captured fingerprint, given a base image of the
+ * empty sensor, or NULL if the device background model already removed it.
+ * fp is enhanced in place. The returned set is freed with dpfp_mset_free. */
+struct dpfp_mset *dpfp_fprint_process(struct dpfp_fprint *fp,
+	struct dpfp_fprint *base)
+{
+	struct dpfp_fprint *mask = dpfp_fprint_alloc();
+	struct dpfp_ffield *direction = dpfp_ffield_alloc();
+	struct dpfp_ffield *frequency = dpfp_ffield_alloc();
+	struct dpfp_mset *mset = dpfp_mset_alloc();
+	struct dpfp_mset *result;
+
+	result = dpfp_process_frame(fp, base, mask, direction, frequency, mset,
+		NULL);
+
+	dpfp_fprint_free(mask);
+	dpfp_mset_free(mset);
+	dpfp_ffield_free(direction);
+	dpfp_ffield_free(frequency);
+	return result;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct pipe_worker *worker = arg;
+	struct dpfp_pipeline *pl = worker->pl;
+	struct dpfp_mset *mset;
+	int idx;
+
+	while (1) {
+		sem_wait(&worker->sem);
+		if (__atomic_load_n(&pl->stop, __ATOMIC_ACQUIRE))
+			break;
+		if (!ring_pop(&worker->in, &idx))
+			continue;
+
+		mset = dpfp_process_frame(pl->bufs[idx], pl->base, worker->mask,
+			worker->direction, worker->frequency, worker->mset,
+			NULL);
+		pl->callback(pl, pl->bufs[idx], mset, 0, pl->user_data);
+		__atomic_add_fetch(&pl->processed, 1, __ATOMIC_RELAXED);
+
+		/* can't fail: the ring is as big as the number of buffers
+		 * which can be out at this worker */
+		ring_push(&worker->out, idx);
+	}
+
+	return NULL;
+}
+
+/* Collect buffers the workers are done with */
+static void reclaim(struct dpfp_pipeline *pl)
+{
+	int i, idx;
+
+	for (i = 0; i < pl->num_workers; i++)
+		while (ring_pop(&pl->workers[i].out, &idx))
+			pl->free_bufs[pl->num_free++] = idx;
+}
+
+/* Hand a frame to the next worker with room in its ring */
+static int dispatch(struct dpfp_pipeline *pl, int idx)
+{
+	int i;
+
+	for (i = 0; i < pl->num_workers; i++) {
+		struct pipe_worker *worker =
+			&pl->workers[(pl->next_worker + i) % pl->num_workers];
+
+		if (ring_count(&worker->in) >= PIPE_DEPTH)
+			continue;
+
+		ring_push(&worker->in, idx);
+		sem_post(&worker->sem);
+		pl->next_worker = (pl->next_worker + i + 1) % pl->num_workers;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *capture_thread(void *arg)
+{
+	struct dpfp_pipeline *pl = arg;
+	unsigned long seq = 0;
+	int idx;
+	int r;
+
+	while (!__atomic_load_n(&pl->stop, __ATOMIC_ACQUIRE)) {
+		reclaim(pl);
+		idx = pl->free_bufs[--pl->num_free];
+
+		r = dpfp_capture_fprint(pl->dev, pl->bufs[idx]);
+		if (r < 0) {
+			pl->free_bufs[pl->num_free++] = idx;
+			pl->callback(pl, NULL, NULL, r, pl->user_data);
+			if (r == -ETIMEDOUT)
+				continue;
+			break;
+		}
+
+		pl->bufs[idx]->seq = seq++;
+		pl->captured++;
+		if (!dispatch(pl, idx)) {
+			pl->free_bufs[pl->num_free++] = idx;
+			pl->dropped++;
+		}
+	}
+
+	return NULL;
+}
+
+static void pipeline_free(struct dpfp_pipeline *pl)
+{
+	int i;
+
+	for (i = 0; i < pl->num_workers; i++) {
+		struct pipe_worker *worker = &pl->workers[i];
+
+		sem_destroy(&worker->sem);
+		if (worker->mask)
+			dpfp_fprint_free(worker->mask);
+		if (worker->direction)
+			dpfp_ffield_free(worker->direction);
+		if (worker->frequency)
+			dpfp_ffield_free(worker->frequency);
+		if (worker->mset)
+			dpfp_mset_free(worker->mset);
+	}
+
+	for (i = 0; pl->bufs && i < pl->num_bufs; i++)
+		if (pl->bufs[i])
+			dpfp_fprint_free(pl->bufs[i]);
+
+	if (pl->base)
+		dpfp_fprint_free(pl->base);
+	free(pl->bufs);
+	free(pl->free_bufs);
+	free(pl);
+}
+
+/* Start the capture thread, trying for real-time priority */
+static int start_capture_thread(struct dpfp_pipeline *pl)
+{
+	struct sched_param param;
+	pthread_attr_t attr;
+	int r;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+
+	r = pthread_create(&pl->capture_thread, &attr, capture_thread, pl);
+	pthread_attr_destroy(&attr);
+	if (r == 0)
+		return 0;
+
+	dbg(DBG_INFO, "no real-time priority for capture thread");
+	return -pthread_create(&pl->capture_thread, NULL, capture_thread, pl);
+}
+
+/* Start capturing from dev, which must already be in DPFP_MODE_SEND_FINGER,
+ * and extracting minutiae with num_workers processing threads. base is an
+ * image of the empty sensor and is copied, or NULL when frames come out of
+ * dpfp_capture_fprint with the background already subtracted.
+ *
+ * The callback runs on the worker threads, possibly several at once, with
+ * the enhanced frame and its minutiae set, which the callback takes
+ * ownership of. Frames carry increasing sequence numbers but may complete
+ * out of order. Capture errors are reported from the capture thread with a
+ * NULL frame and set; a timeout does not end the pipeline, other errors
+ * do. */
+struct dpfp_pipeline *dpfp_pipeline_start(struct dpfp_dev *dev,
+	struct dpfp_fprint *base, int num_workers, dpfp_pipeline_cb callback,
+	void *user_data)
+{
+	struct dpfp_pipeline *pl;
+	int i;
+
+	if (num_workers < 1 || num_workers > PIPE_MAX_WORKERS
+			|| callback == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pl = malloc(sizeof(*pl));
+	if (pl == NULL)
+		return NULL;
+
+	memset(pl, 0, sizeof(*pl));
+	pl->dev = dev;
+	pl->callback = callback;
+	pl->user_data = user_data;
+
+	if (base) {
+		pl->base = dpfp_fprint_alloc();
+		if (pl->base == NULL)
+			goto err;
+		memcpy(pl->base->header, base->header,
+			base->header_size + base->data_size);
+		pl->base->header_size = base->header_size;
+		pl->base->data_size = base->data_size;
+	}
+
+	/* every worker's queue full plus one in processing, and one being
+	 * captured into */
+	pl->num_bufs = num_workers * (PIPE_DEPTH + 1) + 1;
+	pl->bufs = calloc(pl->num_bufs, sizeof(*pl->bufs));
+	pl->free_bufs = calloc(pl->num_bufs, sizeof(*pl->free_bufs));
+	if (pl->bufs == NULL || pl->free_bufs == NULL)
+		goto err;
+
+	for (i = 0; i < pl->num_bufs; i++) {
+		pl->bufs[i] = dpfp_fprint_alloc();
+		if (pl->bufs[i] == NULL)
+			goto err;
+		pl->free_bufs[pl->num_free++] = i;
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		struct pipe_worker *worker = &pl->workers[i];
+
+		worker->pl = pl;
+		sem_init(&worker->sem, 0, 0);
+		pl->num_workers++;
+
+		worker->mask = dpfp_fprint_alloc();
+		worker->direction = dpfp_ffield_alloc();
+		worker->frequency = dpfp_ffield_alloc();
+		worker->mset = dpfp_mset_alloc();
+		if (!worker->mask || !worker->direction || !worker->frequency
+				|| !worker->mset)
+			goto err;
+	}
+
+	for (i = 0; i < num_workers; i++)
+		if (pthread_create(&pl->workers[i].thread, NULL, worker_thread,
+				&pl->workers[i]) != 0)
+			goto err_threads;
+
+	if (start_capture_thread(pl) < 0)
+		goto err_threads;
+
+	return pl;
+
+err_threads:
+	pl->stop = 1;
+	while (--i >= 0) {
+		sem_post(&pl->workers[i].sem);
+		pthread_join(pl->workers[i].thread, NULL);
+	}
+err:
+	pipeline_free(pl);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* Stop capturing and processing and free the pipeline. Frames which are
+ * still queued are discarded. Must not be called from the callback. */
+void dpfp_pipeline_stop(struct dpfp_pipeline *pl)
+{
+	int i;
+
+	__atomic_store_n(&pl->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(pl->capture_thread, NULL);
+
+	for (i = 0; i < pl->num_workers; i++) {
+		sem_post(&pl->workers[i].sem);
+		pthread_join(pl->workers[i].thread, NULL);
+	}
+
+	pipeline_free(pl);
+}
+
+void dpfp_pipeline_get_stats(struct dpfp_pipeline *pl,
+	struct dpfp_pipeline_stats *stats)
+{
+	stats->captured = __atomic_load_n(&pl->captured, __ATOMIC_RELAXED);
+	stats->processed = __atomic_load_n(&pl->processed, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&pl->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,214 @@
+/*
+ * Software finger presence detection
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Instead of waiting for the sensor to raise a finger-on interrupt and only
+ * then switching it to DPFP_MODE_SEND_FINGER, the sensor is left streaming
+ * and each frame is compared to a base frame of the empty sensor.
+ *
+ * The image is split into PRESENCE_BLOCK x PRESENCE_BLOCK blocks. The energy
+ * of a block is the sum of |frame - base| over every PRESENCE_ROW_STEP'th row
+ * of the block, which is exactly one SSE2 psadbw per sampled row. A block is
+ * covered when its mean absolute difference exceeds the energy threshold,
+ * and the finger is present once the covered fraction of all blocks reaches
+ * the coverage threshold. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define PRESENCE_BLOCK		16
+#define PRESENCE_ROW_STEP	4
+#define PRESENCE_SAMPLES	(PRESENCE_BLOCK * PRESENCE_BLOCK / PRESENCE_ROW_STEP)
+#define PRESENCE_COLS		(DPFP_IMG_WIDTH / PRESENCE_BLOCK)
+#define PRESENCE_ROWS		(DPFP_IMG_HEIGHT / PRESENCE_BLOCK)
+
+/* mean absolute difference per pixel for a covered block */
+#define DEFAULT_ENERGY		20
+#define DEFAULT_COVERAGE	0.25
+
+struct dpfp_presence {
+	unsigned char base[DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT];
+	/* threshold on the block sum */
+	unsigned int block_energy;
+	double coverage;
+};
+
+struct dpfp_presence *dpfp_presence_alloc(struct dpfp_fprint *base)
+{
+	struct dpfp_presence *presence;
+
+	if (base->data_size < sizeof(presence->base)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	presence = malloc(sizeof(*presence));
+	if (presence == NULL)
+		return NULL;
+
+	memcpy(presence->base, base->data, sizeof(presence->base));
+	dpfp_presence_set_threshold(presence, DEFAULT_ENERGY, DEFAULT_COVERAGE);
+	return presence;
+}
+
+void dpfp_presence_free(struct dpfp_presence *presence)
+{
+	free(presence);
+}
+
+/* Replace the empty-sensor reference frame */
+void dpfp_presence_set_base(struct dpfp_presence *presence,
+	struct dpfp_fprint *base)
+{
+	memcpy(presence->base, base->data, sizeof(presence->base));
+}
+
+/* energy: mean absolute difference from the base frame (0-255) above which
+ * a block counts as covered. coverage: fraction of covered blocks (0-1) at
+ * which a finger is considered present. */
+void dpfp_presence_set_threshold(struct dpfp_presence *presence, int energy,
+	double coverage)
+{
+	presence->block_energy = energy * PRESENCE_SAMPLES;
+	presence->coverage = coverage;
+}
+
+#ifdef __SSE2__
+static unsigned int block_energy(const unsigned char *img,
+	const unsigned char *base)
+{
+	__m128i sum = _mm_setzero_si128();
+	int y;
+
+	for (y = 0; y < PRESENCE_BLOCK; y += PRESENCE_ROW_STEP) {
+		int off = y * DPFP_IMG_WIDTH;
+		__m128i a = _mm_loadu_si128((const __m128i *) (img + off));
+		__m128i b = _mm_loadu_si128((const __m128i *) (base + off));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(a, b));
+	}
+
+	return _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+}
+#else
+static unsigned int block_energy(const unsigned char *img,
+	const unsigned char *base)
+{
+	unsigned int sum = 0;
+	int x, y;
+
+	for (y = 0; y < PRESENCE_BLOCK; y += PRESENCE_ROW_STEP) {
+		int off = y * DPFP_IMG_WIDTH;
+		for (x = 0; x < PRESENCE_BLOCK; x++)
+			sum += abs(img[off + x] - base[off + x]);
+	}
+
+	return sum;
+}
+#endif
+
+/* Fraction of blocks of fp which differ from the base frame */
+double dpfp_presence_get_coverage(struct dpfp_presence *presence,
+	struct dpfp_fprint *fp)
+{
+	int covered = 0;
+	int bx, by;
+
+	if (fp->data_size < sizeof(presence->base))
+		return 0;
+
+	for (by = 0; by < PRESENCE_ROWS; by++) {
+		int row = by * PRESENCE_BLOCK * DPFP_IMG_WIDTH;
+		for (bx = 0; bx < PRESENCE_COLS; bx++) {
+			int off = row + bx * PRESENCE_BLOCK;
+			if (block_energy(fp->data + off, presence->base + off)
+					> presence->block_energy)
+				covered++;
+		}
+	}
+
+	return (double) covered / (PRESENCE_COLS * PRESENCE_ROWS);
+}
+
+int dpfp_presence_detected(struct dpfp_presence *presence,
+	struct dpfp_fprint *fp)
+{
+	return dpfp_presence_get_coverage(presence, fp) >= presence->coverage;
+}
+
+/* Capture frames from dev, which must already be in DPFP_MODE_SEND_FINGER,
+ * until one shows a finger covering the sensor. That frame is left in fp.
+ * timeout is in milliseconds and applies to each frame; 0 uses the default.
+ * If report is not NULL it receives how the detection went. */
+int dpfp_presence_await(struct dpfp_dev *dev, struct dpfp_presence *presence,
+	struct dpfp_fprint *fp, int timeout, struct dpfp_presence_report *report)
+{
+	double last_empty = 0;
+	double first_contact = 0;
+	unsigned long frames = 0;
+	double coverage;
+	int r;
+
+	if (timeout <= 0)
+		timeout = DATA_TIMEOUT;
+
+	while (1) {
+		r = dpfp_capture_raw(dev, fp, timeout);
+		if (r < 0)
+			return r;
+		frames++;
+
+		/* The detector's base is a raw frame of the empty sensor, so
+		 * the frame is judged before the background model, with
+		 * DPFP_BG_AUTO_SUBTRACT, takes its own base off it */
+		coverage = dpfp_presence_get_coverage(presence, fp);
+		if (dev->background)
+			dpfp_background_apply(dev, fp);
+		if (coverage == 0) {
+			last_empty = fp->timestamp;
+			first_contact = 0;
+			continue;
+		}
+
+		if (first_contact == 0)
+			first_contact = fp->timestamp;
+		if (coverage >= presence->coverage)
+			break;
+	}
+
+	if (report) {
+		report->frames = frames;
+		report->coverage = coverage;
+		report->contact_time = first_contact;
+		report->frame_time = fp->timestamp;
+		/* The finger went down after the last empty frame was read out,
+		 * so this bounds touch-to-frame latency from above */
+		report->latency = last_empty ? (fp->timestamp - last_empty) * 1000
+			: 0;
+	}
+
+	return 0;
+}
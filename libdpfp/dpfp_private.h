@@ -21,6 +21,7 @@
 #ifndef __DPFP_PRIVATE_H__
 #define __DPFP_PRIVATE_H__
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 
@@ -59,9 +60,53 @@ struct dpfp_dev_type {
 	uint32_t fw_enc_offset;
 };
 
+struct dpfp_irq_listener;
+struct dpfp_background;
+struct dpfp_crypt;
+struct dpfp_dev;
+
+/* Device I/O backend, see dpfp_transport.c */
+struct dpfp_transport_ops {
+	int (*control)(struct dpfp_dev *dev, int requesttype, int request,
+		int value, int index, unsigned char *buf, int size, int timeout);
+	int (*bulk_read)(struct dpfp_dev *dev, int ep, unsigned char *buf,
+		int size, int timeout);
+	int (*interrupt_read)(struct dpfp_dev *dev, int ep, unsigned char *buf,
+		int size, int timeout);
+	int (*close)(struct dpfp_dev *dev);
+};
+
 struct dpfp_dev {
+	const struct dpfp_transport_ops *ops;
+	void *transport;
 	struct usb_dev_handle *handle;
+	int interface;
 	const struct dpfp_dev_entry *dev_entry;
+	struct dpfp_irq_listener *irq;
+	struct dpfp_background *background;
+	struct dpfp_crypt *crypt;
+	char path[DPFP_PATH_LENGTH];
+	/* set by the registry once the device has left the bus; accessed
+	 * atomically */
+	int unplugged;
+	int flags;
+	/* when dpfp_open_usb started, for the open timing */
+	double open_start;
+	struct dpfp_open_timing timing;
+	struct dpfp_telemetry telemetry;
+	/* last mode set; accessed atomically */
+	unsigned char mode;
+	/* Mode changes and frame transfers are bracketed by dpfp_io_begin
+	 * and dpfp_io_end. A recovery waits for those in flight to finish
+	 * and holds new ones off until it is done. */
+	pthread_mutex_t io_lock;
+	pthread_cond_t io_cond;
+	int io_busy;
+	int recovering;
+	/* transfers which failed, and expected interrupts which did not
+	 * come, in a row; for the watchdog */
+	int stalls;
+	int irq_stalls;
 };
 
 enum {
@@ -72,6 +117,7 @@ enum {
 
 /* URB timeouts */
 #define CTRL_TIMEOUT 1000
+#define DATA_TIMEOUT 5000
 
 /* To be implemented later */
 #define dbg(lvl, msg) printf("%s: " msg "\n", __func__)
@@ -105,14 +151,126 @@ enum {
 #define DATABLK1_RQSIZE		0x10000
 #define DATABLK2_RQSIZE		0xb340
 
+/* Frame header layout */
+#define HDR_NUM_LINES		0x04	/* le16 */
+#define HDR_KEY_NUMBER		0x06
+#define HDR_BLOCK_INFO		0x10	/* flags, num_lines pairs */
+#define HDR_MAX_LINES		((DATABLK1_RQSIZE + DATABLK2_RQSIZE - 64) \
+					/ DPFP_IMG_WIDTH)
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define be16_to_cpu(x) (((x & 0xff) << 8) | (x >> 8))
+#define le16_to_cpu(x) (x)
 #elif __BYTE_ORDER == __BIG_ENDIAN
 #define be16_to_cpu(x) (x)
+#define le16_to_cpu(x) (((x & 0xff) << 8) | (x >> 8))
 #else
 #error "Unrecognized endianness"
 #endif
 
+const struct dpfp_dev_entry *dpfp_lookup_dev_entry(uint16_t vid, uint16_t pid);
+const struct dpfp_dev_entry *dpfp_get_dev_entry(struct usb_device *udev);
+struct dpfp_dev *dpfp_open_usb(struct usb_device *udev,
+	const struct dpfp_dev_entry *deventry, int flags, const char *record);
+int dpfp_open_finish(struct dpfp_dev *dev);
+
+void dpfp_registry_init(void);
+struct dpfp_dev *dpfp_registry_open(int idx, int flags, const char *record);
+void dpfp_registry_release(struct dpfp_dev *dev);
+
+extern const struct dpfp_transport_ops dpfp_usb_transport;
+int dpfp_transport_record(struct dpfp_dev *dev, const char *filename);
+int dpfp_transport_replay(struct dpfp_dev *dev, const char *filename,
+	enum dpfp_replay_speed speed, uint16_t *vid, uint16_t *pid);
+int dpfp_control_msg(struct dpfp_dev *dev, int requesttype, int request,
+	int value, int index, unsigned char *buf, int size, int timeout);
+int dpfp_bulk_read(struct dpfp_dev *dev, int ep, unsigned char *buf, int size,
+	int timeout);
+int dpfp_interrupt_read(struct dpfp_dev *dev, int ep, unsigned char *buf,
+	int size, int timeout);
+void dpfp_irq_missed(struct dpfp_dev *dev);
+
+void dpfp_irq_request_stop(struct dpfp_dev *dev);
+unsigned long dpfp_irq_position(struct dpfp_dev *dev);
+int dpfp_irq_wait(struct dpfp_dev *dev, unsigned long *pos,
+	unsigned char *buf, int timeout);
+int dpfp_get_irq_from(struct dpfp_dev *dev, unsigned long *pos,
+	unsigned char *buf, int timeout);
+int dpfp_get_irq_type_from(struct dpfp_dev *dev, unsigned long *pos,
+	uint16_t irqtype, unsigned char *irqbuf, int timeout);
+
+#define TELEMETRY_INC(dev, field) \
+	__atomic_add_fetch(&(dev)->telemetry.field, 1, __ATOMIC_RELAXED)
+
+uint64_t dpfp_telemetry_now(void);
+void dpfp_telemetry_record(struct dpfp_histogram *hist, uint64_t start);
+void dpfp_telemetry_irq(struct dpfp_dev *dev, const unsigned char *buf,
+	int r);
+
+int dpfp_recover(struct dpfp_dev *dev);
+void dpfp_io_begin(struct dpfp_dev *dev);
+void dpfp_io_end(struct dpfp_dev *dev);
+int dpfp_write_mode(struct dpfp_dev *dev, unsigned char mode);
+
+int dpfp_capture_raw(struct dpfp_dev *dev, struct dpfp_fprint *fp,
+	int timeout);
+void dpfp_background_apply(struct dpfp_dev *dev, struct dpfp_fprint *fp);
+int dpfp_background_get_flags(struct dpfp_dev *dev);
+
+int dpfp_presence_detected(struct dpfp_presence *presence,
+	struct dpfp_fprint *fp);
+
+int dpfp_challenge(struct dpfp_dev *dev, unsigned char *param);
+int dpfp_read_response(struct dpfp_dev *dev, unsigned char *buf);
+
+/* Progress through the image blocks of an encrypted frame */
+struct dpfp_decoder {
+	struct dpfp_frame_info info;
+	uint32_t key;
+	int key_number;
+	int block;
+	/* first byte of the current block, and next byte to decrypt */
+	int start;
+	int pos;
+};
+
+int dpfp_decrypt_start(struct dpfp_dev *dev, struct dpfp_fprint *fp,
+	struct dpfp_decoder *dec);
+int dpfp_decrypt_upto(struct dpfp_dev *dev, struct dpfp_fprint *fp,
+	struct dpfp_decoder *dec, int avail);
+int dpfp_decrypt_frame(struct dpfp_dev *dev, struct dpfp_fprint *fp);
+void dpfp_crypt_reset(struct dpfp_dev *dev);
+void dpfp_crypt_free(struct dpfp_dev *dev);
+
+struct dpfp_mset *dpfp_process_frame(struct dpfp_fprint *fp,
+	struct dpfp_fprint *base, struct dpfp_fprint *mask,
+	struct dpfp_ffield *direction, struct dpfp_ffield *frequency,
+	struct dpfp_mset *mset, double *enhanced);
+
+void dpfp_soften_rows(const unsigned char *src, unsigned char *dst, int size,
+	int first, int last);
+void dpfp_direction_rows(const unsigned char *imgbuf, double *out,
+	double scale, int block_size, int first, int last);
+void dpfp_direction_vec_rows(const unsigned char *imgbuf, double *phi,
+	int block_size, int first, int last);
+void dpfp_direction_vec_clear(double *phi);
+int dpfp_direction_low_pass(const double *phi, double *ffbuf,
+	int filter_size);
+
+/* Accuracy tiers of the vector math functions, see dpfp_math.c */
+enum dpfp_math_accuracy {
+	DPFP_MATH_PRECISE,
+	DPFP_MATH_FAST,
+};
+
+void dpfp_math_sincos(const double *x, double *s, double *c, int n,
+	enum dpfp_math_accuracy acc);
+void dpfp_math_atan2(const double *y, const double *x, double *out, int n);
+void dpfp_math_exp(const double *x, double *out, int n,
+	enum dpfp_math_accuracy acc);
+void dpfp_math_pow(const double *x, double y, double *out, int n,
+	enum dpfp_math_accuracy acc);
+
 #define TV_TO_DOUBLE(tv) (tv.tv_sec + (tv.tv_usec / 1000000.0))
 
 #endif
@@ -0,0 +1,581 @@
+/*
+ * Device registry and hotplug tracking
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The registry is the list of supported readers currently on the bus, in
+ * bus scan order. It is built once by dpfp_init and then only rebuilt when
+ * the kernel reports that a supported device arrived or left (via a netlink
+ * uevent socket on Linux), or when the application calls dpfp_rescan.
+ * Lookups by index, bus path and vendor/product ID are table/hash lookups
+ * and never touch the bus.
+ *
+ * libusb-0.1 frees the usb_device of a departed device during the rescan, so
+ * every enumeration and every use of a registry usb_device happens under the
+ * registry lock. Opening a device only holds the lock while it claims the
+ * reader; the entry is marked as being opened, the lock is dropped for the
+ * power-up sequence, which can take seconds, and the device is published
+ * once it is ready. */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#endif
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define REG_MAX_READERS	64
+/* power of two, well above REG_MAX_READERS to keep probe chains short */
+#define REG_HASH_SIZE	256
+/* how long to wait for libusb to see a device the kernel announced */
+#define REG_ADD_RETRIES	10
+#define REG_ADD_DELAY	50000
+
+struct reg_entry {
+	struct dpfp_reader_info info;
+	struct usb_device *udev;
+	const struct dpfp_dev_entry *deventry;
+	/* open instance, if any */
+	struct dpfp_dev *dev;
+	/* being powered up by dpfp_registry_open, not yet in dev */
+	int opening;
+};
+
+static struct {
+	int initialized;
+	pthread_mutex_t lock;
+
+	struct reg_entry entries[REG_MAX_READERS];
+	int num_entries;
+	/* entry index + 1, 0 for an empty bucket */
+	unsigned char path_hash[REG_HASH_SIZE];
+	/* first entry with a given vendor/product */
+	unsigned char id_hash[REG_HASH_SIZE];
+
+	dpfp_hotplug_cb callback;
+	void *user_data;
+
+	int monitor_fd;
+	int wake_pipe[2];
+	pthread_t thread;
+} registry = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.monitor_fd = -1,
+};
+
+static unsigned int hash_path(const char *path)
+{
+	unsigned int h = 2166136261u;
+
+	while (*path)
+		h = (h ^ (unsigned char) *path++) * 16777619u;
+	return h & (REG_HASH_SIZE - 1);
+}
+
+static unsigned int hash_id(uint16_t vendor, uint16_t product)
+{
+	uint32_t key = ((uint32_t) vendor << 16) | product;
+
+	return ((key * 2654435761u) >> 24) & (REG_HASH_SIZE - 1);
+}
+
+static void rebuild_hashes(void)
+{
+	int i;
+
+	memset(registry.path_hash, 0, sizeof(registry.path_hash));
+	memset(registry.id_hash, 0, sizeof(registry.id_hash));
+
+	for (i = 0; i < registry.num_entries; i++) {
+		struct dpfp_reader_info *info = &registry.entries[i].info;
+		unsigned int h;
+
+		h = hash_path(info->path);
+		while (registry.path_hash[h])
+			h = (h + 1) & (REG_HASH_SIZE - 1);
+		registry.path_hash[h] = i + 1;
+
+		h = hash_id(info->vendor, info->product);
+		while (registry.id_hash[h]) {
+			struct dpfp_reader_info *other =
+				&registry.entries[registry.id_hash[h] - 1].info;
+			if (other->vendor == info->vendor
+					&& other->product == info->product)
+				break;
+			h = (h + 1) & (REG_HASH_SIZE - 1);
+		}
+		if (registry.id_hash[h] == 0)
+			registry.id_hash[h] = i + 1;
+	}
+}
+
+/* Called with the lock held */
+static int lookup_path(const char *path)
+{
+	unsigned int h = hash_path(path);
+
+	while (registry.path_hash[h]) {
+		int idx = registry.path_hash[h] - 1;
+		if (strcmp(registry.entries[idx].info.path, path) == 0)
+			return idx;
+		h = (h + 1) & (REG_HASH_SIZE - 1);
+	}
+
+	return -1;
+}
+
+/* Called with the lock held */
+static int lookup_id(uint16_t vendor, uint16_t product)
+{
+	unsigned int h = hash_id(vendor, product);
+
+	while (registry.id_hash[h]) {
+		struct dpfp_reader_info *info =
+			&registry.entries[registry.id_hash[h] - 1].info;
+		if (info->vendor == vendor && info->product == product)
+			return registry.id_hash[h] - 1;
+		h = (h + 1) & (REG_HASH_SIZE - 1);
+	}
+
+	return -1;
+}
+
+/* Re-enumerate the bus and rebuild the registry, called with the lock held.
+ * Readers which appeared or disappeared since the last scan are returned in
+ * arrived and left; open devices which disappeared are flagged so that
+ * further I/O on them fails immediately. */
+static void rescan(struct dpfp_reader_info *arrived, int *num_arrived,
+	struct dpfp_reader_info *left, int *num_left)
+{
+	struct reg_entry old[REG_MAX_READERS];
+	int num_old = registry.num_entries;
+	struct usb_bus *bus;
+	int i;
+
+	memcpy(old, registry.entries, sizeof(old[0]) * num_old);
+	registry.num_entries = 0;
+	*num_arrived = 0;
+	*num_left = 0;
+
+	usb_find_busses();
+	usb_find_devices();
+
+	for (bus = usb_busses; bus; bus = bus->next) {
+		struct usb_device *udev;
+
+		for (udev = bus->devices; udev; udev = udev->next) {
+			const struct dpfp_dev_entry *deventry;
+			struct reg_entry *entry;
+
+			if (registry.num_entries == REG_MAX_READERS)
+				break;
+
+			deventry = dpfp_get_dev_entry(udev);
+			if (deventry == NULL)
+				continue;
+
+			/* a truncated path could name another reader */
+			entry = &registry.entries[registry.num_entries];
+			memset(entry, 0, sizeof(*entry));
+			if (snprintf(entry->info.path, sizeof(entry->info.path),
+					"%s/%s", bus->dirname, udev->filename)
+					>= sizeof(entry->info.path)) {
+				dbgf(DBG_WARN, "bus path too long, skipping %s",
+					udev->filename);
+				continue;
+			}
+
+			entry->udev = udev;
+			entry->deventry = deventry;
+			entry->info.vendor = deventry->vid;
+			entry->info.product = deventry->pid;
+			entry->info.name = deventry->name;
+			registry.num_entries++;
+		}
+	}
+
+	rebuild_hashes();
+
+	for (i = 0; i < num_old; i++) {
+		int idx = lookup_path(old[i].info.path);
+
+		if (idx >= 0) {
+			registry.entries[idx].dev = old[i].dev;
+			registry.entries[idx].opening = old[i].opening;
+			continue;
+		}
+
+		/* a device still being opened finds out when it is
+		 * published */
+		if (old[i].dev)
+			__atomic_store_n(&old[i].dev->unplugged, 1,
+				__ATOMIC_RELAXED);
+		left[(*num_left)++] = old[i].info;
+	}
+
+	for (i = 0; i < registry.num_entries; i++) {
+		int j;
+
+		for (j = 0; j < num_old; j++)
+			if (strcmp(old[j].info.path,
+					registry.entries[i].info.path) == 0)
+				break;
+		if (j == num_old)
+			arrived[(*num_arrived)++] = registry.entries[i].info;
+	}
+}
+
+/* Rescan and report the changes to the hotplug callback. Returns the number
+ * of readers which arrived. */
+static int rescan_and_notify(void)
+{
+	struct dpfp_reader_info arrived[REG_MAX_READERS];
+	struct dpfp_reader_info left[REG_MAX_READERS];
+	int num_arrived, num_left;
+	dpfp_hotplug_cb callback;
+	void *user_data;
+	int i;
+
+	pthread_mutex_lock(&registry.lock);
+	rescan(arrived, &num_arrived, left, &num_left);
+	callback = registry.callback;
+	user_data = registry.user_data;
+	pthread_mutex_unlock(&registry.lock);
+
+	if (callback) {
+		for (i = 0; i < num_left; i++)
+			callback(&left[i], 0, user_data);
+		for (i = 0; i < num_arrived; i++)
+			callback(&arrived[i], 1, user_data);
+	}
+
+	return num_arrived;
+}
+
+#ifdef __linux__
+
+/* Does this uevent describe a supported reader arriving or leaving?
+ * Returns 1 for add, -1 for remove, 0 if it is of no interest. */
+static int parse_uevent(const char *buf, int len)
+{
+	const char *end = buf + len;
+	int action = 0, is_usb_device = 0, supported = 0;
+
+	for (; buf < end; buf += strlen(buf) + 1) {
+		unsigned int vendor, product;
+
+		if (strcmp(buf, "ACTION=add") == 0)
+			action = 1;
+		else if (strcmp(buf, "ACTION=remove") == 0)
+			action = -1;
+		else if (strcmp(buf, "DEVTYPE=usb_device") == 0)
+			is_usb_device = 1;
+		else if (sscanf(buf, "PRODUCT=%x/%x/", &vendor, &product) == 2)
+			supported = dpfp_lookup_dev_entry(vendor, product) != NULL;
+	}
+
+	return is_usb_device && supported ? action : 0;
+}
+
+static void *monitor_thread(void *arg)
+{
+	struct pollfd fds[2];
+	char buf[4096];
+	int len, action, i;
+
+	fds[0].fd = registry.monitor_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = registry.wake_pipe[0];
+	fds[1].events = POLLIN;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+
+		len = recv(registry.monitor_fd, buf, sizeof(buf) - 1, 0);
+		if (len <= 0)
+			continue;
+		buf[len] = '\0';
+
+		action = parse_uevent(buf, len);
+		if (action == 0)
+			continue;
+
+		/* The kernel may announce a device before its usbfs node is
+		 * ready for libusb to find */
+		for (i = 0; i < REG_ADD_RETRIES; i++) {
+			if (rescan_and_notify() > 0 || action < 0)
+				break;
+			usleep(REG_ADD_DELAY);
+		}
+	}
+
+	return NULL;
+}
+
+static void start_monitor(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		dbgf(DBG_WARN, "no uevent socket (%d), hotplug disabled", errno);
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0;
+	addr.nl_groups = 1;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		dbgf(DBG_WARN, "uevent bind failed (%d), hotplug disabled",
+			errno);
+		close(fd);
+		return;
+	}
+
+	if (pipe(registry.wake_pipe) < 0) {
+		close(fd);
+		return;
+	}
+
+	registry.monitor_fd = fd;
+	if (pthread_create(&registry.thread, NULL, monitor_thread, NULL) != 0) {
+		close(registry.wake_pipe[0]);
+		close(registry.wake_pipe[1]);
+		close(fd);
+		registry.monitor_fd = -1;
+	}
+}
+
+#else
+
+static void start_monitor(void)
+{
+	dbg(DBG_INFO, "no hotplug support on this platform, use dpfp_rescan");
+}
+
+#endif
+
+/* Build the registry and start watching for hotplug events. Called from
+ * dpfp_init. */
+void dpfp_registry_init(void)
+{
+	struct dpfp_reader_info arrived[REG_MAX_READERS];
+	struct dpfp_reader_info left[REG_MAX_READERS];
+	int num_arrived, num_left;
+
+	pthread_mutex_lock(&registry.lock);
+	if (registry.initialized) {
+		pthread_mutex_unlock(&registry.lock);
+		return;
+	}
+	registry.initialized = 1;
+	rescan(arrived, &num_arrived, left, &num_left);
+	pthread_mutex_unlock(&registry.lock);
+
+	start_monitor();
+}
+
+/* Stop hotplug monitoring. Devices may still be opened afterwards but the
+ * registry is no longer kept up to date. */
+void dpfp_exit(void)
+{
+	if (registry.monitor_fd < 0)
+		return;
+
+	if (write(registry.wake_pipe[1], "", 1) == 1)
+		pthread_join(registry.thread, NULL);
+	close(registry.wake_pipe[0]);
+	close(registry.wake_pipe[1]);
+	close(registry.monitor_fd);
+	registry.monitor_fd = -1;
+}
+
+/* Re-enumerate the bus now. Only needed where hotplug events are not
+ * available. Returns the number of readers present. */
+int dpfp_rescan(void)
+{
+	rescan_and_notify();
+	return dpfp_get_num_readers();
+}
+
+/* Register a function to be called from the hotplug thread whenever a
+ * supported reader is plugged in (arrived = 1) or removed (arrived = 0).
+ * Pass NULL to unregister. */
+void dpfp_set_hotplug_callback(dpfp_hotplug_cb callback, void *user_data)
+{
+	pthread_mutex_lock(&registry.lock);
+	registry.callback = callback;
+	registry.user_data = user_data;
+	pthread_mutex_unlock(&registry.lock);
+}
+
+int dpfp_get_num_readers(void)
+{
+	int num;
+
+	pthread_mutex_lock(&registry.lock);
+	num = registry.num_entries;
+	pthread_mutex_unlock(&registry.lock);
+
+	return num;
+}
+
+int dpfp_get_reader_info(int idx, struct dpfp_reader_info *info)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&registry.lock);
+	if (idx < 0 || idx >= registry.num_entries)
+		r = -ENODEV;
+	else
+		*info = registry.entries[idx].info;
+	pthread_mutex_unlock(&registry.lock);
+
+	return r;
+}
+
+/* Index of the reader at bus path (as in dpfp_reader_info), or -ENODEV */
+int dpfp_find_reader_path(const char *path)
+{
+	int idx;
+
+	pthread_mutex_lock(&registry.lock);
+	idx = lookup_path(path);
+	pthread_mutex_unlock(&registry.lock);
+
+	return idx >= 0 ? idx : -ENODEV;
+}
+
+/* Index of the first reader with the given IDs, or -ENODEV */
+int dpfp_find_reader(uint16_t vendor, uint16_t product)
+{
+	int idx;
+
+	pthread_mutex_lock(&registry.lock);
+	idx = lookup_id(vendor, product);
+	pthread_mutex_unlock(&registry.lock);
+
+	return idx >= 0 ? idx : -ENODEV;
+}
+
+/* Called with the lock held, which is dropped while the device powers up.
+ * Entries may have been reshuffled by a rescan by the time it is taken
+ * again, so the entry is looked up afresh by path. */
+static struct dpfp_dev *open_entry(int idx, int flags, const char *record)
+{
+	struct reg_entry *entry = &registry.entries[idx];
+	char path[DPFP_PATH_LENGTH];
+	struct dpfp_dev *dev;
+	int r;
+
+	if (entry->dev || entry->opening) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	dev = dpfp_open_usb(entry->udev, entry->deventry, flags, record);
+	if (dev == NULL)
+		return NULL;
+
+	strcpy(dev->path, entry->info.path);
+	/* dev is freed if the power-up fails */
+	strcpy(path, entry->info.path);
+	entry->opening = 1;
+	pthread_mutex_unlock(&registry.lock);
+
+	r = dpfp_open_finish(dev);
+
+	pthread_mutex_lock(&registry.lock);
+	idx = lookup_path(path);
+	if (idx >= 0)
+		registry.entries[idx].opening = 0;
+	if (r < 0) {
+		errno = -r;
+		return NULL;
+	}
+
+	if (idx < 0) {
+		dbgf(DBG_WARN, "%s left while being opened", path);
+		pthread_mutex_unlock(&registry.lock);
+		dpfp_close(dev);
+		pthread_mutex_lock(&registry.lock);
+		errno = ENODEV;
+		return NULL;
+	}
+
+	registry.entries[idx].dev = dev;
+	return dev;
+}
+
+struct dpfp_dev *dpfp_registry_open(int idx, int flags, const char *record)
+{
+	struct dpfp_dev *dev = NULL;
+
+	pthread_mutex_lock(&registry.lock);
+	if (idx >= 0 && idx < registry.num_entries)
+		dev = open_entry(idx, flags, record);
+	else
+		errno = ENODEV;
+	pthread_mutex_unlock(&registry.lock);
+
+	return dev;
+}
+
+struct dpfp_dev *dpfp_open_path(const char *path)
+{
+	struct dpfp_dev *dev = NULL;
+	int idx;
+
+	pthread_mutex_lock(&registry.lock);
+	idx = lookup_path(path);
+	if (idx >= 0)
+		dev = open_entry(idx, 0, NULL);
+	else
+		errno = ENODEV;
+	pthread_mutex_unlock(&registry.lock);
+
+	return dev;
+}
+
+/* Forget an open device, called from dpfp_close */
+void dpfp_registry_release(struct dpfp_dev *dev)
+{
+	int idx;
+
+	pthread_mutex_lock(&registry.lock);
+	idx = lookup_path(dev->path);
+	if (idx >= 0 && registry.entries[idx].dev == dev)
+		registry.entries[idx].dev = NULL;
+	pthread_mutex_unlock(&registry.lock);
+}
@@ -0,0 +1,312 @@
+/*
+ * Preallocated frame ring for continuous capture
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The ring holds num_slots frames in a single cache-aligned allocation. The
+ * producer captures straight into a free slot and publishes it with the
+ * next sequence number.
+ *
+ * Every registered reader sees published frames in order and borrows the
+ * slot itself rather than a copy. Borrowed slots are never overwritten.
+ * When the producer needs a slot and the oldest frame has not been consumed
+ * by every reader yet, the policy decides: DPFP_RING_BLOCK stalls the
+ * producer until the readers catch up, DPFP_RING_DROP_OLDEST recycles the
+ * slot anyway and the lagging readers skip over the lost frames, which are
+ * counted per reader. The producer only stalls under DPFP_RING_DROP_OLDEST
+ * when every slot is borrowed. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define RING_ALIGN		64
+#define RING_MAX_READERS	8
+
+struct ring_slot {
+	struct dpfp_fprint fp;
+	int refs;
+	/* set once fp.seq holds a published frame */
+	int valid;
+};
+
+struct ring_reader {
+	int active;
+	unsigned long next_seq;
+	unsigned long dropped;
+};
+
+struct dpfp_ring {
+	int num_slots;
+	enum dpfp_ring_policy policy;
+	struct ring_slot *slots;
+	unsigned char *frames;
+
+	/* sequence number the next published frame will carry */
+	unsigned long write_seq;
+	struct ring_reader readers[RING_MAX_READERS];
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+#define SLOT_STRIDE \
+	(((DATABLK1_RQSIZE + DATABLK2_RQSIZE) + RING_ALIGN - 1) & ~(RING_ALIGN - 1))
+
+struct dpfp_ring *dpfp_ring_alloc(int num_slots, enum dpfp_ring_policy policy)
+{
+	struct dpfp_ring *ring;
+	int i;
+
+	if (num_slots < 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ring = malloc(sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->num_slots = num_slots;
+	ring->policy = policy;
+
+	ring->slots = calloc(num_slots, sizeof(*ring->slots));
+	if (ring->slots == NULL)
+		goto err;
+
+	if (posix_memalign((void **) &ring->frames, RING_ALIGN,
+			(size_t) SLOT_STRIDE * num_slots) != 0)
+		goto err;
+
+	for (i = 0; i < num_slots; i++) {
+		struct dpfp_fprint *fp = &ring->slots[i].fp;
+		fp->header = ring->frames + (size_t) SLOT_STRIDE * i;
+		fp->data = fp->header + 64;
+	}
+
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	return ring;
+
+err:
+	free(ring->slots);
+	free(ring);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void dpfp_ring_free(struct dpfp_ring *ring)
+{
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->frames);
+	free(ring->slots);
+	free(ring);
+}
+
+/* Register a new reader. It will see frames published from now on. Returns
+ * the reader ID, or -1 if all reader slots are taken. */
+int dpfp_ring_add_reader(struct dpfp_ring *ring)
+{
+	int i;
+
+	pthread_mutex_lock(&ring->lock);
+	for (i = 0; i < RING_MAX_READERS; i++) {
+		struct ring_reader *reader = &ring->readers[i];
+		if (reader->active)
+			continue;
+
+		reader->active = 1;
+		reader->next_seq = ring->write_seq;
+		reader->dropped = 0;
+		pthread_mutex_unlock(&ring->lock);
+		return i;
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	errno = ENOSPC;
+	return -1;
+}
+
+void dpfp_ring_remove_reader(struct dpfp_ring *ring, int reader)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->readers[reader].active = 0;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/* Has every active reader consumed frame seq? */
+static int consumed_by_all(struct dpfp_ring *ring, unsigned long seq)
+{
+	int i;
+
+	for (i = 0; i < RING_MAX_READERS; i++)
+		if (ring->readers[i].active && ring->readers[i].next_seq <= seq)
+			return 0;
+
+	return 1;
+}
+
+/* Pick a slot for the producer to write into: an unused one if available,
+ * otherwise the unborrowed slot holding the oldest frame, subject to the
+ * backpressure policy. */
+static struct ring_slot *find_write_slot(struct dpfp_ring *ring)
+{
+	struct ring_slot *oldest = NULL;
+	int i;
+
+	for (i = 0; i < ring->num_slots; i++) {
+		struct ring_slot *slot = &ring->slots[i];
+		if (slot->refs > 0)
+			continue;
+		if (!slot->valid)
+			return slot;
+		if (oldest == NULL || slot->fp.seq < oldest->fp.seq)
+			oldest = slot;
+	}
+
+	if (oldest && ring->policy == DPFP_RING_BLOCK
+			&& !consumed_by_all(ring, oldest->fp.seq))
+		return NULL;
+
+	return oldest;
+}
+
+/* Capture the next frame from dev directly into the ring and publish it.
+ * Only one thread may act as producer. timeout is in milliseconds and
+ * bounds the USB transfer only; the producer may additionally wait for a
+ * slot as described above. */
+int dpfp_ring_capture(struct dpfp_ring *ring, struct dpfp_dev *dev,
+	int timeout)
+{
+	struct ring_slot *slot;
+	int r;
+
+	pthread_mutex_lock(&ring->lock);
+	while ((slot = find_write_slot(ring)) == NULL)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	slot->valid = 0;
+	pthread_mutex_unlock(&ring->lock);
+
+	/* Readers ignore invalid slots, so the transfer runs unlocked */
+	r = dpfp_capture_fprint_timeout(dev, &slot->fp, timeout);
+
+	pthread_mutex_lock(&ring->lock);
+	if (r == 0) {
+		slot->fp.seq = ring->write_seq++;
+		slot->valid = 1;
+	}
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+
+	return r;
+}
+
+/* Oldest published frame with a sequence number of at least seq */
+static struct ring_slot *find_read_slot(struct dpfp_ring *ring,
+	unsigned long seq)
+{
+	struct ring_slot *found = NULL;
+	int i;
+
+	for (i = 0; i < ring->num_slots; i++) {
+		struct ring_slot *slot = &ring->slots[i];
+		if (!slot->valid || slot->fp.seq < seq)
+			continue;
+		if (found == NULL || slot->fp.seq < found->fp.seq)
+			found = slot;
+	}
+
+	return found;
+}
+
+/* Borrow the next frame for reader. The frame stays valid and unmodified
+ * until handed back with dpfp_ring_return. timeout is in milliseconds, 0
+ * means wait forever. Returns NULL with errno ETIMEDOUT if no frame
+ * arrived in time. */
+struct dpfp_fprint *dpfp_ring_borrow(struct dpfp_ring *ring, int reader,
+	int timeout)
+{
+	struct ring_reader *rd = &ring->readers[reader];
+	struct ring_slot *slot;
+	struct timespec ts;
+	struct timeval tv;
+	int r = 0;
+
+	if (timeout > 0) {
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec + timeout / 1000;
+		ts.tv_nsec = tv.tv_usec * 1000 + (timeout % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	while ((slot = find_read_slot(ring, rd->next_seq)) == NULL && r == 0) {
+		if (timeout > 0)
+			r = pthread_cond_timedwait(&ring->cond, &ring->lock, &ts);
+		else
+			pthread_cond_wait(&ring->cond, &ring->lock);
+	}
+
+	if (slot == NULL) {
+		pthread_mutex_unlock(&ring->lock);
+		errno = ETIMEDOUT;
+		return NULL;
+	}
+
+	/* anything between our position and this frame was recycled */
+	rd->dropped += slot->fp.seq - rd->next_seq;
+	rd->next_seq = slot->fp.seq + 1;
+	slot->refs++;
+	pthread_mutex_unlock(&ring->lock);
+
+	return &slot->fp;
+}
+
+/* Hand a borrowed frame back to the ring */
+void dpfp_ring_return(struct dpfp_ring *ring, struct dpfp_fprint *fp)
+{
+	struct ring_slot *slot = (struct ring_slot *) fp;
+
+	pthread_mutex_lock(&ring->lock);
+	slot->refs--;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/* Number of frames reader has lost to DPFP_RING_DROP_OLDEST */
+unsigned long dpfp_ring_get_dropped(struct dpfp_ring *ring, int reader)
+{
+	unsigned long dropped;
+
+	pthread_mutex_lock(&ring->lock);
+	dropped = ring->readers[reader].dropped;
+	pthread_mutex_unlock(&ring->lock);
+
+	return dropped;
+}
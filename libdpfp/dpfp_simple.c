@@ -26,8 +26,10 @@
 #include "dpfp.h"
 #include "dpfp_private.h"
 
-int dpfp_simple_get_irq_with_type(struct dpfp_dev *dev, uint16_t irqtype,
-	unsigned char *irqbuf, int timeout)
+/* dpfp_simple_get_irq_with_type from read position *pos, see
+ * dpfp_get_irq_from */
+int dpfp_get_irq_type_from(struct dpfp_dev *dev, unsigned long *pos,
+	uint16_t irqtype, unsigned char *irqbuf, int timeout)
 {
 	uint16_t hdr;
 	int result;
@@ -38,7 +40,7 @@ int dpfp_simple_get_irq_with_type(struct dpfp_dev *dev, uint16_t irqtype,
 	do {
 		discarded++;
 
-		result = dpfp_get_irq(dev, irqbuf, timeout);
+		result = dpfp_get_irq_from(dev, pos, irqbuf, timeout);
 		if (result < 0) {
 			dbg(DBG_ERR, "get_irq fail");
 			return result;
@@ -46,15 +48,28 @@ int dpfp_simple_get_irq_with_type(struct dpfp_dev *dev, uint16_t irqtype,
 		hdr = be16_to_cpu(*((uint16_t *) irqbuf));
 	} while (hdr != irqtype);
 
-	if (discarded > 0)
+	if (discarded > 0) {
 		dbgf(DBG_INFO, "discarded %d interrupts", discarded);
+		__atomic_add_fetch(&dev->telemetry.discarded_irqs, discarded,
+			__ATOMIC_RELAXED);
+	}
 
 	return 0;
 }
 
+int dpfp_simple_get_irq_with_type(struct dpfp_dev *dev, uint16_t irqtype,
+	unsigned char *irqbuf, int timeout)
+{
+	unsigned long pos = dpfp_irq_position(dev);
+
+	return dpfp_get_irq_type_from(dev, &pos, irqtype, irqbuf, timeout);
+}
+
 static int set_mode_and_get_irq_with_type(struct dpfp_dev *dev,
 	unsigned char mode, uint16_t irqtype, unsigned char *irqbuf)
 {
+	/* the interrupt may arrive before we start waiting for it */
+	unsigned long pos = dpfp_irq_position(dev);
 	int result;
 
 	result = dpfp_set_mode(dev, mode);
@@ -63,7 +78,7 @@ static int set_mode_and_get_irq_with_type(struct dpfp_dev *dev,
 		return result;
 	}
 
-	return dpfp_simple_get_irq_with_type(dev, irqtype, irqbuf, 0);
+	return dpfp_get_irq_type_from(dev, &pos, irqtype, irqbuf, 0);
 }
 
 int dpfp_simple_await_finger_on_irqbuf(struct dpfp_dev *dev,
@@ -98,6 +113,7 @@ int dpfp_simple_auth_cr(struct dpfp_dev *dev)
 	unsigned char challenge[DPFP_AUTH_CR_LENGTH];
 	unsigned char response[DPFP_AUTH_CR_LENGTH];
 
+	TELEMETRY_INC(dev, auth_rounds);
 	r = dpfp_auth_read_challenge(dev, challenge);
 	if (r < 0)
 		return r;
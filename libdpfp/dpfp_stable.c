@@ -0,0 +1,274 @@
+/*
+ * Frame stability detection
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* While a finger is being pressed down, consecutive frames streamed in
+ * DPFP_MODE_SEND_FINGER differ a lot, and enhancing any of them is wasted
+ * effort. This detector compares each frame to the one before and reports
+ * a single frame once the finger has settled.
+ *
+ * The comparison is sampled the same way as in the presence detector: the
+ * image is split into STABLE_BLOCK x STABLE_BLOCK blocks and only every
+ * STABLE_ROW_STEP'th row is looked at, one SSE2 psadbw per block per
+ * sampled row. Only the sampled rows of the previous frame are kept. The
+ * motion of a frame is the mean absolute change per pixel of its most
+ * changed block, so a finger rolling at one edge is not averaged away by
+ * the rest of the sensor. A frame is stable once the motion has stayed
+ * within the threshold for the given number of frames in a row. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define STABLE_BLOCK		16
+#define STABLE_ROW_STEP		4
+#define STABLE_SAMPLES		(STABLE_BLOCK * STABLE_BLOCK / STABLE_ROW_STEP)
+#define STABLE_COLS		(DPFP_IMG_WIDTH / STABLE_BLOCK)
+#define STABLE_ROWS		(DPFP_IMG_HEIGHT / STABLE_BLOCK)
+#define STABLE_LINES		(STABLE_ROWS * STABLE_BLOCK / STABLE_ROW_STEP)
+
+/* mean absolute change per pixel between two frames of a settled finger */
+#define DEFAULT_MOTION		6
+#define DEFAULT_FRAMES		3
+/* ms a finger is given to settle in dpfp_stable_await */
+#define DEFAULT_MAX_WAIT	5000
+
+struct dpfp_stable {
+	/* sampled rows of the previous frame */
+	unsigned char prev[STABLE_LINES * DPFP_IMG_WIDTH];
+	int have_prev;
+	/* threshold on the block sum */
+	unsigned int block_motion;
+	int frames;
+	/* consecutive frames within the threshold */
+	int count;
+	int emitted;
+	unsigned int motion;
+};
+
+struct dpfp_stable *dpfp_stable_alloc(void)
+{
+	struct dpfp_stable *stable;
+
+	stable = malloc(sizeof(*stable));
+	if (stable == NULL)
+		return NULL;
+
+	memset(stable, 0, sizeof(*stable));
+	dpfp_stable_set_threshold(stable, DEFAULT_MOTION, DEFAULT_FRAMES);
+	return stable;
+}
+
+void dpfp_stable_free(struct dpfp_stable *stable)
+{
+	free(stable);
+}
+
+/* motion: mean absolute change per pixel (0-255) of a block between two
+ * frames, above which the finger is still moving. frames: how many frames
+ * in a row must stay within that before one is reported stable. */
+void dpfp_stable_set_threshold(struct dpfp_stable *stable, int motion,
+	int frames)
+{
+	stable->block_motion = motion * STABLE_SAMPLES;
+	stable->frames = frames > 0 ? frames : 1;
+}
+
+/* Start over, e.g. once the finger has been lifted, so that the next
+ * settled finger is reported again */
+void dpfp_stable_reset(struct dpfp_stable *stable)
+{
+	stable->have_prev = 0;
+	stable->count = 0;
+	stable->emitted = 0;
+	stable->motion = 0;
+}
+
+/* Mean absolute change per pixel of the most changed block between the
+ * last two frames fed in */
+int dpfp_stable_get_motion(struct dpfp_stable *stable)
+{
+	return stable->motion / STABLE_SAMPLES;
+}
+
+#ifdef __SSE2__
+/* Add the change of each block on one sampled row to sums, and keep the
+ * row for the next frame */
+static void compare_row(const unsigned char *img, unsigned char *prev,
+	unsigned int *sums)
+{
+	int bx;
+
+	for (bx = 0; bx < STABLE_COLS; bx++) {
+		int off = bx * STABLE_BLOCK;
+		__m128i a = _mm_loadu_si128((const __m128i *) (img + off));
+		__m128i b = _mm_loadu_si128((const __m128i *) (prev + off));
+		__m128i sad = _mm_sad_epu8(a, b);
+
+		sums[bx] += _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+		_mm_storeu_si128((__m128i *) (prev + off), a);
+	}
+}
+#else
+static void compare_row(const unsigned char *img, unsigned char *prev,
+	unsigned int *sums)
+{
+	int bx, x;
+
+	for (bx = 0; bx < STABLE_COLS; bx++) {
+		int off = bx * STABLE_BLOCK;
+		for (x = 0; x < STABLE_BLOCK; x++)
+			sums[bx] += abs(img[off + x] - prev[off + x]);
+	}
+	memcpy(prev, img, STABLE_COLS * STABLE_BLOCK);
+}
+#endif
+
+/* Largest block change between img and the previous frame, which img then
+ * replaces */
+static unsigned int compare(struct dpfp_stable *stable,
+	const unsigned char *img)
+{
+	unsigned int sums[STABLE_COLS];
+	unsigned int max = 0;
+	int by, y, bx;
+	int line = 0;
+
+	for (by = 0; by < STABLE_ROWS; by++) {
+		memset(sums, 0, sizeof(sums));
+		for (y = 0; y < STABLE_BLOCK; y += STABLE_ROW_STEP) {
+			int row = by * STABLE_BLOCK + y;
+			compare_row(img + row * DPFP_IMG_WIDTH,
+				stable->prev + line++ * DPFP_IMG_WIDTH, sums);
+		}
+		for (bx = 0; bx < STABLE_COLS; bx++)
+			if (sums[bx] > max)
+				max = sums[bx];
+	}
+
+	return max;
+}
+
+/* Feed the next frame of a stream. Returns 1 for the frame at which the
+ * finger has settled, and 0 for every other frame until
+ * dpfp_stable_reset. */
+int dpfp_stable_feed(struct dpfp_stable *stable, struct dpfp_fprint *fp)
+{
+	unsigned int motion;
+
+	if (fp->data_size < DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT)
+		return -EINVAL;
+
+	motion = compare(stable, fp->data);
+	if (!stable->have_prev) {
+		stable->have_prev = 1;
+		return 0;
+	}
+
+	stable->motion = motion;
+	if (motion > stable->block_motion) {
+		stable->count = 0;
+		return 0;
+	}
+
+	if (stable->emitted || ++stable->count < stable->frames)
+		return 0;
+
+	stable->emitted = 1;
+	return 1;
+}
+
+/* Capture frames from dev, which must already be in DPFP_MODE_SEND_FINGER,
+ * until a finger has settled on the sensor. That frame is left in fp. With
+ * a presence detector, frames without a finger present restart the count,
+ * so an empty sensor is never reported as stable. timeout is in
+ * milliseconds and applies to each frame; 0 uses the default. max_wait is
+ * in milliseconds and bounds the whole wait, counted from the first frame;
+ * 0 uses the default. Returns -ETIMEDOUT if no frame was stable by then,
+ * with the last frame left in fp. If report is not NULL it receives how the
+ * wait went, including when it timed out. */
+int dpfp_stable_await(struct dpfp_dev *dev, struct dpfp_stable *stable,
+	struct dpfp_presence *presence, struct dpfp_fprint *fp, int timeout,
+	int max_wait, struct dpfp_stable_report *report)
+{
+	double contact = 0;
+	double start = 0;
+	unsigned long frames = 0;
+	int r;
+
+	if (timeout <= 0)
+		timeout = DATA_TIMEOUT;
+	if (max_wait <= 0)
+		max_wait = DEFAULT_MAX_WAIT;
+
+	dpfp_stable_reset(stable);
+	while (1) {
+		r = dpfp_capture_raw(dev, fp, timeout);
+		if (r < 0)
+			return r;
+		frames++;
+		if (start == 0)
+			start = fp->timestamp;
+
+		/* judged on the raw frame, like in dpfp_presence_await */
+		if (presence && !dpfp_presence_detected(presence, fp)) {
+			dpfp_stable_reset(stable);
+			contact = 0;
+		} else {
+			if (contact == 0)
+				contact = fp->timestamp;
+
+			r = dpfp_stable_feed(stable, fp);
+			if (r < 0)
+				return r;
+		}
+
+		if (dev->background)
+			dpfp_background_apply(dev, fp);
+		if (r == 1) {
+			r = 0;
+			break;
+		}
+
+		if ((fp->timestamp - start) * 1000 >= max_wait) {
+			dbgf(DBG_INFO, "no stable frame after %lu frames",
+				frames);
+			r = -ETIMEDOUT;
+			break;
+		}
+	}
+
+	if (report) {
+		report->frames = frames;
+		report->motion = dpfp_stable_get_motion(stable);
+		report->contact_time = contact;
+		report->frame_time = fp->timestamp;
+		report->settle_time = contact ? (fp->timestamp - contact) * 1000
+			: 0;
+	}
+
+	return r;
+}
@@ -0,0 +1,355 @@
+/*
+ * Memory-mapped frame container
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A store is a single file, preallocated for a fixed number of frames when
+ * created and mapped into memory for its whole lifetime:
+ *
+ *   page 0          struct store_hdr
+ *   index           max_frames fixed-size struct store_index entries
+ *   data            max_frames slots of slot_size bytes, page aligned, each
+ *                   holding a raw frame exactly as it came off the bus
+ *
+ * Appending a frame is a copy into the next slot (or, with
+ * dpfp_store_capture, the USB transfer itself lands in the slot) followed by
+ * filling in its index entry and bumping the frame count in the header.
+ * The count is only bumped once the frame is complete, so a reader mapping
+ * the file while it is being written never sees a partial frame.
+ *
+ * Frame n lives at a fixed offset, so random access is O(1), and reading
+ * hands out struct dpfp_fprint views pointing straight into the mapping.
+ * Fields are in host byte order. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define STORE_MAGIC	"DPFPSTO1"
+#define STORE_VERSION	1
+#define STORE_PAGE	4096
+#define STORE_ALIGN(x)	(((x) + STORE_PAGE - 1) & ~((uint64_t) STORE_PAGE - 1))
+#define STORE_FRAME_SIZE	(DATABLK1_RQSIZE + DATABLK2_RQSIZE)
+
+struct store_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t max_frames;
+	/* number of complete frames */
+	uint32_t count;
+	uint64_t index_offset;
+	uint64_t data_offset;
+};
+
+struct store_index {
+	double timestamp;
+	uint64_t seq;
+	uint32_t devid;
+	uint32_t header_size;
+	uint32_t data_size;
+	uint32_t reserved;
+};
+
+struct dpfp_store {
+	int fd;
+	int writable;
+	unsigned char *map;
+	size_t map_size;
+	struct store_hdr *hdr;
+	struct store_index *index;
+};
+
+static unsigned char *slot(struct dpfp_store *store, unsigned int idx)
+{
+	return store->map + store->hdr->data_offset
+		+ (uint64_t) idx * store->hdr->slot_size;
+}
+
+/* Whether a frame described by an index entry fits inside its slot */
+static int entry_valid(struct dpfp_store *store,
+	const struct store_index *entry)
+{
+	return (uint64_t) entry->header_size + entry->data_size
+		<= store->hdr->slot_size;
+}
+
+static struct dpfp_store *store_map(int fd, size_t size, int writable)
+{
+	struct dpfp_store *store;
+
+	store = malloc(sizeof(*store));
+	if (store == NULL)
+		return NULL;
+
+	store->map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE
+		: PROT_READ, MAP_SHARED, fd, 0);
+	if (store->map == MAP_FAILED) {
+		free(store);
+		return NULL;
+	}
+
+	store->fd = fd;
+	store->writable = writable;
+	store->map_size = size;
+	store->hdr = (struct store_hdr *) store->map;
+	return store;
+}
+
+/* Create a store with room for max_frames frames. The whole file is
+ * allocated up front so that appending never has to grow it. */
+struct dpfp_store *dpfp_store_create(const char *filename,
+	unsigned int max_frames)
+{
+	struct dpfp_store *store;
+	uint64_t index_offset, data_offset, size;
+	uint32_t slot_size;
+	int fd;
+	int r;
+
+	if (max_frames == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	slot_size = STORE_ALIGN(STORE_FRAME_SIZE);
+	index_offset = STORE_PAGE;
+	data_offset = STORE_ALIGN(index_offset
+		+ (uint64_t) max_frames * sizeof(struct store_index));
+	size = data_offset + (uint64_t) max_frames * slot_size;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	r = posix_fallocate(fd, 0, size);
+	if (r != 0) {
+		dbgf(DBG_ERR, "could not allocate %llu bytes",
+			(unsigned long long) size);
+		close(fd);
+		errno = r;
+		return NULL;
+	}
+
+	store = store_map(fd, size, 1);
+	if (store == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	memcpy(store->hdr->magic, STORE_MAGIC, sizeof(store->hdr->magic));
+	store->hdr->version = STORE_VERSION;
+	store->hdr->slot_size = slot_size;
+	store->hdr->max_frames = max_frames;
+	store->hdr->count = 0;
+	store->hdr->index_offset = index_offset;
+	store->hdr->data_offset = data_offset;
+	store->index = (struct store_index *) (store->map + index_offset);
+
+	/* slots are written front to back */
+	madvise(store->map + data_offset, size - data_offset, MADV_SEQUENTIAL);
+	return store;
+}
+
+/* Open an existing store for reading. It may still be being written to by
+ * another process; new frames become visible through dpfp_store_get_count.
+ * The file is mapped read-only, so the frames cannot be modified in place
+ * (see dpfp_store_get_frame). */
+struct dpfp_store *dpfp_store_open(const char *filename)
+{
+	struct dpfp_store *store;
+	struct store_hdr *hdr;
+	struct stat st;
+	unsigned int i;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	store = store_map(fd, st.st_size, 0);
+	if (store == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Offsets are checked one at a time against the file size, so that
+	 * none of the sums can overflow. The index must lie between the
+	 * header and the slots, and every published frame in its slot. */
+	hdr = store->hdr;
+	if (memcmp(hdr->magic, STORE_MAGIC, sizeof(hdr->magic)) != 0
+			|| hdr->version != STORE_VERSION
+			|| hdr->slot_size < STORE_FRAME_SIZE
+			|| hdr->count > hdr->max_frames
+			|| hdr->index_offset < sizeof(*hdr)
+			|| hdr->index_offset % sizeof(double) != 0
+			|| hdr->index_offset > st.st_size
+			|| hdr->data_offset > st.st_size
+			|| hdr->data_offset < hdr->index_offset
+			|| hdr->data_offset - hdr->index_offset
+				< (uint64_t) hdr->max_frames
+				* sizeof(struct store_index)
+			|| st.st_size - hdr->data_offset
+				< (uint64_t) hdr->max_frames * hdr->slot_size) {
+		dbg(DBG_ERR, "not a frame store");
+		goto err;
+	}
+
+	store->index = (struct store_index *) (store->map + hdr->index_offset);
+	for (i = 0; i < hdr->count; i++)
+		if (!entry_valid(store, &store->index[i])) {
+			dbgf(DBG_ERR, "frame %u does not fit its slot", i);
+			goto err;
+		}
+
+	return store;
+
+err:
+	dpfp_store_close(store);
+	errno = EINVAL;
+	return NULL;
+}
+
+void dpfp_store_close(struct dpfp_store *store)
+{
+	munmap(store->map, store->map_size);
+	close(store->fd);
+	free(store);
+}
+
+/* Schedule written frames to be flushed to disk without waiting for it */
+int dpfp_store_sync(struct dpfp_store *store)
+{
+	if (msync(store->map, store->map_size, MS_ASYNC) < 0)
+		return -errno;
+	return 0;
+}
+
+static void publish(struct dpfp_store *store, struct dpfp_fprint *fp,
+	uint32_t devid)
+{
+	struct store_index *entry = &store->index[store->hdr->count];
+
+	entry->timestamp = fp->timestamp;
+	entry->seq = fp->seq;
+	entry->devid = devid;
+	entry->header_size = fp->header_size;
+	entry->data_size = fp->data_size;
+
+	/* the frame and its index entry must be visible before the count */
+	__sync_synchronize();
+	store->hdr->count++;
+}
+
+/* Append a copy of fp, tagged with an application-chosen device ID. fp->seq
+ * and fp->timestamp are stored as they are. */
+int dpfp_store_append(struct dpfp_store *store, struct dpfp_fprint *fp,
+	uint32_t devid)
+{
+	if (!store->writable)
+		return -EBADF;
+	if (store->hdr->count == store->hdr->max_frames)
+		return -ENOSPC;
+	if (fp->header_size + fp->data_size > store->hdr->slot_size)
+		return -EINVAL;
+
+	memcpy(slot(store, store->hdr->count), fp->header,
+		fp->header_size + fp->data_size);
+	publish(store, fp, devid);
+	return 0;
+}
+
+/* Capture the next frame from dev straight into the store, without an
+ * intermediate buffer. The frame is numbered with its position in the
+ * store. timeout is in milliseconds. */
+int dpfp_store_capture(struct dpfp_store *store, struct dpfp_dev *dev,
+	uint32_t devid, int timeout)
+{
+	struct dpfp_fprint fp;
+	int r;
+
+	if (!store->writable)
+		return -EBADF;
+	if (store->hdr->count == store->hdr->max_frames)
+		return -ENOSPC;
+
+	memset(&fp, 0, sizeof(fp));
+	fp.header = slot(store, store->hdr->count);
+	fp.data = fp.header + 64;
+
+	r = dpfp_capture_fprint_timeout(dev, &fp, timeout);
+	if (r < 0)
+		return r;
+
+	fp.seq = store->hdr->count;
+	publish(store, &fp, devid);
+	return 0;
+}
+
+unsigned int dpfp_store_get_count(struct dpfp_store *store)
+{
+	unsigned int count = store->hdr->count;
+
+	__sync_synchronize();
+	/* the writer may be another process, so do not trust it blindly */
+	if (count > store->hdr->max_frames)
+		count = store->hdr->max_frames;
+	return count;
+}
+
+/* Point view at frame idx inside the mapping. The view stays valid until the
+ * store is closed and must not be passed to dpfp_fprint_free. devid may be
+ * NULL. For a store opened with dpfp_store_open the view's header and data
+ * are read-only: writing to them, e.g. by enhancing the view in place,
+ * crashes. Copy the frame into a dpfp_fprint_alloc'ed one to process it. */
+int dpfp_store_get_frame(struct dpfp_store *store, unsigned int idx,
+	struct dpfp_fprint *view, uint32_t *devid)
+{
+	struct store_index *entry;
+
+	if (idx >= dpfp_store_get_count(store))
+		return -EINVAL;
+
+	/* frames published after the store was opened were not checked */
+	entry = &store->index[idx];
+	if (!entry_valid(store, entry))
+		return -EINVAL;
+	view->header = slot(store, idx);
+	view->header_size = entry->header_size;
+	view->data = view->header + entry->header_size;
+	view->data_size = entry->data_size;
+	view->seq = entry->seq;
+	view->timestamp = entry->timestamp;
+	if (devid)
+		*devid = entry->devid;
+
+	return 0;
+}
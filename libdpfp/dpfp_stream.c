@@ -0,0 +1,477 @@
+/*
+ * Row-streaming capture
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A frame comes off the bus as two bulk transfers: 0x10000 bytes holding
+ * the header and the first 170 rows, then the remaining 0xb340 bytes.
+ * dpfp_stream_capture issues the second transfer from a helper thread as
+ * soon as the first one completes. It then parses the header and hands the
+ * first rows to the caller while the rest of the frame is still on the bus.
+ *
+ * The preprocessor runs the early enhancement stages on rows as they become
+ * available: base subtraction, rotation to the correct orientation,
+ * softening and the gradient part of the direction field. The rotation puts
+ * the rows of the first transfer at the bottom of the image, so each stage
+ * works its way up from there. A stage only processes rows whose whole
+ * neighbourhood is available from the previous stage. When the frame is
+ * complete, dpfp_prep_finish only has the top of the image and the
+ * direction low-pass filter left to do. The results are the same as
+ * running dpfp_fprint_subtract, dpfp_fprint_flip_v, dpfp_fprint_flip_h,
+ * dpfp_fprint_soften_mean and dpfp_fprint_get_direction on the whole
+ * frame. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define STREAM_PIXELS	(HDR_MAX_LINES * DPFP_IMG_WIDTH)
+
+struct dpfp_stream {
+	struct dpfp_dev *dev;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+
+	/* second block read, owned by the helper thread while pending */
+	int pending;
+	unsigned char *buf;
+	int timeout;
+	int result;
+};
+
+struct dpfp_prep {
+	struct dpfp_fprint *base;
+	int soften_size;
+	int block_size;
+	int filter_size;
+
+	/* frame being processed, its number of rows, and whether base
+	 * matches it and is subtracted */
+	struct dpfp_fprint *fp;
+	int num_rows;
+	int subtract;
+
+	/* stage outputs, in corrected orientation */
+	unsigned char *sub;
+	unsigned char *soft;
+	double *theta;
+
+	/* each stage has finished every row from here to the bottom */
+	int sub_lo;
+	int soft_lo;
+	int dir_lo;
+};
+
+static void *reader_thread(void *arg)
+{
+	struct dpfp_stream *stream = arg;
+	int r;
+
+	pthread_mutex_lock(&stream->lock);
+	while (1) {
+		while (!stream->pending && !stream->stop)
+			pthread_cond_wait(&stream->cond, &stream->lock);
+		if (stream->stop)
+			break;
+
+		pthread_mutex_unlock(&stream->lock);
+		r = dpfp_bulk_read(stream->dev, EP_DATA, stream->buf,
+			DATABLK2_RQSIZE, stream->timeout);
+		pthread_mutex_lock(&stream->lock);
+
+		stream->result = r;
+		stream->pending = 0;
+		pthread_cond_broadcast(&stream->cond);
+	}
+	pthread_mutex_unlock(&stream->lock);
+	return NULL;
+}
+
+static void start_read(struct dpfp_stream *stream, unsigned char *buf,
+	int timeout)
+{
+	pthread_mutex_lock(&stream->lock);
+	stream->buf = buf;
+	stream->timeout = timeout;
+	stream->pending = 1;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+static int finish_read(struct dpfp_stream *stream)
+{
+	int r;
+
+	pthread_mutex_lock(&stream->lock);
+	while (stream->pending)
+		pthread_cond_wait(&stream->cond, &stream->lock);
+	r = stream->result;
+	pthread_mutex_unlock(&stream->lock);
+	return r;
+}
+
+struct dpfp_stream *dpfp_stream_alloc(struct dpfp_dev *dev)
+{
+	struct dpfp_stream *stream;
+	int r;
+
+	stream = malloc(sizeof(*stream));
+	if (stream == NULL)
+		return NULL;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->dev = dev;
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->cond, NULL);
+
+	r = pthread_create(&stream->thread, NULL, reader_thread, stream);
+	if (r != 0) {
+		pthread_cond_destroy(&stream->cond);
+		pthread_mutex_destroy(&stream->lock);
+		free(stream);
+		errno = r;
+		return NULL;
+	}
+
+	return stream;
+}
+
+void dpfp_stream_free(struct dpfp_stream *stream)
+{
+	pthread_mutex_lock(&stream->lock);
+	stream->stop = 1;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+
+	pthread_join(stream->thread, NULL);
+	pthread_cond_destroy(&stream->cond);
+	pthread_mutex_destroy(&stream->lock);
+	free(stream);
+}
+
+/* Capture a frame, calling callback with ranges of completed rows as they
+ * arrive: once with the rows of the first transfer while the second is in
+ * flight, then once more with the rest. A corrupt header fails with
+ * -EPROTO before callback sees any rows. A frame that turns out to be
+ * truncated fails the same way, possibly after the first call.
+ * fp->data_size is set from the header before the first call. The frame is
+ * decrypted if needed but otherwise raw, without the device background
+ * model applied. timeout is in milliseconds and bounds the whole frame;
+ * as with dpfp_capture_raw, a frame which times out once it has started
+ * fails with -EPIPE and the mode must be re-entered. callback may be
+ * NULL. */
+static int stream_capture(struct dpfp_stream *stream, struct dpfp_fprint *fp,
+	int timeout, dpfp_rows_cb callback, void *user_data)
+{
+	struct dpfp_dev *dev = stream->dev;
+	struct dpfp_frame_info info;
+	struct dpfp_decoder dec;
+	int encrypted = dev->flags & DPFP_OPEN_ENCRYPTED;
+	uint64_t start = dpfp_telemetry_now();
+	struct timeval tv;
+	double deadline;
+	int trf1, trf2;
+	int remaining;
+	int rows = 0;
+	int r;
+
+	if (__atomic_load_n(&dev->unplugged, __ATOMIC_RELAXED))
+		return -ENODEV;
+
+	gettimeofday(&tv, NULL);
+	deadline = TV_TO_DOUBLE(tv) + timeout / 1000.0;
+
+	trf1 = dpfp_bulk_read(dev, EP_DATA, fp->header, DATABLK1_RQSIZE,
+		timeout);
+	if (trf1 < 0) {
+		dbg(DBG_ERR, "first read failed");
+		return trf1;
+	}
+
+	gettimeofday(&tv, NULL);
+	remaining = (deadline - TV_TO_DOUBLE(tv)) * 1000;
+	if (remaining <= 0) {
+		dbg(DBG_ERR, "deadline passed mid-frame, lost frame sync");
+		return -EPIPE;
+	}
+
+	/* Get the second block onto the bus before looking at the first. It
+	 * is read even for a bad frame, so the next frame starts in sync. */
+	start_read(stream, fp->header + trf1, remaining);
+
+	fp->header_size = 64;
+	fp->data_size = 0;
+	r = trf1 < 64 ? -EPROTO : dpfp_fprint_get_info(fp, &info);
+	if (r == 0 && encrypted) {
+		/* decrypt what we have so far, which needs the key */
+		r = dpfp_decrypt_start(dev, fp, &dec);
+		if (r == 0)
+			r = dpfp_decrypt_upto(dev, fp, &dec, trf1 - 64);
+	}
+	if (r >= 0) {
+		fp->data_size = info.num_lines * DPFP_IMG_WIDTH;
+		rows = (encrypted ? r : trf1 - 64) / DPFP_IMG_WIDTH;
+		if (rows > info.num_lines)
+			rows = info.num_lines;
+		r = 0;
+
+		/* a short first transfer ends the frame */
+		if (trf1 < DATABLK1_RQSIZE && rows < info.num_lines) {
+			dbgf(DBG_ERR, "truncated frame, %d of %d rows", rows,
+				info.num_lines);
+			r = -EPROTO;
+		} else if (rows > 0 && callback) {
+			callback(fp, 0, rows, user_data);
+		}
+	}
+
+	trf2 = finish_read(stream);
+	if (trf2 == -ETIMEDOUT) {
+		dbg(DBG_ERR, "second read timed out, lost frame sync");
+		return -EPIPE;
+	}
+	if (r < 0)
+		return r;
+	if (trf2 < 0) {
+		dbg(DBG_ERR, "second read failed");
+		return trf2;
+	}
+
+	if (trf1 + trf2 - 64 < fp->data_size) {
+		dbgf(DBG_ERR, "truncated frame, %d of %d bytes",
+			trf1 + trf2 - 64, (int) fp->data_size);
+		return -EPROTO;
+	}
+
+	if (encrypted) {
+		r = dpfp_decrypt_upto(dev, fp, &dec, trf1 + trf2 - 64);
+		if (r < 0)
+			return r;
+	}
+
+	gettimeofday(&tv, NULL);
+	fp->timestamp = TV_TO_DOUBLE(tv);
+	dpfp_telemetry_record(&dev->telemetry.frame, start);
+	TELEMETRY_INC(dev, frames);
+
+	if (rows < info.num_lines && callback)
+		callback(fp, rows, info.num_lines, user_data);
+
+	return 0;
+}
+
+int dpfp_stream_capture(struct dpfp_stream *stream, struct dpfp_fprint *fp,
+	int timeout, dpfp_rows_cb callback, void *user_data)
+{
+	int r;
+
+	dpfp_io_begin(stream->dev);
+	r = stream_capture(stream, fp, timeout, callback, user_data);
+	dpfp_io_end(stream->dev);
+	return r;
+}
+
+/* Create a preprocessor which subtracts base (copied, may be NULL), rotates
+ * to the correct orientation, softens with a soften_size mean filter and
+ * computes the direction field with the given block and filter sizes, as
+ * dpfp_fprint_soften_mean and dpfp_fprint_get_direction would. */
+struct dpfp_prep *dpfp_prep_alloc(struct dpfp_fprint *base, int soften_size,
+	int block_size, int filter_size)
+{
+	struct dpfp_prep *prep;
+
+	if (soften_size < 1 || block_size < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	prep = malloc(sizeof(*prep));
+	if (prep == NULL)
+		return NULL;
+
+	memset(prep, 0, sizeof(*prep));
+	prep->soften_size = soften_size;
+	prep->block_size = block_size;
+	prep->filter_size = filter_size;
+
+	prep->sub = malloc(STREAM_PIXELS);
+	prep->soft = malloc(STREAM_PIXELS);
+	/* orientations, or (Phi_x, Phi_y) pairs for the low-pass filter */
+	prep->theta = calloc(DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT * 2,
+		sizeof(double));
+	if (prep->sub == NULL || prep->soft == NULL || prep->theta == NULL)
+		goto err;
+	if (filter_size > 0)
+		dpfp_direction_vec_clear(prep->theta);
+
+	if (base) {
+		prep->base = dpfp_fprint_alloc();
+		if (prep->base == NULL)
+			goto err;
+		dpfp_prep_set_base(prep, base);
+	}
+
+	return prep;
+
+err:
+	dpfp_prep_free(prep);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void dpfp_prep_free(struct dpfp_prep *prep)
+{
+	if (prep->base)
+		dpfp_fprint_free(prep->base);
+	free(prep->sub);
+	free(prep->soft);
+	free(prep->theta);
+	free(prep);
+}
+
+/* Replace the base image. prep must have been created with one. */
+void dpfp_prep_set_base(struct dpfp_prep *prep, struct dpfp_fprint *base)
+{
+	memcpy(prep->base->header, base->header,
+		base->header_size + base->data_size);
+	prep->base->header_size = base->header_size;
+	prep->base->data_size = base->data_size;
+}
+
+/* Run every stage as far as the rows finished by the stage before allow */
+static void advance(struct dpfp_prep *prep)
+{
+	int ready;
+
+	/* a softened row needs soften_size / 2 rows either side */
+	ready = prep->sub_lo == 0 ? 0 : prep->sub_lo + prep->soften_size / 2;
+	if (ready < prep->soft_lo) {
+		dpfp_soften_rows(prep->sub, prep->soft, prep->soften_size,
+			ready, prep->soft_lo);
+		prep->soft_lo = ready;
+	}
+
+	/* the block centered on a row reaches block_size + 1 rows up */
+	ready = prep->soft_lo == 0 ? 0 : prep->soft_lo + prep->block_size + 1;
+	if (ready < prep->dir_lo) {
+		if (prep->filter_size > 0)
+			dpfp_direction_vec_rows(prep->soft, prep->theta,
+				prep->block_size, ready, prep->dir_lo);
+		else
+			dpfp_direction_rows(prep->soft, prep->theta, 0.5,
+				prep->block_size, ready, prep->dir_lo);
+		prep->dir_lo = ready;
+	}
+}
+
+/* Process rows [first, last) of fp. This is a dpfp_rows_cb taking the
+ * preprocessor as user data, so it can be passed straight to
+ * dpfp_stream_capture. A range starting at row 0 begins a new frame, and
+ * the ranges of a frame must follow on from each other. */
+void dpfp_prep_rows(struct dpfp_fprint *fp, int first, int last,
+	void *user_data)
+{
+	struct dpfp_prep *prep = user_data;
+	struct dpfp_fprint *base = prep->base;
+	int num_rows;
+	int x, y;
+
+	if (first == 0) {
+		prep->fp = fp;
+		/* as dpfp_fprint_subtract, a base of another size is not
+		 * used at all */
+		prep->subtract = base && base->data_size == fp->data_size;
+		if (base && !prep->subtract)
+			dbgf(DBG_ERR, "frame size %zu does not match base size "
+				"%zu", fp->data_size, base->data_size);
+		prep->num_rows = fp->data_size / DPFP_IMG_WIDTH;
+		if (prep->num_rows > HDR_MAX_LINES)
+			prep->num_rows = HDR_MAX_LINES;
+		/* rows the sensor did not send read as empty */
+		if (prep->num_rows < DPFP_IMG_HEIGHT)
+			memset(prep->sub + prep->num_rows * DPFP_IMG_WIDTH, 0,
+				(DPFP_IMG_HEIGHT - prep->num_rows)
+				* DPFP_IMG_WIDTH);
+		prep->sub_lo = prep->num_rows;
+		prep->soft_lo = DPFP_IMG_HEIGHT;
+		prep->dir_lo = DPFP_IMG_HEIGHT - prep->block_size - 1;
+	}
+
+	num_rows = prep->num_rows;
+	if (last > num_rows)
+		last = num_rows;
+
+	for (y = first; y < last; y++) {
+		unsigned char *src = fp->data + y * DPFP_IMG_WIDTH;
+		unsigned char *dst = prep->sub
+			+ (num_rows - y - 1) * DPFP_IMG_WIDTH;
+		unsigned char *b = NULL;
+
+		if (prep->subtract)
+			b = base->data + y * DPFP_IMG_WIDTH;
+
+		for (x = 0; x < DPFP_IMG_WIDTH; x++) {
+			int p = src[x];
+			if (b) {
+				p -= b[x];
+				if (p < 0)
+					p = -p;
+			}
+			dst[DPFP_IMG_WIDTH - x - 1] = p;
+		}
+	}
+
+	if (last > first)
+		prep->sub_lo = num_rows - last;
+	advance(prep);
+}
+
+/* Complete processing of the last frame once all of its rows have been
+ * through dpfp_prep_rows. The softened image is stored in out and the
+ * direction field in direction. */
+int dpfp_prep_finish(struct dpfp_prep *prep, struct dpfp_fprint *out,
+	struct dpfp_ffield *direction)
+{
+	struct dpfp_fprint *fp = prep->fp;
+	int size = DPFP_IMG_WIDTH * DPFP_IMG_HEIGHT;
+
+	if (fp == NULL || prep->sub_lo != 0)
+		return -EINVAL;
+
+	memcpy(out->header, fp->header, fp->header_size);
+	out->header_size = fp->header_size;
+	out->data_size = prep->num_rows * DPFP_IMG_WIDTH;
+	out->seq = fp->seq;
+	out->timestamp = fp->timestamp;
+
+	memcpy(out->data, prep->soft, size);
+
+	if (prep->filter_size > 0)
+		return dpfp_direction_low_pass(prep->theta, direction->pimg,
+			prep->filter_size);
+
+	memcpy(direction->pimg, prep->theta, size * sizeof(double));
+	return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Device telemetry
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Every device counts what happens on its endpoints and how long the
+ * transfers take. All fields are 64-bit counters which are only ever
+ * updated with relaxed atomic operations, from whichever thread did the
+ * I/O, so neither recording nor reading takes a lock.
+ *
+ * Latencies go into log-linear histograms in microseconds, in the style of
+ * HdrHistogram: values below 2^DPFP_HIST_SUB_BITS have a bucket each, and
+ * every power of two above that is split into 2^DPFP_HIST_SUB_BITS linear
+ * buckets. A bucket is never wider than 1/16 of the values it holds, so
+ * percentiles are good to about 6% from microseconds up to a minute. */
+
+#include <errno.h>
+#include <sys/time.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define HIST_SUB	(1 << DPFP_HIST_SUB_BITS)
+
+uint64_t dpfp_telemetry_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int bucket_of(uint64_t value)
+{
+	int exp;
+	int idx;
+
+	if (value < HIST_SUB)
+		return value;
+
+	exp = 63 - __builtin_clzll(value);
+	idx = (exp - DPFP_HIST_SUB_BITS + 1) * HIST_SUB
+		+ ((value >> (exp - DPFP_HIST_SUB_BITS)) & (HIST_SUB - 1));
+	return idx < DPFP_HIST_BUCKETS ? idx : DPFP_HIST_BUCKETS - 1;
+}
+
+/* Largest value that falls into a bucket */
+static uint64_t bucket_limit(int idx)
+{
+	int exp;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	exp = idx / HIST_SUB + DPFP_HIST_SUB_BITS - 1;
+	return ((uint64_t) (HIST_SUB + idx % HIST_SUB + 1)
+		<< (exp - DPFP_HIST_SUB_BITS)) - 1;
+}
+
+/* Record the time since start, as returned by dpfp_telemetry_now */
+void dpfp_telemetry_record(struct dpfp_histogram *hist, uint64_t start)
+{
+	uint64_t now = dpfp_telemetry_now();
+	uint64_t value = now > start ? now - start : 0;
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&hist->buckets[bucket_of(value)], 1,
+		__ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&hist->max, &max,
+			value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Count the result of a transfer on the interrupt endpoint */
+void dpfp_telemetry_irq(struct dpfp_dev *dev, const unsigned char *buf,
+	int r)
+{
+	struct dpfp_telemetry *tm = &dev->telemetry;
+	uint64_t *counter;
+
+	if (r == -ETIMEDOUT)
+		counter = &tm->irq_timeouts;
+	else if (r < 2)
+		counter = &tm->errors;
+	else switch (buf[0] << 8 | buf[1]) {
+	case DPFP_IRQDATA_SCANPWR_ON:
+		counter = &tm->irqs[DPFP_TM_IRQ_SCANPWR_ON];
+		break;
+	case DPFP_IRQDATA_FINGER_ON:
+		counter = &tm->irqs[DPFP_TM_IRQ_FINGER_ON];
+		break;
+	case DPFP_IRQDATA_FINGER_OFF:
+		counter = &tm->irqs[DPFP_TM_IRQ_FINGER_OFF];
+		break;
+	default:
+		counter = &tm->irqs[DPFP_TM_IRQ_OTHER];
+		break;
+	}
+
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Take a snapshot of the telemetry of dev. This never blocks the threads
+ * doing I/O. Each counter is read atomically, but I/O completing during
+ * the copy may show up in some counters and not yet in others. */
+void dpfp_get_telemetry(struct dpfp_dev *dev, struct dpfp_telemetry *tm)
+{
+	const uint64_t *src = (const uint64_t *) &dev->telemetry;
+	uint64_t *dst = (uint64_t *) tm;
+	size_t i;
+
+	for (i = 0; i < sizeof(*tm) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+/* Latency in microseconds below which a fraction (0-1) of the recorded
+ * values fall, rounded up to the end of its bucket */
+uint64_t dpfp_histogram_percentile(const struct dpfp_histogram *hist,
+	double fraction)
+{
+	uint64_t seen = 0;
+	uint64_t target;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	target = fraction * hist->count;
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < DPFP_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	if (i == DPFP_HIST_BUCKETS)
+		return hist->max;
+	return bucket_limit(i) < hist->max ? bucket_limit(i) : hist->max;
+}
@@ -0,0 +1,592 @@
+/*
+ * Device I/O transports: USB, session recording and replay
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* All device I/O goes through dpfp_control_msg, dpfp_bulk_read and
+ * dpfp_interrupt_read, which dispatch to the transport of the device:
+ *
+ *  - usb: straight to libusb
+ *  - record: to libusb, additionally logging every transaction with its
+ *    start time, duration, parameters, result and data to a session file
+ *  - replay: serves a recorded session back without any hardware, either
+ *    on the recorded timeline or at full speed
+ *
+ * A session file is a struct rec_file_hdr followed by transaction records,
+ * each a struct rec_hdr followed by the transferred data (the bytes read
+ * for IN transfers, the bytes sent for OUT transfers) padded to a multiple
+ * of 8 bytes. Fields are in host byte order; sessions are meant to be
+ * replayed on the kind of machine that recorded them.
+ *
+ * The interrupt endpoint is often read from a different thread than the
+ * data endpoint, so replay keeps one cursor per transaction kind rather
+ * than insisting on the recorded interleaving. Control transfers are
+ * matched on their setup fields, so a replaying client which skips a
+ * request (e.g. a warm open) stays in sync. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define REC_MAGIC	"DPFPREC1"
+#define REC_ALIGN	8
+#define REC_PADDED(len)	(((len) + REC_ALIGN - 1) & ~(REC_ALIGN - 1))
+
+enum {
+	REC_CONTROL = 'C',
+	REC_BULK = 'B',
+	REC_INTERRUPT = 'I',
+};
+
+struct rec_file_hdr {
+	char magic[8];
+	uint16_t vid;
+	uint16_t pid;
+	uint32_t reserved;
+};
+
+struct rec_hdr {
+	uint8_t kind;
+	uint8_t requesttype;
+	uint8_t request;
+	uint8_t ep;
+	uint16_t value;
+	uint16_t index;
+	int32_t size;
+	int32_t result;
+	/* seconds since the session started, and seconds taken */
+	double start;
+	double duration;
+};
+
+/* Number of data bytes following a record */
+static int rec_data_len(const struct rec_hdr *hdr)
+{
+	if (hdr->kind == REC_CONTROL && !(hdr->requesttype & 0x80))
+		return hdr->size;
+	return hdr->result > 0 ? hdr->result : 0;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return TV_TO_DOUBLE(tv);
+}
+
+/* USB */
+
+static int usb_control(struct dpfp_dev *dev, int requesttype, int request,
+	int value, int index, unsigned char *buf, int size, int timeout)
+{
+	return usb_control_msg(dev->handle, requesttype, request, value, index,
+		(char *) buf, size, timeout);
+}
+
+static int usb_bulk(struct dpfp_dev *dev, int ep, unsigned char *buf,
+	int size, int timeout)
+{
+	return usb_bulk_read(dev->handle, ep, (char *) buf, size, timeout);
+}
+
+static int usb_interrupt(struct dpfp_dev *dev, int ep, unsigned char *buf,
+	int size, int timeout)
+{
+	return usb_interrupt_read(dev->handle, ep, (char *) buf, size, timeout);
+}
+
+static int usb_transport_close(struct dpfp_dev *dev)
+{
+	return usb_close(dev->handle);
+}
+
+const struct dpfp_transport_ops dpfp_usb_transport = {
+	.control = usb_control,
+	.bulk_read = usb_bulk,
+	.interrupt_read = usb_interrupt,
+	.close = usb_transport_close,
+};
+
+/* Recording */
+
+struct recorder {
+	FILE *file;
+	double start;
+	pthread_mutex_t lock;
+};
+
+static void record(struct dpfp_dev *dev, struct rec_hdr *hdr,
+	const unsigned char *data, double start)
+{
+	static const unsigned char pad[REC_ALIGN];
+	struct recorder *rec = dev->transport;
+	double end = now();
+	int len = rec_data_len(hdr);
+
+	hdr->start = start - rec->start;
+	hdr->duration = end - start;
+
+	pthread_mutex_lock(&rec->lock);
+	if (fwrite(hdr, sizeof(*hdr), 1, rec->file) != 1
+			|| fwrite(data, 1, len, rec->file) != (size_t) len
+			|| fwrite(pad, 1, REC_PADDED(len) - len, rec->file)
+				!= (size_t) (REC_PADDED(len) - len))
+		dbg(DBG_ERR, "session record write failed");
+	pthread_mutex_unlock(&rec->lock);
+}
+
+static int record_control(struct dpfp_dev *dev, int requesttype, int request,
+	int value, int index, unsigned char *buf, int size, int timeout)
+{
+	struct rec_hdr hdr;
+	double start = now();
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.result = usb_control(dev, requesttype, request, value, index, buf,
+		size, timeout);
+	hdr.kind = REC_CONTROL;
+	hdr.requesttype = requesttype;
+	hdr.request = request;
+	hdr.value = value;
+	hdr.index = index;
+	hdr.size = size;
+	record(dev, &hdr, buf, start);
+
+	return hdr.result;
+}
+
+static int record_bulk(struct dpfp_dev *dev, int ep, unsigned char *buf,
+	int size, int timeout)
+{
+	struct rec_hdr hdr;
+	double start = now();
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.result = usb_bulk(dev, ep, buf, size, timeout);
+	hdr.kind = REC_BULK;
+	hdr.ep = ep;
+	hdr.size = size;
+	record(dev, &hdr, buf, start);
+
+	return hdr.result;
+}
+
+static int record_interrupt(struct dpfp_dev *dev, int ep, unsigned char *buf,
+	int size, int timeout)
+{
+	struct rec_hdr hdr;
+	double start = now();
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.result = usb_interrupt(dev, ep, buf, size, timeout);
+	hdr.kind = REC_INTERRUPT;
+	hdr.ep = ep;
+	hdr.size = size;
+	record(dev, &hdr, buf, start);
+
+	return hdr.result;
+}
+
+static int record_close(struct dpfp_dev *dev)
+{
+	struct recorder *rec = dev->transport;
+
+	fclose(rec->file);
+	pthread_mutex_destroy(&rec->lock);
+	free(rec);
+	return usb_transport_close(dev);
+}
+
+static const struct dpfp_transport_ops record_transport = {
+	.control = record_control,
+	.bulk_read = record_bulk,
+	.interrupt_read = record_interrupt,
+	.close = record_close,
+};
+
+/* Switch a freshly opened USB device to the recording transport */
+int dpfp_transport_record(struct dpfp_dev *dev, const char *filename)
+{
+	struct rec_file_hdr fhdr;
+	struct recorder *rec;
+
+	rec = malloc(sizeof(*rec));
+	if (rec == NULL)
+		return -ENOMEM;
+
+	rec->file = fopen(filename, "wb");
+	if (rec->file == NULL) {
+		free(rec);
+		return -errno;
+	}
+
+	memset(&fhdr, 0, sizeof(fhdr));
+	memcpy(fhdr.magic, REC_MAGIC, sizeof(fhdr.magic));
+	fhdr.vid = dev->dev_entry->vid;
+	fhdr.pid = dev->dev_entry->pid;
+	if (fwrite(&fhdr, sizeof(fhdr), 1, rec->file) != 1) {
+		fclose(rec->file);
+		free(rec);
+		return -EIO;
+	}
+
+	rec->start = now();
+	pthread_mutex_init(&rec->lock, NULL);
+	dev->transport = rec;
+	dev->ops = &record_transport;
+	return 0;
+}
+
+/* Replay */
+
+struct replay_rec {
+	const struct rec_hdr *hdr;
+	const unsigned char *data;
+};
+
+struct replayer {
+	unsigned char *log;
+	struct replay_rec *recs;
+	int num_recs;
+	enum dpfp_replay_speed speed;
+	/* when replay started, matching the start of the recording */
+	double start;
+
+	/* next record to consider, per kind */
+	int next_control;
+	int next_bulk;
+	int next_interrupt;
+	pthread_mutex_t lock;
+};
+
+/* In realtime mode, hold a transaction back until the point in the session
+ * at which it originally completed. A client running behind the recording
+ * is not made to wait at all. */
+static void replay_wait(struct replayer *rp, const struct rec_hdr *hdr)
+{
+	double delay;
+
+	if (rp->speed != DPFP_REPLAY_REALTIME)
+		return;
+
+	delay = rp->start + hdr->start + hdr->duration - now();
+	if (delay > 0)
+		usleep(delay * 1000000);
+}
+
+/* Find the next record of a kind from *cursor onwards (for control
+ * transfers, with the same setup fields) and advance the cursor past it.
+ * Called with the lock held. */
+static const struct replay_rec *replay_next(struct replayer *rp, int *cursor,
+	int kind, int requesttype, int request, int value, int index)
+{
+	int i;
+
+	for (i = *cursor; i < rp->num_recs; i++) {
+		const struct rec_hdr *hdr = rp->recs[i].hdr;
+
+		if (hdr->kind != kind)
+			continue;
+		if (kind == REC_CONTROL && (hdr->requesttype != requesttype
+				|| hdr->request != request || hdr->value != value
+				|| hdr->index != index))
+			continue;
+
+		*cursor = i + 1;
+		return &rp->recs[i];
+	}
+
+	return NULL;
+}
+
+/* Copy a recorded IN transfer into the caller's buffer */
+static int replay_serve(struct replayer *rp, const struct replay_rec *rec,
+	unsigned char *buf, int size)
+{
+	int r = rec->hdr->result;
+
+	if (r > 0 && r > size) {
+		dbgf(DBG_WARN, "recorded %d bytes, buffer holds %d", r, size);
+		r = size;
+	}
+	if (r > 0)
+		memcpy(buf, rec->data, r);
+
+	replay_wait(rp, rec->hdr);
+	return r;
+}
+
+static int replay_control(struct dpfp_dev *dev, int requesttype, int request,
+	int value, int index, unsigned char *buf, int size, int timeout)
+{
+	struct replayer *rp = dev->transport;
+	const struct replay_rec *rec;
+
+	/* replies are paced by replay_wait, not by the timeout */
+	(void) timeout;
+
+	pthread_mutex_lock(&rp->lock);
+	rec = replay_next(rp, &rp->next_control, REC_CONTROL, requesttype,
+		request, value, index);
+	pthread_mutex_unlock(&rp->lock);
+
+	if (rec == NULL) {
+		dbgf(DBG_ERR, "no recorded control %02x/%02x/%04x",
+			requesttype, request, value);
+		return -EIO;
+	}
+
+	if (!(requesttype & 0x80)) {
+		replay_wait(rp, rec->hdr);
+		return rec->hdr->result;
+	}
+	return replay_serve(rp, rec, buf, size);
+}
+
+static int replay_bulk(struct dpfp_dev *dev, int ep, unsigned char *buf,
+	int size, int timeout)
+{
+	struct replayer *rp = dev->transport;
+	const struct replay_rec *rec;
+
+	/* the device only has one bulk endpoint */
+	(void) ep;
+	(void) timeout;
+
+	pthread_mutex_lock(&rp->lock);
+	rec = replay_next(rp, &rp->next_bulk, REC_BULK, 0, 0, 0, 0);
+	pthread_mutex_unlock(&rp->lock);
+
+	/* end of the session: the device is gone */
+	if (rec == NULL)
+		return -ENODEV;
+
+	return replay_serve(rp, rec, buf, size);
+}
+
+static int replay_interrupt(struct dpfp_dev *dev, int ep, unsigned char *buf,
+	int size, int timeout)
+{
+	struct replayer *rp = dev->transport;
+	const struct replay_rec *rec;
+
+	(void) ep;
+
+	pthread_mutex_lock(&rp->lock);
+	rec = replay_next(rp, &rp->next_interrupt, REC_INTERRUPT, 0, 0, 0, 0);
+	pthread_mutex_unlock(&rp->lock);
+
+	/* end of the session: nothing more happens */
+	if (rec == NULL) {
+		usleep((timeout > 0 ? timeout : 1000) * 1000);
+		return -ETIMEDOUT;
+	}
+
+	return replay_serve(rp, rec, buf, size);
+}
+
+static int replay_close(struct dpfp_dev *dev)
+{
+	struct replayer *rp = dev->transport;
+
+	pthread_mutex_destroy(&rp->lock);
+	free(rp->recs);
+	free(rp->log);
+	free(rp);
+	return 0;
+}
+
+static const struct dpfp_transport_ops replay_transport = {
+	.control = replay_control,
+	.bulk_read = replay_bulk,
+	.interrupt_read = replay_interrupt,
+	.close = replay_close,
+};
+
+/* Load a recorded session and attach it to dev as its transport. The vendor
+ * and product IDs of the recorded device are returned so that the caller
+ * can identify the device type. */
+int dpfp_transport_replay(struct dpfp_dev *dev, const char *filename,
+	enum dpfp_replay_speed speed, uint16_t *vid, uint16_t *pid)
+{
+	struct rec_file_hdr *fhdr;
+	struct replayer *rp;
+	FILE *file;
+	long len, pos;
+	int r = -EINVAL;
+
+	rp = malloc(sizeof(*rp));
+	if (rp == NULL)
+		return -ENOMEM;
+	memset(rp, 0, sizeof(*rp));
+	rp->speed = speed;
+
+	file = fopen(filename, "rb");
+	if (file == NULL) {
+		free(rp);
+		return -errno;
+	}
+
+	if (fseek(file, 0, SEEK_END) < 0 || (len = ftell(file)) < 0) {
+		r = -errno;
+		goto err;
+	}
+	rewind(file);
+
+	rp->log = malloc(len);
+	if (rp->log == NULL || fread(rp->log, 1, len, file) != (size_t) len) {
+		r = rp->log ? -EIO : -ENOMEM;
+		goto err;
+	}
+
+	fhdr = (struct rec_file_hdr *) rp->log;
+	if (len < (long) sizeof(*fhdr) || memcmp(fhdr->magic, REC_MAGIC,
+			sizeof(fhdr->magic)) != 0) {
+		dbg(DBG_ERR, "not a session recording");
+		goto err;
+	}
+
+	/* index the records */
+	for (pos = sizeof(*fhdr); pos + (long) sizeof(struct rec_hdr) <= len; ) {
+		const struct rec_hdr *hdr = (struct rec_hdr *) (rp->log + pos);
+		long data_len = rec_data_len(hdr);
+
+		if (data_len < 0) {
+			dbgf(DBG_ERR, "corrupt record at offset %ld", pos);
+			goto err;
+		}
+
+		/* what a recording cut short by a crash ends with */
+		data_len = REC_PADDED(data_len);
+		if (data_len > len - pos - (long) sizeof(*hdr)) {
+			dbgf(DBG_WARN, "ignoring truncated record at offset %ld",
+				pos);
+			break;
+		}
+
+		if (rp->num_recs % 256 == 0) {
+			struct replay_rec *recs = realloc(rp->recs,
+				(rp->num_recs + 256) * sizeof(*recs));
+			if (recs == NULL) {
+				r = -ENOMEM;
+				goto err;
+			}
+			rp->recs = recs;
+		}
+
+		rp->recs[rp->num_recs].hdr = hdr;
+		rp->recs[rp->num_recs].data = (unsigned char *) (hdr + 1);
+		rp->num_recs++;
+		pos += sizeof(*hdr) + data_len;
+	}
+	fclose(file);
+
+	dbgf(DBG_INFO, "replaying %d transactions", rp->num_recs);
+	rp->start = now();
+	*vid = fhdr->vid;
+	*pid = fhdr->pid;
+	pthread_mutex_init(&rp->lock, NULL);
+	dev->transport = rp;
+	dev->ops = &replay_transport;
+	return 0;
+
+err:
+	fclose(file);
+	free(rp->recs);
+	free(rp->log);
+	free(rp);
+	return r;
+}
+
+/* A timeout only counts towards a stall when the device had at least the
+ * library's own timeout for that kind of transfer to answer in; callers
+ * which choose a shorter one (to poll, or to bound a frame) expect to see
+ * timeouts from a healthy device. */
+static void count_result(struct dpfp_dev *dev, int r, int full_timeout)
+{
+	if (r == -ETIMEDOUT)
+		TELEMETRY_INC(dev, timeouts);
+	else if (r < 0)
+		TELEMETRY_INC(dev, errors);
+
+	if (r == -ETIMEDOUT && !full_timeout)
+		return;
+	if (r < 0)
+		__atomic_add_fetch(&dev->stalls, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&dev->stalls, 0, __ATOMIC_RELAXED);
+}
+
+int dpfp_control_msg(struct dpfp_dev *dev, int requesttype, int request,
+	int value, int index, unsigned char *buf, int size, int timeout)
+{
+	uint64_t start = dpfp_telemetry_now();
+	int r;
+
+	r = dev->ops->control(dev, requesttype, request, value, index, buf,
+		size, timeout);
+	dpfp_telemetry_record(&dev->telemetry.control, start);
+	count_result(dev, r, timeout >= CTRL_TIMEOUT);
+	return r;
+}
+
+int dpfp_bulk_read(struct dpfp_dev *dev, int ep, unsigned char *buf, int size,
+	int timeout)
+{
+	uint64_t start = dpfp_telemetry_now();
+	int r;
+
+	r = dev->ops->bulk_read(dev, ep, buf, size, timeout);
+	dpfp_telemetry_record(&dev->telemetry.bulk, start);
+	count_result(dev, r, timeout >= DATA_TIMEOUT);
+	return r;
+}
+
+/* Not timed: an interrupt read lasts until something happens. Nor is a
+ * timeout a stall: most interrupts wait for a finger, and the listener
+ * re-arms with a timeout on an idle reader. Waits for an
+ * interrupt the device owes us count their own timeouts, see
+ * dpfp_irq_missed. */
+int dpfp_interrupt_read(struct dpfp_dev *dev, int ep, unsigned char *buf,
+	int size, int timeout)
+{
+	int r;
+
+	r = dev->ops->interrupt_read(dev, ep, buf, size, timeout);
+	dpfp_telemetry_irq(dev, buf, r);
+
+	if (r >= 0)
+		__atomic_store_n(&dev->irq_stalls, 0, __ATOMIC_RELAXED);
+	else if (r != -ETIMEDOUT)
+		__atomic_add_fetch(&dev->stalls, 1, __ATOMIC_RELAXED);
+	return r;
+}
+
+/* An interrupt which the device always sends in response to something we
+ * did failed to arrive in time */
+void dpfp_irq_missed(struct dpfp_dev *dev)
+{
+	__atomic_add_fetch(&dev->irq_stalls, 1, __ATOMIC_RELAXED);
+}
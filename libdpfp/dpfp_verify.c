@@ -0,0 +1,408 @@
+/*
+ * Continuous verification sessions
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A verify session runs the whole touch / capture / lift cycle for a reader
+ * and keeps the sensor in the mode it will need next:
+ *
+ *   AWAIT_FINGER_ON   armed up front; on the interrupt:
+ *   SEND_FINGER       one frame, the base image comes from the background
+ *                     model, so no second frame is needed
+ *   AWAIT_FINGER_OFF  armed as soon as the frame is handed over for
+ *                     processing, so lift detection and processing overlap
+ *   AWAIT_FINGER_ON   re-armed as soon as the finger lifts, unless the
+ *                     background model is stale and takes one empty frame
+ *                     first
+ *
+ * The device thread drives the sensor and a processing thread enhances the
+ * frame, extracts minutiae and matches them against the templates. Every
+ * step of a transaction is timestamped. The decision is reported as soon
+ * as it is made, and the complete timeline once the finger has lifted. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+/* seconds; how long the device thread may take to notice a stop */
+#define VERIFY_POLL	1
+
+struct dpfp_verify {
+	struct dpfp_dev *dev;
+	struct dpfp_mset *templates;
+	int num_templates;
+	float threshold;
+	dpfp_verify_cb callback;
+	void *user_data;
+	/* the session enabled the background model and disables it again,
+	 * or else puts back the flags the application had set */
+	int own_background;
+	int saved_flags;
+
+	pthread_t device_thread;
+	pthread_t process_thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+
+	/* transaction in progress; busy while the frame is being processed */
+	int busy;
+	struct dpfp_fprint *fp;
+	struct dpfp_verify_result result;
+
+	/* processing scratch */
+	struct dpfp_fprint *mask;
+	struct dpfp_ffield *direction;
+	struct dpfp_ffield *frequency;
+	struct dpfp_mset *mset;
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return TV_TO_DOUBLE(tv);
+}
+
+static int stopped(struct dpfp_verify *v)
+{
+	int stop;
+
+	pthread_mutex_lock(&v->lock);
+	stop = v->stop;
+	pthread_mutex_unlock(&v->lock);
+	return stop;
+}
+
+static void report_error(struct dpfp_verify *v, int status)
+{
+	struct dpfp_verify_result result;
+
+	memset(&result, 0, sizeof(result));
+	result.status = status;
+	v->callback(v, DPFP_VERIFY_ERROR, &result, v->user_data);
+}
+
+/* Wait for an interrupt of the given type from read position *pos on,
+ * giving up if the session is stopped */
+static int await_irq(struct dpfp_verify *v, unsigned long *pos, uint16_t type)
+{
+	unsigned char irqbuf[DPFP_IRQ_LENGTH];
+	int r;
+
+	while (!stopped(v)) {
+		r = dpfp_get_irq_type_from(v->dev, pos, type, irqbuf,
+			VERIFY_POLL);
+		if (r != -ETIMEDOUT)
+			return r;
+	}
+
+	return -ECANCELED;
+}
+
+static int background_valid(struct dpfp_dev *dev)
+{
+	struct dpfp_background_stats stats;
+
+	dpfp_background_get_stats(dev, &stats);
+	return stats.valid;
+}
+
+/* One touch, from arming for it to the finger lifting */
+static int transaction(struct dpfp_verify *v, unsigned long seq)
+{
+	struct dpfp_dev *dev = v->dev;
+	struct dpfp_verify_result result;
+	unsigned long pos;
+	double touch;
+	double lift;
+	int r;
+
+	/* Seeding or refreshing the base needs an empty sensor, which it is
+	 * right after a lift. A finger already on the sensor is not an
+	 * error; the model catches up next time round. */
+	r = dpfp_background_refresh(dev, 0);
+	if (r < 0 && r != -EAGAIN)
+		return r;
+
+	pos = dpfp_irq_position(dev);
+	r = dpfp_set_mode(dev, DPFP_MODE_AWAIT_FINGER_ON);
+	if (r < 0)
+		return r;
+
+	r = await_irq(v, &pos, DPFP_IRQDATA_FINGER_ON);
+	if (r < 0)
+		return r;
+	touch = now();
+
+	r = dpfp_set_mode(dev, DPFP_MODE_SEND_FINGER);
+	if (r < 0)
+		return r;
+
+	/* Without a base the frame would be matched unsubtracted. That
+	 * touch is skipped; the model is seeded again after the lift. */
+	if (!background_valid(dev))
+		r = -EAGAIN;
+	else
+		r = dpfp_capture_fprint(dev, v->fp);
+	if (r < 0) {
+		report_error(v, r);
+	} else {
+		pthread_mutex_lock(&v->lock);
+		memset(&v->result, 0, sizeof(v->result));
+		v->result.seq = seq;
+		v->result.timeline.touch = touch;
+		v->result.timeline.first_frame = v->fp->timestamp;
+		v->busy = 1;
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	/* processing is under way, get ready for the lift meanwhile */
+	pos = dpfp_irq_position(dev);
+	r = dpfp_set_mode(dev, DPFP_MODE_AWAIT_FINGER_OFF);
+	if (r < 0)
+		return r;
+
+	r = await_irq(v, &pos, DPFP_IRQDATA_FINGER_OFF);
+	if (r < 0)
+		return r;
+	lift = now();
+
+	/* the decision is always reported before the lift */
+	pthread_mutex_lock(&v->lock);
+	while (v->busy)
+		pthread_cond_wait(&v->cond, &v->lock);
+	v->result.timeline.lift = lift;
+	result = v->result;
+	pthread_mutex_unlock(&v->lock);
+
+	if (result.seq == seq)
+		v->callback(v, DPFP_VERIFY_LIFT, &result, v->user_data);
+	return 0;
+}
+
+static void *device_thread(void *arg)
+{
+	struct dpfp_verify *v = arg;
+	unsigned long seq = 0;
+	int r;
+
+	while (!stopped(v)) {
+		r = transaction(v, ++seq);
+		if (r == -ECANCELED)
+			break;
+		if (r < 0) {
+			/* the sensor has stopped responding to commands */
+			report_error(v, r);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void *process_thread(void *arg)
+{
+	struct dpfp_verify *v = arg;
+	struct dpfp_verify_result result;
+	struct dpfp_mset *mset;
+	double enhanced;
+	double minutiae;
+	float best = 0;
+	int best_idx = -1;
+	int busy;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&v->lock);
+		while (!v->busy && !v->stop)
+			pthread_cond_wait(&v->cond, &v->lock);
+		busy = v->busy;
+		pthread_mutex_unlock(&v->lock);
+		if (!busy)
+			break;
+
+		/* the background model already removed the base image */
+		v->mset->count = 0;
+		mset = dpfp_process_frame(v->fp, NULL, v->mask, v->direction,
+			v->frequency, v->mset, &enhanced);
+		minutiae = now();
+
+		best = 0;
+		best_idx = -1;
+		for (i = 0; mset && i < v->num_templates; i++) {
+			float score = dpfp_fprint_mset_match1(mset,
+				&v->templates[i]);
+			if (best_idx < 0 || score > best) {
+				best = score;
+				best_idx = i;
+			}
+		}
+
+		pthread_mutex_lock(&v->lock);
+		v->result.timeline.enhanced = enhanced;
+		v->result.timeline.minutiae = minutiae;
+		v->result.timeline.decision = now();
+		v->result.score = best;
+		v->result.index = best_idx;
+		v->result.match = best_idx >= 0 && best >= v->threshold;
+		v->result.status = mset ? 0 : -ENOMEM;
+		result = v->result;
+		pthread_mutex_unlock(&v->lock);
+
+		result.mset = mset;
+		v->callback(v, DPFP_VERIFY_DECISION, &result, v->user_data);
+		if (mset)
+			dpfp_mset_free(mset);
+
+		pthread_mutex_lock(&v->lock);
+		v->busy = 0;
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	return NULL;
+}
+
+static void verify_free(struct dpfp_verify *v)
+{
+	if (v->own_background)
+		dpfp_background_disable(v->dev);
+	else if (v->dev->background)
+		dpfp_background_enable(v->dev, v->saved_flags);
+	if (v->fp)
+		dpfp_fprint_free(v->fp);
+	if (v->mask)
+		dpfp_fprint_free(v->mask);
+	if (v->direction)
+		dpfp_ffield_free(v->direction);
+	if (v->frequency)
+		dpfp_ffield_free(v->frequency);
+	if (v->mset)
+		dpfp_mset_free(v->mset);
+	free(v->templates);
+	pthread_cond_destroy(&v->cond);
+	pthread_mutex_destroy(&v->lock);
+	free(v);
+}
+
+/* Start verifying every touch on dev against num_templates minutiae sets,
+ * which are copied. A touch matches if its best score reaches threshold.
+ * The finger should be away from the sensor when the session starts, as
+ * the base image is taken from the device background model. The session
+ * adds DPFP_BG_AUTO_SUBTRACT to the model's flags, or enables the model
+ * with it, and puts things back as they were when it stops. A touch while
+ * the model has no valid base is not matched but reported as
+ * DPFP_VERIFY_ERROR with -EAGAIN.
+ *
+ * The callback runs on the session's threads. For each touch it gets
+ * DPFP_VERIFY_DECISION as soon as the touch has been matched, then
+ * DPFP_VERIFY_LIFT with the complete timeline. DPFP_VERIFY_ERROR reports a
+ * failed capture, which skips that touch, or a failure to control the
+ * sensor, which ends the session. */
+struct dpfp_verify *dpfp_verify_start(struct dpfp_dev *dev,
+	struct dpfp_mset *templates, int num_templates, float threshold,
+	dpfp_verify_cb callback, void *user_data)
+{
+	struct dpfp_verify *v;
+	int r;
+
+	if (num_templates < 0 || callback == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	v = malloc(sizeof(*v));
+	if (v == NULL)
+		return NULL;
+
+	memset(v, 0, sizeof(*v));
+	v->dev = dev;
+	v->num_templates = num_templates;
+	v->threshold = threshold;
+	v->callback = callback;
+	v->user_data = user_data;
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->cond, NULL);
+
+	if (num_templates > 0) {
+		v->templates = malloc(num_templates * sizeof(*templates));
+		if (v->templates == NULL)
+			goto err;
+		memcpy(v->templates, templates,
+			num_templates * sizeof(*templates));
+	}
+
+	v->fp = dpfp_fprint_alloc();
+	v->mask = dpfp_fprint_alloc();
+	v->direction = dpfp_ffield_alloc();
+	v->frequency = dpfp_ffield_alloc();
+	v->mset = dpfp_mset_alloc();
+	if (!v->fp || !v->mask || !v->direction || !v->frequency || !v->mset)
+		goto err;
+
+	v->own_background = dev->background == NULL;
+	v->saved_flags = dpfp_background_get_flags(dev);
+	r = dpfp_background_enable(dev, v->saved_flags | DPFP_BG_AUTO_SUBTRACT);
+	if (r < 0) {
+		v->own_background = 0;
+		goto err;
+	}
+
+	r = pthread_create(&v->process_thread, NULL, process_thread, v);
+	if (r != 0)
+		goto err;
+
+	r = pthread_create(&v->device_thread, NULL, device_thread, v);
+	if (r != 0) {
+		pthread_mutex_lock(&v->lock);
+		v->stop = 1;
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+		pthread_join(v->process_thread, NULL);
+		goto err;
+	}
+
+	return v;
+
+err:
+	verify_free(v);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* End the session. The device thread notices within a second, or once the
+ * frame it is capturing has arrived. */
+void dpfp_verify_stop(struct dpfp_verify *v)
+{
+	pthread_mutex_lock(&v->lock);
+	v->stop = 1;
+	pthread_cond_broadcast(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+
+	pthread_join(v->device_thread, NULL);
+	pthread_join(v->process_thread, NULL);
+	verify_free(v);
+}
@@ -0,0 +1,358 @@
+/*
+ * Device watchdog
+ *
+ *    Copyright (C) 2006 Daniel Drake <dsd@gentoo.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Readers occasionally wedge after they have been opened: transfers start
+ * timing out, interrupts stop coming, or hwstat shows the sensor has lost
+ * scan power (the 0x85 state dpfp_open works around is one of these). The
+ * watchdog checks each device it is given every so often:
+ *  - the transport counts failed transfers, and interrupts the device
+ *    should have sent but did not, in a row, which the watchdog compares
+ *    to the policy. Timeouts the application asked for by choosing a
+ *    short timeout, or by waiting for a finger, do not count.
+ *  - if the policy asks for it, it reads hwstat, which should have 0x80
+ *    clear for as long as the device is open. That costs a control
+ *    transfer per device per check, so it is off by default.
+ *
+ * A wedged device is recovered on a thread of its own, by power-cycling
+ * the sensor through hwstat and powering it up again as dpfp_open does,
+ * authenticating URU4000Bg2 devices again, then restoring the last mode.
+ * The watchdog thread meanwhile goes on checking the other devices, and
+ * their captures are never held up.
+ *
+ * Recovery waits for captures and mode changes in flight on the device,
+ * and holds new ones back until it is done (see dpfp_recover). An
+ * application reading the interrupt endpoint itself (rather than through
+ * a listener) may still take the interrupt the power-up waits for. How
+ * long each recovery took goes into the device telemetry. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "dpfp.h"
+#include "dpfp_private.h"
+
+#define WD_MAX_DEVICES	64
+
+#define DEFAULT_INTERVAL	1000
+#define DEFAULT_TRANSFERS	3
+#define DEFAULT_IRQ_TIMEOUTS	0
+#define DEFAULT_PROBE		0
+#define DEFAULT_ATTEMPTS	5
+
+struct wd_device {
+	struct dpfp_watchdog *wd;
+	struct dpfp_dev *dev;
+	/* a recovery thread is running */
+	int recovering;
+	/* recovery gave up; the device is no longer checked */
+	int failed;
+	enum dpfp_wedge_reason reason;
+	uint64_t since;
+};
+
+struct dpfp_watchdog {
+	struct dpfp_watchdog_policy policy;
+	dpfp_watchdog_cb callback;
+	void *user_data;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+
+	struct wd_device *devices[WD_MAX_DEVICES];
+	int num_devices;
+};
+
+void dpfp_watchdog_policy_init(struct dpfp_watchdog_policy *policy)
+{
+	policy->interval = DEFAULT_INTERVAL;
+	policy->transfers = DEFAULT_TRANSFERS;
+	policy->irq_timeouts = DEFAULT_IRQ_TIMEOUTS;
+	policy->probe = DEFAULT_PROBE;
+	policy->attempts = DEFAULT_ATTEMPTS;
+}
+
+static void notify(struct wd_device *wdev, enum dpfp_watchdog_event event,
+	int status)
+{
+	struct dpfp_watchdog *wd = wdev->wd;
+
+	if (wd->callback)
+		wd->callback(wd, wdev->dev, event, wdev->reason, status,
+			wd->user_data);
+}
+
+static void *recovery_thread(void *arg)
+{
+	struct wd_device *wdev = arg;
+	struct dpfp_watchdog *wd = wdev->wd;
+	struct dpfp_dev *dev = wdev->dev;
+	int r = -EIO;
+	int i;
+
+	for (i = 0; i < wd->policy.attempts; i++) {
+		if (i > 0)
+			usleep(wd->policy.interval * 1000);
+		if (__atomic_load_n(&dev->unplugged, __ATOMIC_RELAXED)) {
+			r = -ENODEV;
+			break;
+		}
+
+		dbgf(DBG_INFO, "recovering %s, attempt %d", dev->path, i + 1);
+		r = dpfp_recover(dev);
+		if (r >= 0)
+			break;
+	}
+
+	if (r >= 0) {
+		/* the failures which got us here are history */
+		__atomic_store_n(&dev->stalls, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&dev->irq_stalls, 0, __ATOMIC_RELAXED);
+		dpfp_telemetry_record(&dev->telemetry.recovery, wdev->since);
+		TELEMETRY_INC(dev, recoveries);
+		dbgf(DBG_INFO, "recovered %s", dev->path);
+		notify(wdev, DPFP_WATCHDOG_RECOVERED, 0);
+	} else {
+		TELEMETRY_INC(dev, failed_recoveries);
+		dbgf(DBG_ERR, "giving up on %s (%d)", dev->path, r);
+		notify(wdev, DPFP_WATCHDOG_FAILED, r);
+	}
+
+	pthread_mutex_lock(&wd->lock);
+	wdev->recovering = 0;
+	wdev->failed = r < 0;
+	pthread_cond_broadcast(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+	return NULL;
+}
+
+/* Returns 1 and sets *reason if dev looks wedged */
+static int check(struct dpfp_watchdog *wd, struct dpfp_dev *dev,
+	enum dpfp_wedge_reason *reason)
+{
+	unsigned char status;
+	int r;
+
+	if (__atomic_load_n(&dev->stalls, __ATOMIC_RELAXED)
+			>= wd->policy.transfers) {
+		*reason = DPFP_WEDGE_TRANSFERS;
+		return 1;
+	}
+
+	if (wd->policy.irq_timeouts > 0
+			&& __atomic_load_n(&dev->irq_stalls, __ATOMIC_RELAXED)
+				>= wd->policy.irq_timeouts) {
+		*reason = DPFP_WEDGE_IRQ;
+		return 1;
+	}
+
+	if (wd->policy.probe) {
+		r = dpfp_get_hwstat(dev, &status);
+		if (r < 0 || (status & 0x80)) {
+			*reason = DPFP_WEDGE_HWSTAT;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void *watchdog_thread(void *arg)
+{
+	struct dpfp_watchdog *wd = arg;
+	struct wd_device *wdev;
+	struct timespec ts;
+	struct timeval tv;
+	pthread_attr_t attr;
+	pthread_t thread;
+	enum dpfp_wedge_reason reason;
+	int i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&wd->lock);
+	while (!wd->stop) {
+		for (i = 0; i < wd->num_devices && !wd->stop; i++) {
+			wdev = wd->devices[i];
+			if (wdev->recovering || wdev->failed
+					|| __atomic_load_n(&wdev->dev->unplugged,
+						__ATOMIC_RELAXED))
+				continue;
+
+			/* a wedged device may take a while to answer the
+			 * probe; add and remove must not wait for that */
+			wdev->recovering = 1;
+			pthread_mutex_unlock(&wd->lock);
+			if (check(wd, wdev->dev, &reason)) {
+				dbgf(DBG_WARN, "%s wedged (%d)",
+					wdev->dev->path, reason);
+				wdev->reason = reason;
+				wdev->since = dpfp_telemetry_now();
+				TELEMETRY_INC(wdev->dev, wedges);
+				notify(wdev, DPFP_WATCHDOG_WEDGED, 0);
+				if (pthread_create(&thread, &attr,
+						recovery_thread, wdev) == 0) {
+					pthread_mutex_lock(&wd->lock);
+					continue;
+				}
+			}
+			pthread_mutex_lock(&wd->lock);
+			wdev->recovering = 0;
+			pthread_cond_broadcast(&wd->cond);
+		}
+
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec + wd->policy.interval / 1000;
+		ts.tv_nsec = tv.tv_usec * 1000
+			+ (wd->policy.interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (!wd->stop)
+			pthread_cond_timedwait(&wd->cond, &wd->lock, &ts);
+	}
+	pthread_mutex_unlock(&wd->lock);
+
+	pthread_attr_destroy(&attr);
+	return NULL;
+}
+
+/* Start a watchdog which checks its devices as often as policy says, or
+ * the defaults if NULL. callback, which may be NULL, is told about wedges
+ * and how their recovery went, from the watchdog and recovery threads. */
+struct dpfp_watchdog *dpfp_watchdog_start(
+	const struct dpfp_watchdog_policy *policy, dpfp_watchdog_cb callback,
+	void *user_data)
+{
+	struct dpfp_watchdog *wd;
+
+	wd = malloc(sizeof(*wd));
+	if (wd == NULL)
+		return NULL;
+
+	memset(wd, 0, sizeof(*wd));
+	if (policy)
+		wd->policy = *policy;
+	else
+		dpfp_watchdog_policy_init(&wd->policy);
+	if (wd->policy.interval <= 0 || wd->policy.transfers <= 0
+			|| wd->policy.attempts <= 0) {
+		free(wd);
+		errno = EINVAL;
+		return NULL;
+	}
+	wd->callback = callback;
+	wd->user_data = user_data;
+	pthread_mutex_init(&wd->lock, NULL);
+	pthread_cond_init(&wd->cond, NULL);
+
+	if (pthread_create(&wd->thread, NULL, watchdog_thread, wd) != 0) {
+		pthread_cond_destroy(&wd->cond);
+		pthread_mutex_destroy(&wd->lock);
+		free(wd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return wd;
+}
+
+/* Start watching dev. Devices must be removed before they are closed. */
+int dpfp_watchdog_add(struct dpfp_watchdog *wd, struct dpfp_dev *dev)
+{
+	struct wd_device *wdev;
+	int r = 0;
+
+	wdev = malloc(sizeof(*wdev));
+	if (wdev == NULL)
+		return -ENOMEM;
+
+	memset(wdev, 0, sizeof(*wdev));
+	wdev->wd = wd;
+	wdev->dev = dev;
+
+	pthread_mutex_lock(&wd->lock);
+	if (wd->num_devices < WD_MAX_DEVICES)
+		wd->devices[wd->num_devices++] = wdev;
+	else
+		r = -ENOSPC;
+	pthread_mutex_unlock(&wd->lock);
+
+	if (r < 0)
+		free(wdev);
+	return r;
+}
+
+/* Stop watching dev, waiting for a recovery in progress to finish */
+void dpfp_watchdog_remove(struct dpfp_watchdog *wd, struct dpfp_dev *dev)
+{
+	struct wd_device *wdev = NULL;
+	int i;
+
+	pthread_mutex_lock(&wd->lock);
+	for (i = 0; i < wd->num_devices; i++)
+		if (wd->devices[i]->dev == dev)
+			break;
+
+	if (i < wd->num_devices) {
+		wdev = wd->devices[i];
+		while (wdev->recovering)
+			pthread_cond_wait(&wd->cond, &wd->lock);
+		/* the list may have moved while we waited */
+		for (i = 0; wd->devices[i] != wdev; i++)
+			;
+		wd->devices[i] = wd->devices[--wd->num_devices];
+	}
+	pthread_mutex_unlock(&wd->lock);
+
+	free(wdev);
+}
+
+/* Stop the watchdog, waiting for recoveries in progress to finish. The
+ * devices are left open. */
+void dpfp_watchdog_stop(struct dpfp_watchdog *wd)
+{
+	int i;
+
+	pthread_mutex_lock(&wd->lock);
+	wd->stop = 1;
+	pthread_cond_broadcast(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+	pthread_join(wd->thread, NULL);
+
+	pthread_mutex_lock(&wd->lock);
+	for (i = 0; i < wd->num_devices; i++) {
+		while (wd->devices[i]->recovering)
+			pthread_cond_wait(&wd->cond, &wd->lock);
+		free(wd->devices[i]);
+	}
+	pthread_mutex_unlock(&wd->lock);
+
+	pthread_cond_destroy(&wd->cond);
+	pthread_mutex_destroy(&wd->lock);
+	free(wd);
+}